@@ -1,166 +1,887 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// client_search() --- miner that searches the keyspace leases handed out by server()
+//
+// the MD5 engine is the widest one that was compiled and that the cpu supports (AVX-512, AVX2 or AVX), and the
+// number of worker threads is the number of cpus the process may use (affinity mask and cgroup cpu quota)
+//
+// the worker threads never touch the socket: each one pushes the coins it finds, as (template id, candidate index)
+// hits, into its own lock-free single-producer single-consumer ring, and a dedicated I/O thread drains the rings,
+// frames the coins and the heartbeat into a bounded output buffer and sends it with one non-blocking send() per
+// tick; when the socket does not keep up (or there is no connection) the coins that do not fit are appended to
+// CLIENT_SPOOL_FILE, so the hash loop never waits for the network or the disk
+//
+// with CLIENT_COMPACT_REPORTS the coins of a template received on the current connection are reported with
+// MSG_HITS (12 bytes per coin, rebuilt by the server); other coins, and the spool, use MSG_COINS (52 bytes)
+//
+// a coin handed to the server is kept in memory until a MSG_COINS_ACK says that it is durable in the server journal
+// (or was rejected); when the connection is lost the leases are dropped (the server reissues them), the coins not
+// acknowledged are spooled, and new connections are attempted with exponential backoff; the spool is replayed
+// (and then emptied) after the next successful hello, so also the coins left over by a previous run are delivered
+//
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <omp.h>
 #include "search_utilities.h"
 #include "md5_cpu_avx.h"
+#include "deti_coins_protocol.h"
+#include "telemetry.h"
 
 #ifndef CLIENT_AVX
 #define CLIENT_AVX
 
-#define SERVER_IP "127.0.0.1"
+#define SERVER_IP "127.0.0.1" // Default server address
 
 // unit --> seconds
 
-#define NUMBER_THREADS 2 // Consider the available resources of the server
-#if NUMBER_THREADS < 1
-    #error "NUMBER_THREADS must be 1 or greater"
+#define MAX_CLIENT_THREADS 64
+#define MAX_CLIENT_LANES 16u // Lanes of the widest engine
+#define CLIENT_MAX_LEASES 2 // Leases held at the same time (the one being searched and the next one)
+#define CLIENT_SLICE_SIZE (1ul << 16) // Candidates searched between two looks at the clock
+#define CLIENT_HIT_RING_SIZE 64u // Coins each worker can have waiting for the I/O thread (a power of two)
+#define CLIENT_OUTPUT_SIZE (8u * (PROTOCOL_HEADER_SIZE + PROTOCOL_MAX_PAYLOAD)) // Bytes of frames waiting for the socket
+#define CLIENT_IO_TICK 100 // Milliseconds between two passes of the I/O thread
+#define CLIENT_CONNECT_TIMEOUT 2 // Seconds allowed for a connection attempt
+#define CLIENT_MAX_BACKOFF 60 // Max seconds between two connection attempts
+#define CLIENT_SPOOL_FILE "deti_coins_client_spool.txt" // Coins not yet delivered to the server (52-byte records)
+#define CLIENT_MAX_TEMPLATES 4 // Templates remembered by the I/O thread (to rebuild the coins of the hits)
+#define CLIENT_COMPACT_REPORTS 1 // Report the coins with MSG_HITS instead of MSG_COINS when possible
+#define CLIENT_ACK_TIMEOUT 5 // Seconds allowed at the end for the server to acknowledge the last coins
+
+//
+// MD5 engines (all of them take and produce interleaved data, see md5_cpu_avx.h)
+//
+
+typedef struct {
+    const char *name;
+    u32_t n_lanes;
+    int (*supported)(void);
+    void (*md5)(u32_t *interleaved_data, u32_t *interleaved_hash);
+} client_engine_t;
+
+#ifdef MD5_CPU_AVX512
+static int client_avx512_supported(void) { return __builtin_cpu_supports("avx512f"); }
+static void client_md5_avx512(u32_t *data, u32_t *hash) { md5_cpu_avx512((v16si *)data, (v16si *)hash); }
+#endif
+#ifdef MD5_CPU_AVX2
+static int client_avx2_supported(void) { return __builtin_cpu_supports("avx2"); }
+static void client_md5_avx2(u32_t *data, u32_t *hash) { md5_cpu_avx2((v8si *)data, (v8si *)hash); }
 #endif
+static int client_avx_supported(void) { return __builtin_cpu_supports("avx"); }
+static void client_md5_avx(u32_t *data, u32_t *hash) { md5_cpu_avx((v4si *)data, (v4si *)hash); }
 
-#define VAR1_IDX_CLIENT_AVX 6 
-#if VAR1_IDX_CLIENT_AVX < 6
-    #error "VAR1_IDX_CLIENT_AVX must be 6 or greater"
+static const client_engine_t client_engines[] = { // widest first
+#ifdef MD5_CPU_AVX512
+    { "avx512", 16u, client_avx512_supported, client_md5_avx512 },
 #endif
-#define VAR2_IDX_CLIENT_AVX 9
-#if VAR2_IDX_CLIENT_AVX < 6
-    #error "VAR2_IDX_CLIENT_AVX must be 6 or greater"
+#ifdef MD5_CPU_AVX2
+    { "avx2", 8u, client_avx2_supported, client_md5_avx2 },
 #endif
+    { "avx", 4u, client_avx_supported, client_md5_avx },
+};
 
+static const client_engine_t *client_select_engine(void) {
+    for (u32_t i = 0; i < sizeof(client_engines) / sizeof(client_engines[0]) - 1u; i++)
+        if (client_engines[i].supported())
+            return &client_engines[i];
+    return &client_engines[sizeof(client_engines) / sizeof(client_engines[0]) - 1u]; // md5_cpu_avx() is the baseline
+}
+
+//
+// state shared by the worker threads and the I/O thread
+//
+
+// Per-thread attempt counters, each one on its own cache line (read by the I/O thread)
 typedef struct {
-    u32_t total_n_coins;
-    u64_t total_n_attempts;
-} search_result_t;
-
-void client_search(u32_t server_port, u32_t search_time) {
-    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_fd < 0) {
-        perror("Failed to create socket");
-        exit(1);
+    volatile u64_t n_attempts;
+    char padding[64 - sizeof(u64_t)];
+} client_counter_t;
+
+static client_counter_t client_counters[MAX_CLIENT_THREADS] __attribute__((aligned(64)));
+
+// A coin found by a worker: candidate index of a template
+typedef struct {
+    u32_t template_id;
+    u64_t index;
+} client_hit_t;
+
+// Coins found by one worker: a lock-free ring written only by the worker and read only by the I/O thread
+// (head and tail are free-running counters, each one on its own cache line); the coins that find the ring
+// full wait in the overflow array, which only the worker touches while it runs
+typedef struct {
+    u32_t head; // coins pushed (written by the worker)
+    char padding1[64 - sizeof(u32_t)];
+    u32_t tail; // coins popped (written by the I/O thread)
+    char padding2[64 - sizeof(u32_t)];
+    client_hit_t hits[CLIENT_HIT_RING_SIZE];
+    u32_t n_overflow;
+    client_hit_t overflow[CLIENT_HIT_RING_SIZE];
+} client_hit_ring_t;
+
+static client_hit_ring_t client_hit_rings[MAX_CLIENT_THREADS] __attribute__((aligned(64)));
+
+// Leases received from the server (protected by client_leases_mutex)
+typedef struct {
+    keyspace_lease_t lease;
+    int active;           // the lease is being searched
+    int revoked;          // the server gave the lease to another client: hand out no more chunks, do not ack it
+    u64_t n_chunks;       // chunks of the lease
+    u64_t next_chunk;     // next chunk to hand out to a worker
+    u64_t done_chunks;    // chunks completed from the start of the lease (contiguous)
+    u08_t chunk_done[KEYSPACE_MAX_LEASE_CHUNKS];
+} client_lease_t;
+
+static client_lease_t client_leases[CLIENT_MAX_LEASES];
+static pthread_mutex_t client_leases_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Work handed to a worker: one chunk of a lease
+typedef struct {
+    u32_t slot, lease_id, template_id;
+    u64_t first, count;
+    u32_t template[13];
+} client_chunk_t;
+
+// A template received from the server (only used by the I/O thread)
+typedef struct {
+    u32_t template_id;
+    int current;       // received on the current connection (its hits can be reported with MSG_HITS)
+    u32_t words[13];
+} client_template_t;
+
+// Connection to the server (only used by the I/O thread, except stop)
+static struct {
+    const char *host;
+    u32_t port;
+    u32_t n_threads;
+    const client_engine_t *engine;
+    int stop;                 // set (atomically) when the workers are done
+    int fd;                   // -1 while disconnected
+    int lease_requested;      // a MSG_LEASE_REQUEST is waiting for its answer
+    time_t backoff;           // seconds to wait after a failed connection attempt
+    time_t next_attempt;      // time of the next connection attempt
+    time_t last_heartbeat;
+    u32_t n_coins;            // coins taken from the rings
+    u32_t n_templates;
+    client_template_t templates[CLIENT_MAX_TEMPLATES];
+    u64_t attempts_at_hello;  // the counters sent to the server are relative to the hello of the connection
+    u32_t coins_at_hello;
+    u08_t *unacked;           // ring buffer of the coins handed to the server but not yet acknowledged
+    u32_t unacked_head, n_unacked, unacked_capacity;
+    u32_t coins_kept;         // coins handed to the server on this connection (MSG_COINS_ACK counts the same way)
+    u32_t coins_acked;
+    u32_t n_input;
+    u32_t n_output;           // bytes of whole frames in output[]
+    u32_t n_output_sent;      // bytes of output[] already handed to the kernel
+    u08_t input[PROTOCOL_HEADER_SIZE + PROTOCOL_MAX_PAYLOAD];
+    u08_t output[CLIENT_OUTPUT_SIZE];
+} client = { .fd = -1, .backoff = 1 };
+
+static int client_take_chunk(client_chunk_t *chunk) {
+    int found = 0;
+
+    pthread_mutex_lock(&client_leases_mutex);
+    for (u32_t slot = 0; slot < CLIENT_MAX_LEASES && !found; slot++) {
+        client_lease_t *l = &client_leases[slot];
+        if (!l->active || l->revoked || l->next_chunk >= l->n_chunks)
+            continue;
+        chunk->slot = slot;
+        chunk->lease_id = l->lease.lease_id;
+        chunk->template_id = l->lease.template_id;
+        chunk->first = l->lease.first + l->next_chunk * KEYSPACE_CHUNK_SIZE;
+        chunk->count = (l->lease.count - l->next_chunk * KEYSPACE_CHUNK_SIZE < KEYSPACE_CHUNK_SIZE) ?
+                       l->lease.count - l->next_chunk * KEYSPACE_CHUNK_SIZE : KEYSPACE_CHUNK_SIZE;
+        memcpy(chunk->template, l->lease.template, sizeof(chunk->template));
+        l->next_chunk++;
+        found = 1;
     }
+    pthread_mutex_unlock(&client_leases_mutex);
+    return found;
+}
 
-    struct sockaddr_in server_addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(server_port),
-    };
-    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+static void client_chunk_done(const client_chunk_t *chunk) {
+    pthread_mutex_lock(&client_leases_mutex);
+    client_lease_t *l = &client_leases[chunk->slot];
+    if (l->active && l->lease.lease_id == chunk->lease_id) {
+        l->chunk_done[(chunk->first - l->lease.first) / KEYSPACE_CHUNK_SIZE] = 1;
+        while (l->done_chunks < l->n_chunks && l->chunk_done[l->done_chunks])
+            l->done_chunks++;
+    }
+    pthread_mutex_unlock(&client_leases_mutex);
+}
 
-    if (connect(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Failed to connect to server");
-        exit(1);
+//
+// hit rings
+//
+
+// Worker side: push a hit (returns -1 if the ring is full)
+static int client_ring_push(client_hit_ring_t *ring, const client_hit_t *hit) {
+    u32_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == CLIENT_HIT_RING_SIZE)
+        return -1;
+    ring->hits[head % CLIENT_HIT_RING_SIZE] = *hit;
+    __atomic_store_n(&ring->head, head + 1u, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Worker side: move the overflow hits to the ring, as far as there is room
+static void client_ring_retry(client_hit_ring_t *ring) {
+    u32_t i = 0u;
+
+    while (i < ring->n_overflow && client_ring_push(ring, &ring->overflow[i]) == 0)
+        i++;
+    memmove(ring->overflow, &ring->overflow[i], (ring->n_overflow - i) * sizeof(ring->overflow[0]));
+    ring->n_overflow -= i;
+}
+
+// Worker side: hand a coin to the I/O thread without ever waiting for it
+static void client_report_coin(u32_t thread, u32_t template_id, u64_t index) {
+    client_hit_ring_t *ring = &client_hit_rings[thread];
+    client_hit_t hit = { .template_id = template_id, .index = index };
+
+    if (ring->n_overflow > 0u)
+        client_ring_retry(ring);
+    if (ring->n_overflow == 0u && client_ring_push(ring, &hit) == 0)
+        return;
+    if (ring->n_overflow < CLIENT_HIT_RING_SIZE)
+        ring->overflow[ring->n_overflow++] = hit;
+    else
+        fprintf(stderr, "client_search: thread %u cannot keep up with its coins, coin %lu of template %08x dropped\n",
+                thread, index, template_id);
+}
+
+// I/O thread side: pop up to max_hits hits of all the rings (and, once the workers are done, of their overflow arrays)
+static u32_t client_collect_hits(client_hit_t *hits, u32_t max_hits, int workers_done) {
+    u32_t n = 0u;
+
+    for (u32_t thread = 0u; thread < client.n_threads; thread++) {
+        client_hit_ring_t *ring = &client_hit_rings[thread];
+        u32_t tail = ring->tail, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (; tail != head && n < max_hits; tail++)
+            hits[n++] = ring->hits[tail % CLIENT_HIT_RING_SIZE];
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        for (; workers_done && ring->n_overflow > 0u && n < max_hits; ring->n_overflow--)
+            hits[n++] = ring->overflow[ring->n_overflow - 1u];
     }
+    client.n_coins += n;
+    return n;
+}
 
-    // Receive mandatory prefix from server for DETI coin: client_id to be inserted into the coin
-    // client_id --> 5 random characters
-    char prefix[6] = {0};
-    if (recv(sock_fd, prefix, sizeof(prefix) - 1, 0) <= 0) {
-        perror("Failed to receive prefix");
-        close(sock_fd);
-        exit(1);
+//
+// templates (I/O thread)
+//
+
+static client_template_t *client_find_template(u32_t template_id) {
+    for (u32_t i = 0u; i < client.n_templates; i++)
+        if (client.templates[i].template_id == template_id)
+            return &client.templates[i];
+    return NULL;
+}
+
+static void client_remember_template(const keyspace_lease_t *lease) {
+    client_template_t *t = client_find_template(lease->template_id);
+
+    if (t == NULL) {
+        if (client.n_templates < CLIENT_MAX_TEMPLATES)
+            t = &client.templates[client.n_templates++];
+        else
+            t = &client.templates[lease->lease_id % CLIENT_MAX_TEMPLATES]; // any of them (only old hits are lost)
+        t->template_id = lease->template_id;
+        memcpy(t->words, lease->template, sizeof(t->words));
     }
-    prefix[5] = '\0'; // Null-terminate
-    printf("Received prefix: '%s'\n", prefix);
+    t->current = 1;
+}
 
-    u32_t total_n_coins = 0;      // Total number of DETI coins found
-    u64_t total_n_attempts = 0;   // Total number of attempts
+// Rebuild the coin of a hit (returns -1 if its template is not known)
+static int client_hit_coin(const client_hit_t *hit, u08_t *coin) {
+    client_template_t *t = client_find_template(hit->template_id);
+    u32_t words[13];
 
-    time_t start_time = time(NULL);
+    if (t == NULL) {
+        fprintf(stderr, "client_search: coin %lu of the forgotten template %08x lost\n", hit->index, hit->template_id);
+        return -1;
+    }
+    keyspace_make_coin(t->words, hit->index, words);
+    memcpy(coin, words, PROTOCOL_COIN_SIZE);
+    return 0;
+}
 
-    // Parallel region with reduction for total_n_coins and total_n_attempts
-    #pragma omp parallel reduction(+:total_n_coins, total_n_attempts) num_threads(NUMBER_THREADS)
-    {
-        u32_t n_coins = 0;        // Coins found by this thread
-        u64_t n_attempts = 0;     // Attempts made by this thread
-        u32_t lane, idx;   
-        coin_t coins[4]; 
-        u32_t interleaved_data[13u * 4u] __attribute__((aligned(16)));
-        u32_t interleaved_hash[ 4u * 4u] __attribute__((aligned(16)));
-
-        u32_t var1 = 0x20202020;  
-        u32_t var2 = 0x20202020;
-
-        // Initialize DETI coins with the client_id, lane number and thread number
-        // prefix (10) + client_id (5) + lane_number (1) + thread_number (1)
-        for (lane = 0u; lane < 4u; lane++) {
-            initialize_deti_coin(&coins[lane]);
-            insert_text_into_coin_at(&coins[lane], prefix, 10); // Insert client_id
-            coins[lane].coin_as_chars[10u + 5u] = '0' + (char)lane; // Insert the lane number
-            coins[lane].coin_as_chars[10u + 5u + 1u] = '0' + (char)omp_get_thread_num(); // Insert the thread number
+//
+// spool of the coins that could not be delivered (I/O thread)
+//
+
+static void client_spool_coins(const u08_t *coins, u32_t n_coins) {
+    FILE *fp;
+
+    if (n_coins == 0u)
+        return;
+    if ((fp = fopen(CLIENT_SPOOL_FILE, "a")) == NULL ||
+        fwrite(coins, PROTOCOL_COIN_SIZE, n_coins, fp) != n_coins ||
+        fclose(fp) != 0) {
+        fprintf(stderr, "client_search: unable to update the spool file \"" CLIENT_SPOOL_FILE "\"; %u coin%s lost\n",
+                n_coins, (n_coins == 1u) ? "" : "s");
+        return;
+    }
+    printf("Spooled %u coin%s to \"" CLIENT_SPOOL_FILE "\"\n", n_coins, (n_coins == 1u) ? "" : "s");
+}
+
+//
+// coins waiting for a MSG_COINS_ACK (I/O thread)
+//
+
+// Remember a coin handed to the server (in the order of the frames)
+static void client_keep_coin(const u08_t *coin) {
+    if (client.n_unacked == client.unacked_capacity) {
+        // Grow the ring buffer (unwrapping it)
+        u32_t new_capacity = (client.unacked_capacity == 0u) ? 1024u : 2u * client.unacked_capacity;
+        u08_t *unacked = malloc((size_t)new_capacity * PROTOCOL_COIN_SIZE);
+        if (unacked == NULL) {
+            fprintf(stderr, "client_keep_coin: out of memory\n");
+            exit(1);
         }
+        for (u32_t i = 0u; i < client.n_unacked; i++)
+            memcpy(&unacked[i * PROTOCOL_COIN_SIZE],
+                   &client.unacked[((client.unacked_head + i) % client.unacked_capacity) * PROTOCOL_COIN_SIZE], PROTOCOL_COIN_SIZE);
+        free(client.unacked);
+        client.unacked = unacked;
+        client.unacked_head = 0u;
+        client.unacked_capacity = new_capacity;
+    }
+    memcpy(&client.unacked[((client.unacked_head + client.n_unacked) % client.unacked_capacity) * PROTOCOL_COIN_SIZE], coin,
+           PROTOCOL_COIN_SIZE);
+    client.n_unacked++;
+    client.coins_kept++;
+}
 
-        // Search for DETI coins
-        for (n_attempts = 0ul; time(NULL) - start_time < search_time; n_attempts+=4u) {
-            
-            // Insert the var1 and var2 to try different combinations
-            for (lane = 0u; lane < 4u; lane++) {
-                coins[lane].coin_as_ints[VAR1_IDX_CLIENT_AVX] = var1;
-                coins[lane].coin_as_ints[VAR2_IDX_CLIENT_AVX] = var2;
-                for (idx = 0u; idx < 13u; idx++) {
-                    interleaved_data[4u * idx + lane] = coins[lane].coin_as_ints[idx];
-                }
+// Forget the coins covered by a MSG_COINS_ACK
+static void client_coins_acked(u32_t n_acked) {
+    u32_t n = n_acked - client.coins_acked;
+
+    if (n_acked > client.coins_kept || n_acked < client.coins_acked) {
+        fprintf(stderr, "client_search: unexpected ack of %u coins ignored\n", n_acked);
+        return;
+    }
+    client.unacked_head = (client.n_unacked == n) ? 0u : (client.unacked_head + n) % client.unacked_capacity;
+    client.n_unacked -= n;
+    client.coins_acked = n_acked;
+}
+
+// Spool the coins not acknowledged (their frames may never reach the server) and empty the output buffer
+static void client_spool_unacked(void) {
+    while (client.n_unacked > 0u) {
+        u32_t n = client.unacked_capacity - client.unacked_head;
+        if (n > client.n_unacked)
+            n = client.n_unacked;
+        client_spool_coins(&client.unacked[client.unacked_head * PROTOCOL_COIN_SIZE], n);
+        client.unacked_head = (client.unacked_head + n) % client.unacked_capacity;
+        client.n_unacked -= n;
+    }
+    client.unacked_head = 0u;
+    client.coins_kept = client.coins_acked = 0u;
+    client.n_output = client.n_output_sent = 0u;
+}
+
+// Send the spooled coins and empty the spool (returns -1 on a send failure; the spool is then kept as is)
+static int client_replay_spool(int sock_fd) {
+    u08_t payload[PROTOCOL_MAX_PAYLOAD];
+    u32_t n, n_replayed = 0u;
+    FILE *fp;
+
+    if ((fp = fopen(CLIENT_SPOOL_FILE, "r")) == NULL)
+        return 0;
+    while ((n = (u32_t)fread(&payload[4], PROTOCOL_COIN_SIZE, PROTOCOL_MAX_COINS, fp)) > 0u) { // a partial record is ignored
+        put_u32(payload, n);
+        if (protocol_send(sock_fd, MSG_COINS, payload, 4u + n * PROTOCOL_COIN_SIZE) < 0) {
+            fclose(fp);
+            client.n_unacked = client.coins_kept = 0u; // they are still in the spool
+            return -1;
+        }
+        for (u32_t i = 0u; i < n; i++)
+            client_keep_coin(&payload[4u + i * PROTOCOL_COIN_SIZE]);
+        n_replayed += n;
+    }
+    fclose(fp);
+    if (truncate(CLIENT_SPOOL_FILE, 0) != 0)
+        perror("client_search: unable to empty the spool file");
+    if (n_replayed > 0u)
+        printf("Replayed %u spooled coin%s\n", n_replayed, (n_replayed == 1u) ? "" : "s");
+    return 0;
+}
+
+//
+// output buffer (I/O thread): whole frames, sent with as few send() calls as possible
+//
+
+// Append a frame (returns -1 if there is no room for it)
+static int client_queue_frame(u32_t type, const u08_t *payload, u32_t length) {
+    if (client.n_output_sent > 0u && client.n_output + PROTOCOL_HEADER_SIZE + length > CLIENT_OUTPUT_SIZE) {
+        // drop the frames already sent (a partially sent frame stays)
+        u32_t offset = 0u, type_, length_;
+        while (offset < client.n_output) {
+            protocol_get_header(&client.output[offset], &type_, &length_);
+            if (offset + PROTOCOL_HEADER_SIZE + length_ > client.n_output_sent)
+                break;
+            offset += PROTOCOL_HEADER_SIZE + length_;
+        }
+        memmove(client.output, &client.output[offset], client.n_output - offset);
+        client.n_output -= offset;
+        client.n_output_sent -= offset;
+    }
+    if (client.n_output + PROTOCOL_HEADER_SIZE + length > CLIENT_OUTPUT_SIZE)
+        return -1;
+    protocol_put_header(&client.output[client.n_output], type, length);
+    if (length > 0u)
+        memcpy(&client.output[client.n_output + PROTOCOL_HEADER_SIZE], payload, length);
+    client.n_output += PROTOCOL_HEADER_SIZE + length;
+    return 0;
+}
+
+// Hand as much of the output as possible to the kernel (returns -1 on a socket error)
+static int client_send_output(void) {
+    while (client.n_output_sent < client.n_output) {
+        ssize_t n = send(client.fd, &client.output[client.n_output_sent], client.n_output - client.n_output_sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return 0;
+        if (n <= 0)
+            return -1;
+        client.n_output_sent += (u32_t)n;
+    }
+    client.n_output = client.n_output_sent = 0u;
+    return 0;
+}
+
+//
+// connection management (I/O thread)
+//
+
+static u64_t client_total_attempts(void) {
+    u64_t n_attempts = 0;
+
+    for (u32_t thread = 0; thread < client.n_threads; thread++)
+        n_attempts += client_counters[thread].n_attempts;
+    return n_attempts;
+}
+
+// Open a TCP connection to host:port, giving up after CLIENT_CONNECT_TIMEOUT seconds (returns -1 on failure)
+static int client_open_socket(const char *host, u32_t port) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *addresses, *a;
+    char service[16];
+    int sock_fd = -1, error, flags;
+    socklen_t error_size = sizeof(error);
+
+    snprintf(service, sizeof(service), "%u", port);
+    if ((error = getaddrinfo(host, service, &hints, &addresses)) != 0) {
+        fprintf(stderr, "client_search: %s: %s\n", host, gai_strerror(error));
+        return -1;
+    }
+    for (a = addresses; a != NULL && sock_fd < 0; a = a->ai_next) {
+        if ((sock_fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol)) < 0)
+            continue;
+        flags = fcntl(sock_fd, F_GETFL, 0);
+        (void)fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK);
+        if (connect(sock_fd, a->ai_addr, a->ai_addrlen) < 0) {
+            struct pollfd pfd = { .fd = sock_fd, .events = POLLOUT };
+            if (errno != EINPROGRESS || poll(&pfd, 1, 1000 * CLIENT_CONNECT_TIMEOUT) != 1 ||
+                getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &error, &error_size) < 0 || error != 0) {
+                close(sock_fd);
+                sock_fd = -1;
+                continue;
             }
+        }
+        (void)fcntl(sock_fd, F_SETFL, flags); // the hello and the spool replay use blocking sends
+    }
+    freeaddrinfo(addresses);
+    return sock_fd;
+}
 
-            // Compute MD5 hashes using AVX
-            md5_cpu_avx((v4si *)interleaved_data, (v4si *)interleaved_hash);
+// Drop the connection and the leases (the server reissues them); coins are spooled until the next connection
+static void client_disconnect(const char *reason) {
+    fprintf(stderr, "client_search: %s; reconnecting in %ld second%s\n", reason, (long)client.backoff,
+            (client.backoff == 1) ? "" : "s");
+    client_spool_unacked();
+    close(client.fd);
+    client.fd = -1;
+    client.next_attempt = time(NULL) + client.backoff;
+    pthread_mutex_lock(&client_leases_mutex);
+    for (u32_t slot = 0; slot < CLIENT_MAX_LEASES; slot++)
+        client_leases[slot].active = 0; // a worker still searching one of its chunks finds the lease gone
+    pthread_mutex_unlock(&client_leases_mutex);
+}
 
-            // Check hashes for trailing zeros
-            for (lane = 0u; lane < 4u; lane++) {
-                u32_t hash[4u];
-                for (idx = 0u; idx < 4u; idx++) {
-                    hash[idx] = interleaved_hash[4u * idx + lane];
-                }
+// Connect, say hello (the server answers with the first lease) and replay the spool (returns -1 on failure)
+static int client_connect(void) {
+    u08_t payload[8];
 
-                if (hash[3] == 0x00000000){
-                    // Send the coin to the server
-                    if (send(sock_fd, coins[lane].coin_as_ints, sizeof(coins[lane].coin_as_ints), 0) < 0) {
-                        perror("Failed to send coin");
-                    }
-                    n_coins++;
-                    //printf("Thread %d: Found DETI coin in lane %u: %s\n",
-                    //    omp_get_thread_num(), lane, coins[lane].coin_as_chars);
+    if ((client.fd = client_open_socket(client.host, client.port)) < 0) {
+        fprintf(stderr, "client_search: unable to connect to %s:%u; next attempt in %ld second%s\n", client.host, client.port,
+                (long)client.backoff, (client.backoff == 1) ? "" : "s");
+        client.next_attempt = time(NULL) + client.backoff;
+        client.backoff = (2 * client.backoff < CLIENT_MAX_BACKOFF) ? 2 * client.backoff : CLIENT_MAX_BACKOFF;
+        return -1;
+    }
+    client.n_input = 0;
+    client.n_output = client.n_output_sent = 0u;
+    client.lease_requested = 0;
+    for (u32_t i = 0u; i < client.n_templates; i++)
+        client.templates[i].current = 0; // the hits of older templates are reported with MSG_COINS
+    client.attempts_at_hello = client_total_attempts();
+    client.coins_at_hello = client.n_coins;
+    client.last_heartbeat = time(NULL);
+    put_u32(&payload[0], client.n_threads);
+    put_u32(&payload[4], client.engine->n_lanes);
+    if (protocol_send(client.fd, MSG_HELLO, payload, 8) < 0 || client_replay_spool(client.fd) < 0) {
+        client_disconnect("hello failed");
+        return -1;
+    }
+    printf("Connected to %s:%u\n", client.host, client.port);
+    fflush(stdout);
+    client.backoff = 1;
+    return 0;
+}
+
+// Queue a heartbeat (or the final result) with the lease acks
+static void client_queue_progress(u32_t type) {
+    u08_t payload[PROTOCOL_PROGRESS_SIZE(CLIENT_MAX_LEASES)];
+    u32_t n_acks = 0, finished[CLIENT_MAX_LEASES], n_finished = 0;
+
+    put_u64(&payload[0], client_total_attempts() - client.attempts_at_hello);
+    put_u32(&payload[8], client.n_coins - client.coins_at_hello);
+    pthread_mutex_lock(&client_leases_mutex);
+    for (u32_t slot = 0; slot < CLIENT_MAX_LEASES; slot++) {
+        client_lease_t *l = &client_leases[slot];
+        if (!l->active)
+            continue;
+        if (!l->revoked) {
+            u64_t done = l->done_chunks * KEYSPACE_CHUNK_SIZE;
+            put_u32(&payload[16 + 12 * n_acks], l->lease.lease_id);
+            put_u64(&payload[20 + 12 * n_acks], (done < l->lease.count) ? done : l->lease.count);
+            n_acks++;
+        }
+        if (l->revoked || l->done_chunks == l->n_chunks)
+            finished[n_finished++] = slot; // completed or revoked
+    }
+    pthread_mutex_unlock(&client_leases_mutex);
+    put_u32(&payload[12], n_acks);
+    if (client_queue_frame(type, payload, PROTOCOL_PROGRESS_SIZE(n_acks)) < 0)
+        return; // the final acks go with a later heartbeat
+    client.last_heartbeat = time(NULL);
+    pthread_mutex_lock(&client_leases_mutex);
+    for (u32_t i = 0; i < n_finished; i++)
+        client_leases[finished[i]].active = 0; // acknowledged now
+    pthread_mutex_unlock(&client_leases_mutex);
+}
+
+// Handle a frame sent by the server
+static void client_process_message(u32_t type, const u08_t *payload, u32_t length) {
+    if (type == MSG_LEASE && length == PROTOCOL_LEASE_SIZE) {
+        keyspace_lease_t lease;
+        u32_t slot;
+        protocol_get_lease(payload, &lease);
+        client.lease_requested = 0;
+        client_remember_template(&lease);
+        pthread_mutex_lock(&client_leases_mutex);
+        for (slot = 0; slot < CLIENT_MAX_LEASES && client_leases[slot].active; slot++)
+            ;
+        if (slot < CLIENT_MAX_LEASES && lease.count <= KEYSPACE_LEASE_SIZE) {
+            client_lease_t *l = &client_leases[slot];
+            l->lease = lease;
+            l->revoked = 0;
+            l->n_chunks = (lease.count + KEYSPACE_CHUNK_SIZE - 1) / KEYSPACE_CHUNK_SIZE;
+            l->next_chunk = l->done_chunks = 0;
+            memset(l->chunk_done, 0, sizeof(l->chunk_done));
+            l->active = 1;
+            printf("Received lease %u: %lu candidates starting at %lu\n", lease.lease_id, lease.count, lease.first);
+        } else {
+            fprintf(stderr, "client_search: unexpected lease %u ignored\n", lease.lease_id);
+        }
+        pthread_mutex_unlock(&client_leases_mutex);
+    } else if (type == MSG_COINS_ACK && length == 4) {
+        client_coins_acked(get_u32(payload));
+    } else if (type == MSG_REVOKE && length == 4) {
+        u32_t lease_id = get_u32(payload);
+        pthread_mutex_lock(&client_leases_mutex);
+        for (u32_t slot = 0; slot < CLIENT_MAX_LEASES; slot++)
+            if (client_leases[slot].active && client_leases[slot].lease.lease_id == lease_id)
+                client_leases[slot].revoked = 1;
+        pthread_mutex_unlock(&client_leases_mutex);
+        printf("Lease %u revoked by the server\n", lease_id);
+    } else {
+        fprintf(stderr, "client_search: unexpected message of type %u and length %u\n", type, length);
+    }
+}
+
+// Read and handle the frames sent by the server (returns -1 if the connection must be dropped)
+static int client_receive(void) {
+    u32_t type, length, used = 0;
+    ssize_t n;
+
+    while ((n = recv(client.fd, &client.input[client.n_input], sizeof(client.input) - client.n_input, MSG_DONTWAIT)) > 0)
+        client.n_input += (u32_t)n;
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        return -1;
+    while (client.n_input - used >= PROTOCOL_HEADER_SIZE) {
+        if (protocol_get_header(&client.input[used], &type, &length) < 0)
+            return -1;
+        if (client.n_input - used < PROTOCOL_HEADER_SIZE + length)
+            break;
+        client_process_message(type, &client.input[used + PROTOCOL_HEADER_SIZE], length);
+        used += PROTOCOL_HEADER_SIZE + length;
+    }
+    memmove(client.input, &client.input[used], client.n_input - used);
+    client.n_input -= used;
+    return 0;
+}
+
+// Ask for one more lease when a slot is free and the work at hand runs low
+static void client_request_lease(void) {
+    u32_t n_free = 0;
+    u64_t n_chunks_left = 0;
+
+    pthread_mutex_lock(&client_leases_mutex);
+    for (u32_t slot = 0; slot < CLIENT_MAX_LEASES; slot++)
+        if (!client_leases[slot].active)
+            n_free++;
+        else if (!client_leases[slot].revoked)
+            n_chunks_left += client_leases[slot].n_chunks - client_leases[slot].next_chunk;
+    pthread_mutex_unlock(&client_leases_mutex);
+    if (n_free > 0 && !client.lease_requested && n_chunks_left < KEYSPACE_MAX_LEASE_CHUNKS / 2u &&
+        client_queue_frame(MSG_LEASE_REQUEST, NULL, 0) == 0)
+        client.lease_requested = 1;
+}
+
+// Queue (or, when there is no connection or no room, spool) the coins of some hits; returns the number of frames queued
+static u32_t client_queue_hits(const client_hit_t *hits, u32_t n_hits) {
+    u08_t coins[4u + PROTOCOL_MAX_COINS * PROTOCOL_COIN_SIZE], compact[4u + PROTOCOL_MAX_HITS * PROTOCOL_HIT_SIZE];
+    u32_t n_coins = 0u, n_compact = 0u, n_frames = 0u;
+
+    for (u32_t i = 0u; i < n_hits; i++) {
+        client_template_t *t = client_find_template(hits[i].template_id);
+        if (CLIENT_COMPACT_REPORTS && client.fd >= 0 && t != NULL && t->current) {
+            put_u32(&compact[4u + n_compact * PROTOCOL_HIT_SIZE], hits[i].template_id);
+            put_u64(&compact[8u + n_compact * PROTOCOL_HIT_SIZE], hits[i].index);
+            n_compact++;
+        } else if (client_hit_coin(&hits[i], &coins[4u + n_coins * PROTOCOL_COIN_SIZE]) == 0) {
+            n_coins++;
+        }
+    }
+    if (n_compact > 0u) {
+        int queued;
+        put_u32(compact, n_compact);
+        queued = (client_queue_frame(MSG_HITS, compact, 4u + n_compact * PROTOCOL_HIT_SIZE) == 0);
+        n_frames += (u32_t)queued;
+        for (u32_t i = 0u; i < n_compact; i++) { // keep them until acknowledged or, when there is no room, spool them
+            client_hit_t hit = { .template_id = get_u32(&compact[4u + i * PROTOCOL_HIT_SIZE]),
+                                 .index = get_u64(&compact[8u + i * PROTOCOL_HIT_SIZE]) };
+            u08_t coin[PROTOCOL_COIN_SIZE];
+            if (client_hit_coin(&hit, coin) != 0)
+                continue;
+            if (queued)
+                client_keep_coin(coin);
+            else
+                client_spool_coins(coin, 1u);
+        }
+    }
+    if (n_coins > 0u) {
+        put_u32(coins, n_coins);
+        if (client.fd >= 0 && client_queue_frame(MSG_COINS, coins, 4u + n_coins * PROTOCOL_COIN_SIZE) == 0) {
+            n_frames++;
+            for (u32_t i = 0u; i < n_coins; i++)
+                client_keep_coin(&coins[4u + i * PROTOCOL_COIN_SIZE]);
+        } else {
+            client_spool_coins(&coins[4], n_coins);
+        }
+    }
+    return n_frames;
+}
+
+// The I/O thread: every CLIENT_IO_TICK milliseconds (or when the server sends something) it collects the coins
+// of the workers, queues them with a heartbeat when one is due, and sends the output buffer
+static void *client_io_thread(void *arg) {
+    client_hit_t hits[PROTOCOL_MAX_COINS];
+    int done;
+
+    (void)arg;
+    do {
+        u32_t n_hits, n_frames = 0u;
+
+        done = __atomic_load_n(&client.stop, __ATOMIC_ACQUIRE);
+        if (client.fd < 0 && !done && time(NULL) >= client.next_attempt)
+            (void)client_connect();
+
+        // Coins: to the output buffer while there is a connection and room, to the spool otherwise
+        while ((n_hits = client_collect_hits(hits, PROTOCOL_MAX_COINS, done)) > 0u)
+            n_frames += client_queue_hits(hits, n_hits);
+        if (client.fd < 0) {
+            usleep(1000 * CLIENT_IO_TICK);
+            continue;
+        }
+
+        // Lease requests and heartbeats share the send() of the coins
+        if (!done)
+            client_request_lease();
+        if (done)
+            client_queue_progress(MSG_RESULT);
+        else if (n_frames > 0u || time(NULL) - client.last_heartbeat >= PROTOCOL_HEARTBEAT_PERIOD)
+            client_queue_progress(MSG_PROGRESS);
+        if (done) {
+            // last words: wait for the socket to take everything, then for the server to acknowledge the coins
+            int flags = fcntl(client.fd, F_GETFL, 0);
+            time_t deadline = time(NULL) + CLIENT_ACK_TIMEOUT;
+            (void)fcntl(client.fd, F_SETFL, flags & ~O_NONBLOCK);
+            if (send_all(client.fd, &client.output[client.n_output_sent], client.n_output - client.n_output_sent) < 0)
+                perror("Failed to send result");
+            else
+                while (client.coins_acked != client.coins_kept && time(NULL) < deadline) {
+                    struct pollfd pfd = { .fd = client.fd, .events = POLLIN };
+                    if (poll(&pfd, 1, CLIENT_IO_TICK) > 0 && client_receive() < 0)
+                        break;
                 }
-            }
+            client_spool_unacked();
+            break;
+        }
+        if (client_send_output() < 0) {
+            client_disconnect("connection to the server lost");
+            continue;
+        }
+
+        struct pollfd pfd = { .fd = client.fd, .events = POLLIN | ((client.n_output > 0u) ? POLLOUT : 0) };
+        if (poll(&pfd, 1, CLIENT_IO_TICK) > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR)) && client_receive() < 0)
+            client_disconnect("connection to the server lost");
+    } while (!done);
+    return NULL;
+}
+
+//
+// search
+//
+
+// Search count candidates of a template starting at candidate first (count is a multiple of the number of lanes)
+static u32_t client_search_slice(u32_t thread, const client_chunk_t *chunk, u64_t first, u64_t count) {
+    const client_engine_t *engine = client.engine;
+    u32_t interleaved_data[13u * MAX_CLIENT_LANES] __attribute__((aligned(64)));
+    u32_t interleaved_hash[ 4u * MAX_CLIENT_LANES] __attribute__((aligned(64)));
+    u32_t n_lanes = engine->n_lanes, lane, idx, n_coins = 0u;
+    u32_t var1 = keyspace_word(first % KEYSPACE_WORD_SIZE);
+    u32_t var2 = keyspace_word(first / KEYSPACE_WORD_SIZE);
 
-            // Update var1 and var2
+    for (lane = 0u; lane < n_lanes; lane++)
+        for (idx = 0u; idx < 13u; idx++)
+            interleaved_data[n_lanes * idx + lane] = chunk->template[idx];
+    for (u64_t batch = 0u; batch < count / n_lanes; batch++) {
+        // lane k of a batch gets the k-th next candidate
+        for (lane = 0u; lane < n_lanes; lane++) {
+            interleaved_data[n_lanes * KEYSPACE_VAR1_WORD + lane] = var1;
+            interleaved_data[n_lanes * KEYSPACE_VAR2_WORD + lane] = var2;
             var1 = next_ascii_code(var1);
             if (var1 == 0x20202020) {
                 var2 = next_ascii_code(var2);
             }
         }
 
+        engine->md5(interleaved_data, interleaved_hash);
+        cross_check_batch(thread, n_lanes, interleaved_data, interleaved_hash); // sampled check against md5_cpu()
+
+        // Check hashes for trailing zeros
+        for (lane = 0u; lane < n_lanes; lane++) {
+            if ((interleaved_hash[n_lanes * 3u + lane] & telemetry_near_miss_mask) == 0u) { // a near miss (all hits are near misses)
+                telemetry_near_miss(thread);
+                if ((interleaved_hash[n_lanes * 3u + lane] & deti_coin_hit_mask) == 0u) {
+                    DETI_PROBE4(hit, thread, lane, telemetry.mode, first + batch * n_lanes + lane);
+                    client_report_coin(thread, chunk->template_id, first + batch * n_lanes + lane);
+                    n_coins++;
+                }
+            }
+        }
+    }
+    return n_coins;
+}
+
+void client_search(const char *host, u32_t server_port, u32_t search_time) {
+    u32_t total_n_coins = 0;      // Total number of DETI coins found
+    u64_t total_n_attempts = 0;   // Total number of attempts
+    pthread_t io_thread;
+
+    client.host = (host != NULL) ? host : SERVER_IP;
+    client.port = server_port;
+    client.engine = client_select_engine();
+    client.n_threads = usable_cpu_count();
+    if (client.n_threads > MAX_CLIENT_THREADS)
+        client.n_threads = MAX_CLIENT_THREADS;
+    printf("Client: %u threads using md5_cpu_%s() (%u lanes)\n", client.n_threads, client.engine->name, client.engine->n_lanes);
+    fflush(stdout);
+    if (pthread_create(&io_thread, NULL, client_io_thread, NULL) != 0) {
+        perror("Failed to create the I/O thread");
+        exit(1);
+    }
+
+    time_t start_time = time(NULL);
+
+    telemetry_start("client_search", client.n_threads);
+    // Parallel region with reduction for total_n_coins and total_n_attempts
+    #pragma omp parallel reduction(+:total_n_coins, total_n_attempts) num_threads(client.n_threads)
+    {
+        u32_t n_coins = 0;        // Coins found by this thread
+        u64_t n_attempts = 0;     // Attempts made by this thread
+        u32_t thread = (u32_t)omp_get_thread_num();
+        client_chunk_t chunk;
+        u64_t done;
+
+        while (stop_request == 0 && time(NULL) - start_time < search_time) {
+            if (!client_take_chunk(&chunk)) {
+                usleep(1000); // waiting for a lease
+                continue;
+            }
+
+            // Search the chunk one slice at a time; now and then check the time
+            for (done = 0u; done < chunk.count; done += CLIENT_SLICE_SIZE) {
+                u64_t count = (chunk.count - done < CLIENT_SLICE_SIZE) ? chunk.count - done : CLIENT_SLICE_SIZE;
+                n_coins += client_search_slice(thread, &chunk, chunk.first + done, count);
+                n_attempts += count;
+                client_counters[thread].n_attempts = n_attempts;
+                telemetry_count(thread, n_attempts, n_coins);
+                if (client_hit_rings[thread].n_overflow > 0u)
+                    client_ring_retry(&client_hit_rings[thread]);
+                if (stop_request != 0 || time(NULL) - start_time >= search_time)
+                    break;
+            }
+            if (done >= chunk.count)
+                client_chunk_done(&chunk); // an interrupted chunk is not acknowledged (the server reissues it)
+        }
+
         // Reduction is handled by the OpenMP reduction clause
         total_n_coins += n_coins;
         total_n_attempts += n_attempts;
     }
 
-    // Send results to server
-    search_result_t result = {
-        .total_n_coins = total_n_coins,
-        .total_n_attempts = total_n_attempts,
-    };
+    // The I/O thread sends the remaining coins and the final results to server (or keeps the coins in the spool)
+    __atomic_store_n(&client.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(io_thread, NULL);
+    telemetry_stop();
 
-    
-    // Combine result and end signal into a single buffer
-    char message_buffer[sizeof(search_result_t) + 1];
-    memcpy(message_buffer, &result, sizeof(search_result_t));
-    message_buffer[sizeof(search_result_t)] = 0; // End signal
-
-    // Send the combined buffer
-    ssize_t bytes_sent = send(sock_fd, message_buffer, sizeof(message_buffer), 0);
-    if (bytes_sent < 0) {
-        perror("Failed to send result and end signal");
-    } else {
-        printf("Sent %zd bytes\n", bytes_sent);
-    }
-    
-    printf("Client - deti_coins_cpu_avx_openmp_search: Found %u DETI coin%s in %lu attempt%s (expected %.2f coins)\n",
+    printf("Client - md5_cpu_%s: Found %u DETI coin%s in %lu attempt%s (expected %.2f coins)\n",
+        client.engine->name,
         total_n_coins, (total_n_coins == 1) ? "" : "s",
         total_n_attempts, (total_n_attempts == 1) ? "" : "s",
         (double)total_n_attempts / (double)(1ul << 32));
 
     // Close connection
-    shutdown(sock_fd, SHUT_WR);
+    if (client.fd >= 0) {
+        shutdown(client.fd, SHUT_WR);
+        close(client.fd);
+    }
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,283 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// worker placement (cpu side, Linux only; elsewhere the placement is left to the operating system)
+//
+// parse_placement_policy() ---- convert "os", "core" or "smt" into a PLACEMENT_* value
+// setup_worker_placement() ---- read the topology and choose one cpu for each worker (logs the final mapping)
+// pin_worker_thread() --------- pin the calling thread to the cpu chosen for a worker
+// usable_cpu_count() ---------- number of cpus this process may use (affinity mask and cgroup cpu quota)
+//
+
+#ifndef CPU_AFFINITY
+#define CPU_AFFINITY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+# include <sched.h>
+#endif
+
+#define PLACEMENT_OS    0 // do not pin (the operating system decides)
+#define PLACEMENT_CORE  1 // one worker per physical core, SMT siblings are never used
+#define PLACEMENT_SMT   2 // one worker per physical core first, then the SMT siblings
+
+#define MAX_PLACEMENT_CPUS 1024u
+
+static int worker_cpus[MAX_PLACEMENT_CPUS]; // worker_cpus[worker] is the cpu of that worker
+static u32_t n_worker_cpus = 0u;            // 0 means that the workers are not pinned
+
+/**
+ * @brief Converts a placement policy name into a PLACEMENT_* value.
+ *
+ * @param name "os", "core" or "smt" (NULL means "os").
+ * @return The policy, or -1 if the name is not known.
+ */
+static int parse_placement_policy(const char *name) {
+    if (name == NULL || strcmp(name, "os") == 0)
+        return PLACEMENT_OS;
+    if (strcmp(name, "core") == 0)
+        return PLACEMENT_CORE;
+    if (strcmp(name, "smt") == 0)
+        return PLACEMENT_SMT;
+    return -1;
+}
+
+#if defined(__linux__)
+
+//
+// read the first integer of a sysfs/procfs file (returns -1 on failure)
+//
+
+static long read_first_long(const char *file_name) {
+    FILE *fp;
+    long value;
+
+    if ((fp = fopen(file_name, "r")) == NULL)
+        return -1l;
+    if (fscanf(fp, "%ld", &value) != 1)
+        value = -1l;
+    fclose(fp);
+    return value;
+}
+
+//
+// cgroup cpu quota, rounded up to a whole number of cpus (returns 0 when there is no quota)
+//
+// cgroup v2 stores "quota period" (or "max period") in cpu.max; cgroup v1 uses cpu.cfs_quota_us and cpu.cfs_period_us
+// (hybrid hosts have a "0::" line and the v1 cpu controller, so v1 is used when cpu.max does not exist)
+//
+
+static int cgroup_v1_quota(const char *group, long *quota, long *period) {
+    static const char *mounts[] = { "/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu" };
+    char path[768];
+
+    for (u32_t idx = 0u; idx < 4u; idx++) { // our own cgroup first, then the root of each mount point
+        snprintf(path, sizeof(path), "%s%s/cpu.cfs_quota_us", mounts[idx % 2u], (idx < 2u) ? group : "");
+        *quota = read_first_long(path);
+        snprintf(path, sizeof(path), "%s%s/cpu.cfs_period_us", mounts[idx % 2u], (idx < 2u) ? group : "");
+        *period = read_first_long(path);
+        if (*period > 0l) // the files exist (a quota of -1 means no quota)
+            return 1;
+    }
+    return 0;
+}
+
+static u32_t cgroup_cpu_limit(void) {
+    char line[512], path[768], v2_group[512] = "", v1_group[512] = "", *controllers;
+    long quota = -1l, period = -1l;
+    int have_v2 = 0;
+    FILE *fp;
+
+    // locate our own cgroups (v2 entries look like "0::/some/path", v1 entries like "4:cpu,cpuacct:/some/path")
+    if ((fp = fopen("/proc/self/cgroup", "r")) != NULL) {
+        while (fgets(line, (int)sizeof(line), fp) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            if (strncmp(line, "0::", 3) == 0) {
+                snprintf(v2_group, sizeof(v2_group), "%s", &line[3]);
+                have_v2 = 1;
+            } else if ((controllers = strchr(line, ':')) != NULL && strchr(controllers + 1, ':') != NULL) {
+                char *group = strchr(controllers + 1, ':');
+
+                *group++ = '\0';
+                for (char *name = strtok(controllers + 1, ","); name != NULL; name = strtok(NULL, ","))
+                    if (strcmp(name, "cpu") == 0)
+                        snprintf(v1_group, sizeof(v1_group), "%s", group);
+            }
+        }
+        fclose(fp);
+    }
+    fp = NULL;
+    if (have_v2) {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", v2_group);
+        if ((fp = fopen(path, "r")) == NULL)
+            fp = fopen("/sys/fs/cgroup/cpu.max", "r");
+    }
+    if (fp != NULL) {
+        char quota_text[32];
+        if (fscanf(fp, "%31s %ld", quota_text, &period) == 2 && strcmp(quota_text, "max") != 0)
+            quota = atol(quota_text);
+        fclose(fp);
+    } else
+        (void)cgroup_v1_quota(v1_group, &quota, &period);
+    if (quota <= 0l || period <= 0l)
+        return 0u;
+    return (u32_t)((quota + period - 1l) / period);
+}
+
+// The affinity mask inherited by the process (the threads pinned by one placement get it back when a later placement
+// does not pin them; the OpenMP threads are reused from one parallel region to the next)
+static cpu_set_t inherited_cpus;
+static int inherited_cpus_known = 0, some_worker_pinned = 0;
+
+/**
+ * @brief Chooses the cpu of each worker according to the placement policy and logs the final mapping.
+ *
+ * Only the cpus of the inherited affinity mask are used. Physical cores are used first, alternating between
+ * packages; with PLACEMENT_SMT the remaining hardware threads of each core are used afterwards. The number
+ * of workers is capped by the number of usable cpus of the policy and, for every policy (PLACEMENT_OS
+ * included), by the cgroup cpu quota.
+ *
+ * @param policy One of the PLACEMENT_* values.
+ * @param n_threads The number of workers requested.
+ * @return The number of workers that should be used.
+ */
+static u32_t setup_worker_placement(int policy, u32_t n_threads) {
+    static int core_of[MAX_PLACEMENT_CPUS], package_of[MAX_PLACEMENT_CPUS], used[MAX_PLACEMENT_CPUS], rank_of[MAX_PLACEMENT_CPUS];
+    char file_name[128];
+    cpu_set_t mask;
+    u32_t cpu, n_cpus, n, limit, round, rank, max_rank;
+
+    n_worker_cpus = 0u;
+    if (!inherited_cpus_known) {
+        if (sched_getaffinity(0, sizeof(inherited_cpus), &inherited_cpus) != 0) {
+            perror("setup_worker_placement: sched_getaffinity");
+            return n_threads;
+        }
+        inherited_cpus_known = 1;
+    }
+    if (policy == PLACEMENT_OS) { // no pinning, but the cgroup cpu quota still applies
+        limit = cgroup_cpu_limit();
+        if (limit > 0u && n_threads > limit) {
+            printf("worker placement: %u threads requested, but the cgroup cpu quota allows only %u cpu%s; using %u\n",
+                   n_threads, limit, (limit == 1u) ? "" : "s", limit);
+            fflush(stdout);
+            n_threads = limit;
+        }
+        return n_threads;
+    }
+    mask = inherited_cpus;
+
+    // topology of the allowed cpus (the core key is the first cpu of thread_siblings_list)
+    n_cpus = 0u;
+    for (cpu = 0u; cpu < MAX_PLACEMENT_CPUS; cpu++) {
+        used[cpu] = 1;
+        if (!CPU_ISSET(cpu, &mask))
+            continue;
+        snprintf(file_name, sizeof(file_name), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+        core_of[cpu] = (int)read_first_long(file_name);
+        snprintf(file_name, sizeof(file_name), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+        package_of[cpu] = (int)read_first_long(file_name);
+        if (core_of[cpu] < 0)
+            core_of[cpu] = (int)cpu; // no topology information: each cpu is a core
+        used[cpu] = 0;
+        n_cpus++;
+    }
+
+    // one cpu per physical core (round 0), then the SMT siblings (round 1, 2, ...); packages alternate within a round
+    for (round = 0u; n_worker_cpus < n_cpus && (round == 0u || policy == PLACEMENT_SMT); round++) {
+        // rank of each candidate cpu inside its package (the first free hardware thread of each core is a candidate)
+        max_rank = 0u;
+        for (cpu = 0u; cpu < MAX_PLACEMENT_CPUS; cpu++) {
+            u32_t other;
+            rank_of[cpu] = -1;
+            if (used[cpu])
+                continue;
+            for (other = 0u; other < cpu; other++)
+                if (!used[other] && core_of[other] == core_of[cpu])
+                    break;
+            if (other < cpu)
+                continue; // an earlier sibling of this core is the candidate of this round
+            for (rank = 0u, other = 0u; other < cpu; other++)
+                if (rank_of[other] >= 0 && package_of[other] == package_of[cpu])
+                    rank++;
+            rank_of[cpu] = (int)rank;
+            if (rank + 1u > max_rank)
+                max_rank = rank + 1u;
+        }
+        for (rank = 0u; rank < max_rank; rank++)
+            for (cpu = 0u; cpu < MAX_PLACEMENT_CPUS; cpu++)
+                if (rank_of[cpu] == (int)rank) {
+                    worker_cpus[n_worker_cpus++] = (int)cpu;
+                    used[cpu] = 1;
+                }
+    }
+
+    // respect the cgroup quota and the number of usable cpus
+    n = n_worker_cpus;
+    limit = cgroup_cpu_limit();
+    if (limit > 0u && limit < n)
+        n = limit;
+    if (n_threads > n) {
+        printf("worker placement: %u threads requested, but only %u cpu%s usable with the %s policy%s; using %u\n",
+               n_threads, n, (n == 1u) ? " is" : "s are", (policy == PLACEMENT_CORE) ? "core" : "smt",
+               (limit > 0u) ? " and the cgroup cpu quota" : "", n);
+        n_threads = n;
+    }
+    n_worker_cpus = n_threads;
+    for (n = 0u; n < n_worker_cpus; n++)
+        printf("worker placement: worker %2u -> cpu %3d (package %d, core %d)\n",
+               n, worker_cpus[n], package_of[worker_cpus[n]], core_of[worker_cpus[n]]);
+    fflush(stdout);
+    return n_threads;
+}
+
+static u32_t usable_cpu_count(void) {
+    cpu_set_t mask;
+    u32_t n, limit;
+
+    n = (sched_getaffinity(0, sizeof(mask), &mask) == 0) ? (u32_t)CPU_COUNT(&mask) : 1u;
+    limit = cgroup_cpu_limit();
+    if (limit > 0u && limit < n)
+        n = limit;
+    return (n > 0u) ? n : 1u;
+}
+
+static void pin_worker_thread(u32_t worker) {
+    cpu_set_t mask;
+
+    if (n_worker_cpus == 0u) {
+        if (some_worker_pinned) // by an earlier placement
+            (void)sched_setaffinity(0, sizeof(inherited_cpus), &inherited_cpus);
+        return;
+    }
+    some_worker_pinned = 1;
+    CPU_ZERO(&mask);
+    CPU_SET(worker_cpus[worker % n_worker_cpus], &mask);
+    if (sched_setaffinity(0, sizeof(mask), &mask) != 0) // 0 is the calling thread
+        perror("pin_worker_thread: sched_setaffinity");
+}
+
+#else
+
+static u32_t setup_worker_placement(int policy, u32_t n_threads) {
+    if (policy != PLACEMENT_OS)
+        printf("worker placement: not supported on this operating system, the placement is left to it\n");
+    return n_threads;
+}
+
+static void pin_worker_thread(u32_t worker) {
+    (void)worker;
+}
+
+static u32_t usable_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (n > 0l) ? (u32_t)n : 1u;
+}
+
+#endif
+
+#endif
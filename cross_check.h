@@ -0,0 +1,143 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// sampled cross-check of the SIMD MD5 engines against md5_cpu() (configured by telemetry_start(), see telemetry.h)
+//
+// a SIMD engine that computes wrong hashes (a compiler or flag change, a lane-indexing bug) makes a search find no
+// coins while it looks perfectly healthy; so every search thread, after a random number of batches that averages
+// DETI_CROSS_CHECK (default CROSS_CHECK_DEFAULT_PERIOD, 0 disables the check), takes a random lane of the batch it has
+// just hashed, hashes that message again with md5_cpu(), and compares the two hashes
+//
+// a mismatch raises an alarm: a JSON line in the telemetry stream (stderr when the telemetry is off) with the mode, the
+// thread, the lane, the message and both hashes; with DETI_CROSS_CHECK_ACTION=stop it also ends the search (as the end
+// of the search time does, so the coins found are saved); the number of checks and of mismatches goes in the telemetry
+// lines and, when some check failed, in a message at the end of the search
+//
+// between two checks a search thread pays a decrement and a well predicted branch per batch
+//
+// cross_check_configure() ---- read the configuration from the environment (at the start of a search)
+// cross_check_batch() -------- called by a search thread after each call of a SIMD engine
+// cross_check_totals() ------- checks and mismatches of all the threads
+// cross_check_report() ------- complain at the end of a search if some check failed
+//
+
+#ifndef CROSS_CHECK
+#define CROSS_CHECK
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CROSS_CHECK_MAX_THREADS 256
+#define CROSS_CHECK_DEFAULT_PERIOD 65536u // Batches between two checks of a thread, on average
+
+// State of one search thread, on its own cache line
+typedef struct {
+    u64_t countdown; // batches to the next check
+    u64_t random;    // xorshift64 state
+    u64_t n_checks;
+    u64_t n_mismatches;
+} __attribute__((aligned(64))) cross_check_thread_t;
+
+static cross_check_thread_t cross_check_threads[CROSS_CHECK_MAX_THREADS];
+
+static struct {
+    u64_t period; // 0: disabled
+    int stop_on_mismatch;
+    const char *mode;
+    FILE *fp; // where the alarms go (the telemetry stream)
+    struct timespec start;
+} cross_check = { .period = CROSS_CHECK_DEFAULT_PERIOD };
+
+static u64_t cross_check_random(cross_check_thread_t *state) {
+    state->random ^= state->random << 13;
+    state->random ^= state->random >> 7;
+    state->random ^= state->random << 17;
+    return state->random;
+}
+
+// batches to the next check: uniform in 1..2*period-1, so no lane or position of the enumeration is favored
+static u64_t cross_check_gap(cross_check_thread_t *state) {
+    return (cross_check.period == 0u) ? 0xFFFFFFFFFFFFFFFFul : 1u + cross_check_random(state) % (2u * cross_check.period - 1u);
+}
+
+static void cross_check_configure(const char *mode) {
+    const char *period = getenv("DETI_CROSS_CHECK"), *action = getenv("DETI_CROSS_CHECK_ACTION");
+    u64_t seed = (u64_t)time(NULL) ^ ((u64_t)getpid() << 32);
+
+    cross_check.period = (period != NULL) ? strtoul(period, NULL, 0) : CROSS_CHECK_DEFAULT_PERIOD;
+    cross_check.stop_on_mismatch = (action != NULL && strcmp(action, "stop") == 0);
+    if (action != NULL && !cross_check.stop_on_mismatch && strcmp(action, "log") != 0)
+        fprintf(stderr, "cross_check: unknown DETI_CROSS_CHECK_ACTION \"%s\" (log or stop), only logging\n", action);
+    cross_check.mode = mode;
+    cross_check.fp = stderr;
+    clock_gettime(CLOCK_MONOTONIC, &cross_check.start);
+    for (u32_t thread = 0u; thread < CROSS_CHECK_MAX_THREADS; thread++) {
+        cross_check_thread_t *state = &cross_check_threads[thread];
+        state->random = (seed += 0x9E3779B97F4A7C15ul) | 1u; // never zero
+        state->countdown = cross_check_gap(state);
+        state->n_checks = state->n_mismatches = 0u;
+    }
+}
+
+static void __attribute__((noinline, cold)) cross_check_sample(u32_t thread, u32_t n_lanes, const u32_t *data, const u32_t *hash) {
+    cross_check_thread_t *state = &cross_check_threads[thread];
+    u32_t lane = (u32_t)(cross_check_random(state) % n_lanes), idx, message[13], expected[4];
+    struct timespec now;
+    char text[2u * 52u + 1u], *p = text;
+
+    state->countdown = cross_check_gap(state);
+    for (idx = 0u; idx < 13u; idx++)
+        message[idx] = data[n_lanes * idx + lane];
+    md5_cpu(message, expected);
+    __atomic_store_n(&state->n_checks, state->n_checks + 1u, __ATOMIC_RELAXED);
+    if (hash[lane] == expected[0] && hash[n_lanes + lane] == expected[1] && hash[2u * n_lanes + lane] == expected[2] &&
+        hash[3u * n_lanes + lane] == expected[3])
+        return;
+
+    // the alarm (the message is escaped for JSON; the bytes of a coin are printable ASCII or '\n')
+    __atomic_store_n(&state->n_mismatches, state->n_mismatches + 1u, __ATOMIC_RELAXED);
+    for (idx = 0u; idx < 52u; idx++) {
+        char c = ((const char *)message)[idx];
+        if (c == '"' || c == '\\' || c == '\n')
+            *p++ = '\\';
+        *p++ = (c == '\n') ? 'n' : (c < ' ' || c > '~') ? '?' : c;
+    }
+    *p = '\0';
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(cross_check.fp, "{\"t\":%.3f,\"cross_check\":\"mismatch\",\"mode\":\"%s\",\"thread\":%u,\"lane\":%u,\"lanes\":%u,"
+            "\"message\":\"%s\",\"engine\":\"%08x%08x%08x%08x\",\"md5_cpu\":\"%08x%08x%08x%08x\"%s}\n",
+            (double)(now.tv_sec - cross_check.start.tv_sec) + 1.0e-9 * (double)(now.tv_nsec - cross_check.start.tv_nsec),
+            (cross_check.mode != NULL) ? cross_check.mode : "", thread, lane, n_lanes, text, hash[lane], hash[n_lanes + lane],
+            hash[2u * n_lanes + lane], hash[3u * n_lanes + lane], expected[0], expected[1], expected[2], expected[3],
+            cross_check.stop_on_mismatch ? ",\"action\":\"stop\"" : "");
+    fflush(cross_check.fp);
+    if (cross_check.stop_on_mismatch)
+        stop_request = 1;
+}
+
+// data and hash: the interleaved messages and hashes of the batch just hashed (word idx of lane k at n_lanes * idx + k)
+static inline void cross_check_batch(u32_t thread, u32_t n_lanes, const u32_t *data, const u32_t *hash) {
+    if (thread < CROSS_CHECK_MAX_THREADS && __builtin_expect(--cross_check_threads[thread].countdown == 0u, 0))
+        cross_check_sample(thread, n_lanes, data, hash);
+}
+
+static void cross_check_totals(u64_t *n_checks, u64_t *n_mismatches) {
+    *n_checks = *n_mismatches = 0u;
+    for (u32_t thread = 0u; thread < CROSS_CHECK_MAX_THREADS; thread++) {
+        *n_checks += __atomic_load_n(&cross_check_threads[thread].n_checks, __ATOMIC_RELAXED);
+        *n_mismatches += __atomic_load_n(&cross_check_threads[thread].n_mismatches, __ATOMIC_RELAXED);
+    }
+}
+
+static void cross_check_report(void) {
+    u64_t n_checks, n_mismatches;
+
+    cross_check_totals(&n_checks, &n_mismatches);
+    if (n_mismatches > 0u)
+        fprintf(stderr, "cross_check: %s: %lu of %lu sampled hashes differ from md5_cpu(); the SIMD engine is broken, its searches cannot be trusted\n",
+                (cross_check.mode != NULL) ? cross_check.mode : "", n_mismatches, n_checks);
+}
+
+#endif
@@ -6,6 +6,10 @@
 // DETI coins main program (possible solution)
 //
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE // sched_getaffinity() and friends (cpu_affinity.h)
+#endif
+
 #include <time.h>
 #include <stdio.h>
 #include <signal.h>
@@ -44,6 +48,7 @@ typedef unsigned  int u32_t;
 typedef unsigned long u64_t;
 
 #include "cpu_utilities.h"
+#include "cpu_affinity.h"
 
 
 //
@@ -83,6 +88,7 @@ typedef unsigned long u64_t;
 # include "cuda_driver_api_utilities.h"
 # include "md5_cuda.h"
 #endif
+#include "md5_benchmark.h"
 
 static void all_md5_tests(void)
 {
@@ -145,6 +151,8 @@ static void alarm_signal_handler(int dummy)
   stop_request = 1;
 }
 
+#include "telemetry.h"
+
 #include "deti_coins_cpu_search.h"
 #include "deti_coins_cpu_special_search.h"
 
@@ -157,6 +165,7 @@ static void alarm_signal_handler(int dummy)
 #ifdef MD5_CPU_AVX2
 #include "deti_coins_cpu_avx2_search.h"
 #include "deti_coins_cpu_avx2_openmp_search.h"
+#include "deti_coins_cpu_avx2_template_search.h"
 #endif
 #ifdef MD5_CPU_AVX512
 #include "deti_coins_cpu_avx512_search.h"
@@ -170,6 +179,12 @@ static void alarm_signal_handler(int dummy)
 
 #include "client_avx.h"
 #include "server_avx.h"
+#include "load_generator.h"
+#include "relay.h"
+#include "shm_mining.h"
+#include "microbenchmarks.h"
+#include "scaling.h"
+#include "deti_coins_regression.h"
 #define SERVER_PORT "8000"
 
 //
@@ -189,12 +204,60 @@ int main(int argc,char **argv)
     test_next_value_to_try_ascii(); // this will help warming up (turbo boost) the processor!
 #endif
     all_md5_tests();
+    return (regression_tests() == 0) ? 0 : 1;
+  }
+  //
+  // known-answer regression of the search engines only (-k command line option)
+  //
+  if(argc == 2 && argv[1][0] == '-' && argv[1][1] == 'k' && argv[1][2] == '\0')
+    return (regression_tests() == 0) ? 0 : 1;
+  //
+  // benchmark of the MD5 implementations, with hardware performance counters (-b command line option)
+  //
+  if((argc >= 2 && argc <= 6) && argv[1][0] == '-' && argv[1][1] == 'b' && argv[1][2] == '\0')
+  {
+    u32_t n_threads = (argc > 3) ? (u32_t)atol(argv[3]) : 1u;
+    double benchmark_seconds = (argc > 4) ? atof(argv[4]) : 2.0;
+    int placement = parse_placement_policy((argc > 5) ? argv[5] : NULL);
+
+    if(n_threads == 0u || benchmark_seconds <= 0.0 || placement < 0)
+    {
+      fprintf(stderr,"main: bad benchmark arguments --- format -b [implementation] [n_threads] [seconds] [placement]\n");
+      exit(1);
+    }
+    srandom((unsigned int)time(NULL));
+    n_threads = setup_worker_placement(placement,n_threads);
+    md5_benchmark((argc > 2) ? argv[2] : "all",n_threads,benchmark_seconds);
+    return 0;
+  }
+  //
+  // microbenchmarks of the components of the search loops (-m command line option)
+  //
+  if((argc >= 2 && argc <= 4) && argv[1][0] == '-' && argv[1][1] == 'm' && argv[1][2] == '\0')
+  {
+    srandom((unsigned int)time(NULL));
+    microbenchmarks((argc > 2) ? argv[2] : "",(argc > 3) ? (u32_t)atol(argv[3]) : 0u);
+    return 0;
+  }
+  //
+  // thread-scaling study of a multithreaded search engine (-x command line option)
+  //
+  if((argc >= 2 && argc <= 6) && argv[1][0] == '-' && argv[1][1] == 'x' && argv[1][2] == '\0')
+  {
+    seconds = (argc > 3) ? parse_time_duration(argv[3]) : 10u;
+    if(seconds == 0u)
+    {
+      fprintf(stderr,"main: bad number of seconds --- format [Nd][Nh][Nm][N[s]], where each N is a number and [] means whats inside it is optional\n");
+      exit(1);
+    }
+    srandom((unsigned int)time(NULL));
+    scaling_study((argc > 2) ? argv[2] : "avx2_openmp",seconds,(argc > 4) ? argv[4] : "os,core,smt",(argc > 5) ? argv[5] : SCALING_CSV_FILE);
     return 0;
   }
   //
   // search for DETI coins (-s command line option)
   //
-  if((argc >= 2 && argc <= 5) && argv[1][0] == '-' && argv[1][1] == 's')
+  if((argc >= 2 && argc <= 8) && argv[1][0] == '-' && argv[1][1] == 's')
   {
     srandom((unsigned int)time(NULL));
     seconds = (argc > 2) ? parse_time_duration(argv[2]) : 1800u;
@@ -213,6 +276,7 @@ int main(int argc,char **argv)
     stop_request = 0;
     (void)signal(SIGALRM,alarm_signal_handler);
     (void)alarm((unsigned int)seconds);
+    telemetry_end_time = time(NULL) + (time_t)seconds;
     switch(argv[1][2])
     {
       default:
@@ -244,6 +308,12 @@ int main(int argc,char **argv)
         else {
           n_threads = 8; // Default number of threads
         }
+        int placement = parse_placement_policy((argc > 5) ? argv[5] : NULL);
+        if (placement < 0) {
+          fprintf(stderr, "main: unknown placement policy \"%s\" (use os, core or smt)\n", argv[5]);
+          exit(1);
+        }
+        n_threads = setup_worker_placement(placement, n_threads);
         printf("searching for %u seconds, with %u threads, using deti_coins_cpu_avx_openmp_search()\n",seconds, n_threads);
         fflush(stdout);
         deti_coins_cpu_avx_openmp_search(n_random_words, n_threads);
@@ -270,6 +340,12 @@ int main(int argc,char **argv)
         else {
           n_threads = 8; // Default number of threads
         }
+        int placement = parse_placement_policy((argc > 5) ? argv[5] : NULL);
+        if (placement < 0) {
+          fprintf(stderr, "main: unknown placement policy \"%s\" (use os, core or smt)\n", argv[5]);
+          exit(1);
+        }
+        n_threads = setup_worker_placement(placement, n_threads);
         printf("searching for %u seconds, with %u threads, using deti_coins_cpu_avx2_openmp_search()\n", seconds, n_threads);
         fflush(stdout);
         deti_coins_cpu_avx2_openmp_search(n_random_words, n_threads);
@@ -285,24 +361,95 @@ int main(int argc,char **argv)
 #endif
 #ifdef SERVER_AVX
     case '6': {
-        const char *port = (argc > 2) ? argv[2] : SERVER_PORT;
+        const char *port = (argc > 2) ? argv[2] : SERVER_PORT, *backend = NULL;
+        int scratch = 0;
+
+        for (int i = 3; i < argc; i++)
+          if (strcmp(argv[i], "scratch") == 0)
+            scratch = 1;
+          else if (backend == NULL)
+            backend = argv[i];
+          else {
+            fprintf(stderr, "main: bad server arguments --- format -s6 [port] [epoll|io_uring] [scratch]\n");
+            exit(1);
+          }
         printf("Starting server on port %s...\n", port);
         fflush(stdout);
-        server(atoi(port)); 
+        server(atoi(port), backend, scratch);
         break;
     }
 #endif
 #ifdef CLIENT_AVX
     case '7': {
         if (argc < 4) {
-          fprintf(stderr, "main: insufficient arguments for client mode. Expected: -s7 [seconds] [port]\n");
+          fprintf(stderr, "main: insufficient arguments for client mode. Expected: -s7 [seconds] [port] [host]\n");
           exit(1);
         }
 
         const char *port = argv[3];
-        printf("Client connecting to port %s for %u seconds...\n", port, seconds);
+        const char *host = (argc > 4) ? argv[4] : SERVER_IP;
+        printf("Client connecting to %s port %s for %u seconds...\n", host, port, seconds);
         fflush(stdout);
-        client_search(atoi(port), seconds); 
+        client_search(host, atoi(port), seconds); 
+        break;
+    }
+#endif
+#ifdef RELAY
+    case 'c': {
+        if (argc < 4) {
+          fprintf(stderr, "main: insufficient arguments for relay mode. Expected: -sc [port] [upstream port] [upstream host]\n");
+          exit(1);
+        }
+
+        const char *port = argv[2];
+        const char *upstream_port = argv[3];
+        const char *upstream_host = (argc > 4) ? argv[4] : SERVER_IP;
+        printf("Starting relay on port %s for %s port %s...\n", port, upstream_host, upstream_port);
+        fflush(stdout);
+        relay(atoi(port), upstream_host, atoi(upstream_port));
+        break;
+    }
+#endif
+#ifdef LOAD_GENERATOR
+    case 'b': {
+        const char *port = (argc > 3) ? argv[3] : SERVER_PORT;
+        u32_t n_clients = (argc > 4) ? (u32_t)atol(argv[4]) : 1000u;
+        double hit_rate = (argc > 5) ? atof(argv[5]) : 1.0;
+        double heartbeat_rate = (argc > 6) ? atof(argv[6]) : 1.0 / PROTOCOL_HEARTBEAT_PERIOD;
+        int replay_vault = (argc > 7 && strcmp(argv[7], "vault") == 0);
+
+        if (n_clients == 0u) {
+          fprintf(stderr, "main: bad number of connections\n");
+          exit(1);
+        }
+        if (argc > 7 && !replay_vault) {
+          fprintf(stderr, "main: bad load test arguments --- format -sb [seconds] [port] [n_clients] [coins/s] [heartbeats/s] [vault]\n");
+          exit(1);
+        }
+        printf("load test of the server on port %s for %u seconds\n", port, seconds);
+        fflush(stdout);
+        load_generator(atoi(port), n_clients, hit_rate, heartbeat_rate, replay_vault);
+        break;
+    }
+#endif
+#ifdef SHM_MINING
+    case 'd': {
+        const char *name = (argc > 3) ? argv[3] : SHM_DEFAULT_NAME;
+        int force = (argc > 4 && strcmp(argv[4], "force") == 0);
+        if (argc > 4 && !force) {
+          fprintf(stderr, "main: bad coordinator arguments --- format -sd [seconds] [segment] [force]\n");
+          exit(1);
+        }
+        printf("coordinating the workers of segment %s for %u seconds\n", name, seconds);
+        fflush(stdout);
+        shm_coordinator(name, force);
+        break;
+    }
+    case 'e': {
+        const char *name = (argc > 3) ? argv[3] : SHM_DEFAULT_NAME;
+        printf("searching for %u seconds as a worker of segment %s\n", seconds, name);
+        fflush(stdout);
+        shm_worker(name, seconds);
         break;
     }
 #endif
@@ -339,32 +486,81 @@ int main(int argc,char **argv)
         deti_coins_cpu_special_search(special_text);
         break;
     }
+#endif
+#ifdef DETI_COINS_CPU_AVX2_TEMPLATE_SEARCH
+    case 'f': {
+        const char *special_text = (argc > 3) ? argv[3] : "DEFAULT";
+        u32_t offset = (argc > 4) ? (u32_t)atol(argv[4]) : 0u;
+        u32_t n_threads = (argc > 5) ? (u32_t)atol(argv[5]) : usable_cpu_count();
+        int placement = parse_placement_policy((argc > 6) ? argv[6] : NULL);
+
+        if (n_threads == 0u || placement < 0) {
+          fprintf(stderr, "main: bad special search arguments --- format -sf [seconds] [special_text] [offset] [n_threads] [placement]\n");
+          exit(1);
+        }
+        n_threads = setup_worker_placement(placement, n_threads);
+        printf("searching for %u seconds, with %u threads, using deti_coins_cpu_avx2_special_search()\n", seconds, n_threads);
+        printf("Special text: %s (offset %u)\n", special_text, offset);
+        fflush(stdout);
+        deti_coins_cpu_avx2_special_search(special_text, offset, n_threads, (u64_t)time(NULL) ^ ((u64_t)getpid() << 32));
+        break;
+    }
+    case 'g': {
+        const char *template = (argc > 3) ? argv[3] : "";
+        u32_t n_threads = (argc > 4) ? (u32_t)atol(argv[4]) : usable_cpu_count();
+        int placement = parse_placement_policy((argc > 5) ? argv[5] : NULL);
+
+        if (n_threads == 0u || placement < 0) {
+          fprintf(stderr, "main: bad template search arguments --- format -sg [seconds] [template] [n_threads] [placement]\n");
+          exit(1);
+        }
+        n_threads = setup_worker_placement(placement, n_threads);
+        printf("searching for %u seconds, with %u threads, using deti_coins_cpu_avx2_template_search()\n", seconds, n_threads);
+        printf("Template: \"%s\"\n", template);
+        fflush(stdout);
+        deti_coins_cpu_avx2_template_search(template, n_threads, (u64_t)time(NULL) ^ ((u64_t)getpid() << 32));
+        break;
+    }
 #endif
     }
     return 0;
   }
-  fprintf(stderr, "usage: %s -t                                         # MD5 hash tests\n", argv[0]);
+  fprintf(stderr, "usage: %s -t                                         # MD5 hash tests and search engine regression\n", argv[0]);
+  fprintf(stderr, "       %s -k                                         # known-answer regression of the search engines (also run by -t)\n", argv[0]);
+  fprintf(stderr, "       %s -b [implementation] [n_threads] [seconds] [placement] # MD5 benchmark with hardware performance counters\n", argv[0]);
+  fprintf(stderr, "       %s -m [component] [n_samples]                 # microbenchmarks of the components of the search loops\n", argv[0]);
+  fprintf(stderr, "       %s -x [engine] [seconds] [policies] [csv_file] # thread-scaling study (CSV) of avx_openmp, avx2_openmp or pool_avx*\n", argv[0]);
   fprintf(stderr, "       %s -s0 [seconds] [ignored]                    # search for DETI coins using md5_cpu()\n", argv[0]);
 #ifdef DETI_COINS_CPU_AVX_SEARCH
   fprintf(stderr, "       %s -s1 [seconds] [n_random_words]             # search for DETI coins using md5_cpu_avx()\n", argv[0]);
 #endif
 #ifdef DETI_COINS_CPU_AVX_OPENMP_SEARCH
-  fprintf(stderr, "       %s -s2 [seconds] [n_random_words] [n_threads] # search for DETI coins using md5_cpu_avx()\n", argv[0]);
+  fprintf(stderr, "       %s -s2 [seconds] [n_random_words] [n_threads] [placement] # search for DETI coins using md5_cpu_avx()\n", argv[0]);
 #endif
 #ifdef DETI_COINS_CPU_AVX2_SEARCH
   fprintf(stderr, "       %s -s3 [seconds] [n_random_words]             # search for DETI coins using md5_cpu_avx2()\n", argv[0]);
 #endif
 #ifdef DETI_COINS_CPU_AVX2_OPENMP_SEARCH
-  fprintf(stderr, "       %s -s4 [seconds] [n_random_words] [n_threads] # search for DETI coins using md5_cpu_avx2()\n", argv[0]);
+  fprintf(stderr, "       %s -s4 [seconds] [n_random_words] [n_threads] [placement] # search for DETI coins using md5_cpu_avx2()\n", argv[0]);
 #endif
 #ifdef DETI_COINS_CPU_AVX512_SEARCH
   fprintf(stderr, "       %s -s5 [seconds] [n_random_words]             # search for DETI coins using md5_cpu_avx512()\n", argv[0]);
 #endif
 #ifdef SERVER_AVX 
-  fprintf(stderr, "       %s -s6 [port] [ignored]                       # search for DETI coins using server\n", argv[0]);
+  fprintf(stderr, "       %s -s6 [port] [epoll|io_uring] [scratch]      # search for DETI coins using server (scratch: scratch vault)\n", argv[0]);
 #endif
 #ifdef CLIENT_AVX 
-  fprintf(stderr, "       %s -s7 [seconds] [port]                       # search for DETI coins using client with avx\n", argv[0]);
+  fprintf(stderr, "       %s -s7 [seconds] [port] [host]                # search for DETI coins using client (best SIMD engine, all usable cpus)\n", argv[0]);
+#endif
+#ifdef RELAY
+  fprintf(stderr, "       %s -sc [port] [upstream port] [upstream host] # relay between local clients and the server\n", argv[0]);
+#endif
+#ifdef LOAD_GENERATOR
+  fprintf(stderr, "       %s -sb [seconds] [port] [n_clients] [coins/s] [heartbeats/s] [vault] # load test of a local server (simulated clients, no hashing; vault: replay the vault coins, for a scratch server)\n", argv[0]);
+#endif
+#ifdef SHM_MINING
+  fprintf(stderr, "       %s -sd [seconds] [segment] [force]            # coordinator of a shared-memory search (owns the vault)\n", argv[0]);
+  fprintf(stderr, "       %s -se [seconds] [segment]                    # worker process of a shared-memory search\n", argv[0]);
 #endif
 #ifdef DETI_COINS_CPU_NEON_SEARCH
   fprintf(stderr, "       %s -s8 [seconds] [n_random_words]             # search for DETI coins using md5_cpu_neon()\n", argv[0]);
@@ -374,11 +570,18 @@ int main(int argc,char **argv)
 #endif
 #ifdef DETI_COINS_CPU_SPECIAL_SEARCH
   fprintf(stderr, "       %s -s10 [seconds] [special_text]               # special search for DETI coins using md5_cpu()\n", argv[0]);
+#endif
+#ifdef DETI_COINS_CPU_AVX2_TEMPLATE_SEARCH
+  fprintf(stderr, "       %s -sf [seconds] [special_text] [offset] [n_threads] [placement] # special search using md5_cpu_avx2() (text at any offset)\n", argv[0]);
+  fprintf(stderr, "       %s -sg [seconds] [template] [n_threads] [placement] # search for DETI coins matching a template using md5_cpu_avx2()\n", argv[0]);
 #endif
   fprintf(stderr, "                                                     # seconds is the amount of time spent in the search\n");
   fprintf(stderr, "                                                     # n_random_words is the number of 4-byte words to use\n");
   fprintf(stderr, "                                                     # n_threads is the number of 4-byte words to use\n");
+  fprintf(stderr, "                                                     # placement is os (default), core (one thread per physical core) or smt (cores first, then SMT siblings)\n");
   fprintf(stderr, "                                                     # special_text is the text that will be inserted into the DETI coin\n");
+  fprintf(stderr, "                                                     # offset is the position of the special text after \"DETI coin \" (default 0)\n");
+  fprintf(stderr, "                                                     # template is the 41 bytes after \"DETI coin \": c, \\c, ?, . or * (raw bytes), [a-z0-9], [^...], atom{n} (see deti_coins_template.h)\n");
   fprintf(stderr, "                                                     # port is the number of the port the server is going to use\n");
   return 1;
 }
\ No newline at end of file
@@ -25,6 +25,7 @@ void deti_coins_cpu_avx2_openmp_search(u32_t n_random_words, u32_t number_of_thr
 {
     u32_t total_n_coins = 0;      // Total number of DETI coins found
     u64_t total_n_attempts = 0;   // Total number of attempts
+    telemetry_start("deti_coins_cpu_avx2_openmp_search", number_of_threads);
 
     // Parallel region with OpenMP
     #pragma omp parallel reduction(+:total_n_coins, total_n_attempts) shared(stop_request) num_threads(number_of_threads)
@@ -39,6 +40,10 @@ void deti_coins_cpu_avx2_openmp_search(u32_t n_random_words, u32_t number_of_thr
         u32_t var1 = 0x20202020;  // Initial value for var1 (0x20 ASCII space)
         u32_t var2 = 0x20202020;  // Initial value for var2 (0x20 ASCII space)
 
+        // Pin this worker to its cpu (does nothing when the placement is left to the operating system)
+        u32_t thread = (u32_t)omp_get_thread_num();
+        pin_worker_thread(thread);
+
         // Initialize DETI coins with lane and thread information
         for (lane = 0u; lane < 8u; lane++) {
             initialize_deti_coin(&coins[lane]);
@@ -47,7 +52,8 @@ void deti_coins_cpu_avx2_openmp_search(u32_t n_random_words, u32_t number_of_thr
         }
 
         // Search for DETI coins
-        for (n_attempts = 0ul; stop_request == 0; n_attempts += 8u) {
+        for (n_attempts = 0ul; stop_request == 0 && n_attempts < deti_coin_attempts_limit; n_attempts += 8u) {
+            telemetry_count(thread, n_attempts, n_coins);
             // Insert var1 and var2 values into each lane's coin data
             for (lane = 0u; lane < 8u; lane++) {
                 coins[lane].coin_as_ints[VAR1_IDX_AVX2_THREAD] = var1;
@@ -59,6 +65,7 @@ void deti_coins_cpu_avx2_openmp_search(u32_t n_random_words, u32_t number_of_thr
 
             // Compute MD5 hashes using AVX2
             md5_cpu_avx2((v8si *)interleaved_data, (v8si *)interleaved_hash);
+            cross_check_batch(thread, 8u, interleaved_data, interleaved_hash); // sampled check against md5_cpu()
 
             // Check hashes for trailing zeros
             for (lane = 0u; lane < 8u; lane++) {
@@ -67,11 +74,15 @@ void deti_coins_cpu_avx2_openmp_search(u32_t n_random_words, u32_t number_of_thr
                     hash[idx] = interleaved_hash[8u * idx + lane];
                 }
 
-                if (hash[3] == 0){
-                    save_deti_coin(coins[lane].coin_as_ints); // Save valid coin
-                    n_coins++;
-                    //printf("Thread %d: Found DETI coin in lane %u: %s\n",
-                    //    omp_get_thread_num(), lane, coins[lane].coin_as_chars);
+                if ((hash[3] & telemetry_near_miss_mask) == 0u) { // a near miss (all hits are near misses)
+                    telemetry_near_miss(thread);
+                    if ((hash[3] & deti_coin_hit_mask) == 0u){
+                        DETI_PROBE4(hit, thread, lane, telemetry.mode, n_attempts + lane);
+                        save_deti_coin(coins[lane].coin_as_ints); // Save valid coin
+                        n_coins++;
+                        //printf("Thread %d: Found DETI coin in lane %u: %s\n",
+                        //    omp_get_thread_num(), lane, coins[lane].coin_as_chars);
+                    }
                 }
             }
 
@@ -89,6 +100,7 @@ void deti_coins_cpu_avx2_openmp_search(u32_t n_random_words, u32_t number_of_thr
 
     // Save all found DETI coins and print results
     STORE_DETI_COINS();
+    telemetry_stop();
     printf("deti_coins_cpu_avx2_openmp_search: Found %u DETI coin%s in %lu attempt%s (expected %.2f coins)\n",
         total_n_coins, (total_n_coins == 1) ? "" : "s",
         total_n_attempts, (total_n_attempts == 1) ? "" : "s",
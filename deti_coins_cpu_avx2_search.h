@@ -41,7 +41,9 @@ static void deti_coins_cpu_avx2_search(u32_t n_random_words)
     }
 
     // Search for DETI coins
-    for (n_attempts = 0ul; stop_request == 0; n_attempts+=8) {
+    telemetry_start("deti_coins_cpu_avx2_search", 1u);
+    for (n_attempts = 0ul; stop_request == 0 && n_attempts < deti_coin_attempts_limit; n_attempts+=8) {
+        telemetry_count(0u, n_attempts, n_coins);
 
         // Insert the var1 and var2 to try different combinations
         for (lane = 0u; lane < 8u; lane++) {
@@ -54,6 +56,7 @@ static void deti_coins_cpu_avx2_search(u32_t n_random_words)
 
         // Compute MD5 hashes for the interleaved coins using AVX2
         md5_cpu_avx2((v8si *)interleaved_data, (v8si *)interleaved_hash);
+        cross_check_batch(0u, 8u, interleaved_data, interleaved_hash); // sampled check against md5_cpu()
 
         // Check each coin's hash for trailing zeros and determine if it's a DETI coin
         for (lane = 0u; lane < 8u; lane++) {
@@ -62,10 +65,14 @@ static void deti_coins_cpu_avx2_search(u32_t n_random_words)
                 hash[idx] = interleaved_hash[8u * idx + lane];
             }
 
-            if (hash[3] == 0){
-                save_deti_coin(coins[lane].coin_as_ints);  // Save the valid DETI coin
-                n_coins++;
-                printf("Found DETI coin in lane %u: %.*s", lane, (int)sizeof(coins[lane].coin_as_chars), coins[lane].coin_as_chars);
+            if ((hash[3] & telemetry_near_miss_mask) == 0u) { // a near miss (all hits are near misses)
+                telemetry_near_miss(0u);
+                if ((hash[3] & deti_coin_hit_mask) == 0u){
+                    DETI_PROBE4(hit, 0u, lane, telemetry.mode, n_attempts + lane);
+                    save_deti_coin(coins[lane].coin_as_ints);  // Save the valid DETI coin
+                    n_coins++;
+                    printf("Found DETI coin in lane %u: %.*s", lane, (int)sizeof(coins[lane].coin_as_chars), coins[lane].coin_as_chars);
+                }
             }
         }
 
@@ -78,6 +85,7 @@ static void deti_coins_cpu_avx2_search(u32_t n_random_words)
 
     // Save all found DETI coins
     STORE_DETI_COINS();
+    telemetry_stop();
 
     // Print results
     printf("deti_coins_cpu_avx2_search: Found %u DETI coin%s in %lu attempt%s (expected %.2f coins)\n",
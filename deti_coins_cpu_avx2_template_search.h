@@ -0,0 +1,131 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// deti_coins_cpu_avx2_template_search() --- find DETI coins that match a template (see deti_coins_template.h) using
+//                                           md5_cpu_avx2() and OpenMP
+// deti_coins_cpu_avx2_special_search() ---- the same for a special text at any offset (the template ?{offset}text)
+//
+// when the fast word is a plain counter (raw bytes, *{4}) a batch is a single vector add
+//
+// the threads take chunks of up to SPECIAL_CHUNK_SIZE values of the fast word of the plan from a shared counter; chunk
+// k covers the values (k % n_word_chunks) * SPECIAL_CHUNK_SIZE onwards, with slow number k / n_word_chunks, so no
+// candidate is tried twice and the search ends when all of them were tried
+//
+// in a chunk only the fast word changes, so the state after the first steps of the first MD5 round (step i uses word i)
+// is computed once per chunk by md5_cpu_midstate() and each batch does only the remaining 64 - fast word steps with
+// md5_cpu_avx2_from_midstate()
+//
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "search_utilities.h"
+#include "md5_cpu_avx2.h"
+#include "deti_coins_template.h"
+
+#ifndef DETI_COINS_CPU_AVX2_TEMPLATE_SEARCH
+#define DETI_COINS_CPU_AVX2_TEMPLATE_SEARCH
+
+#define SPECIAL_CHUNK_SIZE (1ul << 24) // values of the fast word handed to a thread at a time
+
+typedef u32_t v8su __attribute__ ((vector_size (32))); // eight lanes of the fast word
+
+static void deti_coins_cpu_avx2_template_search(const char *template, u32_t n_threads, u64_t seed)
+{
+    static coin_plan_t plan;
+    u64_t next_chunk = 0u, n_word_chunks, n_chunks, total_n_attempts = 0u, total_n_coins = 0u;
+
+    compile_coin_template(template, &plan);
+    plan_randomize(&plan, seed);
+    print_coin_plan("deti_coins_cpu_avx2_template_search", &plan);
+    n_word_chunks = (plan.n_fast_values + SPECIAL_CHUNK_SIZE - 1ul) / SPECIAL_CHUNK_SIZE;
+    n_chunks = (plan.n_slow_values != 0u && plan.n_slow_values <= 0xFFFFFFFFFFFFFFFFul / n_word_chunks) ? n_word_chunks * plan.n_slow_values : 0u; // 0: more chunks than the counter can count
+
+    telemetry_start("deti_coins_cpu_avx2_template_search", n_threads);
+    #pragma omp parallel reduction(+:total_n_coins, total_n_attempts) num_threads(n_threads)
+    {
+        u32_t interleaved_data[13u * 8u] __attribute__((aligned(32)));
+        u32_t interleaved_hash[ 4u * 8u] __attribute__((aligned(32)));
+        u32_t thread = (u32_t)omp_get_thread_num(), fast_word = plan.fast_word, midstate[4], word, n_lanes, lane, idx;
+        u64_t n_attempts = 0u, n_coins = 0u, chunk, value, end;
+        coin_t coin;
+
+        pin_worker_thread(thread);
+        while (stop_request == 0 && n_attempts < deti_coin_attempts_limit) {
+            chunk = __atomic_fetch_add(&next_chunk, 1u, __ATOMIC_RELAXED);
+            if (n_chunks != 0u && chunk >= n_chunks)
+                break; // all candidates were tried
+            // the fixed words of the chunk and their midstate
+            value = (chunk % n_word_chunks) * SPECIAL_CHUNK_SIZE;
+            end = (value + SPECIAL_CHUNK_SIZE < plan.n_fast_values) ? value + SPECIAL_CHUNK_SIZE : plan.n_fast_values;
+            plan_chunk_coin(&plan, chunk / n_word_chunks, value, &coin);
+            md5_cpu_midstate(coin.coin_as_ints, fast_word, midstate);
+            for (lane = 0u; lane < 8u; lane++)
+                for (idx = 0u; idx < 13u; idx++)
+                    interleaved_data[8u * idx + lane] = coin.coin_as_ints[idx];
+            word = coin.coin_as_ints[fast_word];
+            for (; value < end && stop_request == 0 && n_attempts < deti_coin_attempts_limit; value += 8u) {
+                n_lanes = (end - value < 8u) ? (u32_t)(end - value) : 8u; // the last batch of the last chunk may be partial
+                telemetry_count(thread, n_attempts, n_coins);
+                if (plan.fast_counter) { // raw bytes: a plain counter, with no carries between bytes
+                    *(v8su *)&interleaved_data[8u * fast_word] = (v8su){ 0u, 1u, 2u, 3u, 4u, 5u, 6u, 7u } + word;
+                    word += 8u;
+                } else
+                    for (lane = 0u; lane < 8u; lane++) {
+                        interleaved_data[8u * fast_word + lane] = word;
+                        word = plan_next_fast_word(&plan, word);
+                    }
+                md5_cpu_avx2_from_midstate((v8si *)interleaved_data, (v8si *)interleaved_hash, midstate, fast_word);
+                cross_check_batch(thread, 8u, interleaved_data, interleaved_hash); // sampled check against md5_cpu()
+                for (lane = 0u; lane < n_lanes; lane++)
+                    if ((interleaved_hash[8u * 3u + lane] & telemetry_near_miss_mask) == 0u) { // a near miss (all hits are near misses)
+                        telemetry_near_miss(thread);
+                        if ((interleaved_hash[8u * 3u + lane] & deti_coin_hit_mask) == 0u) {
+                            coin.coin_as_ints[fast_word] = interleaved_data[8u * fast_word + lane];
+                            DETI_PROBE4(hit, thread, lane, telemetry.mode, n_attempts + lane);
+                            #pragma omp critical
+                            save_deti_coin(coin.coin_as_ints);
+                            n_coins++;
+                        }
+                    }
+                n_attempts += n_lanes;
+            }
+        }
+        telemetry_count(thread, n_attempts, n_coins);
+        total_n_coins += n_coins;
+        total_n_attempts += n_attempts;
+    }
+
+    STORE_DETI_COINS();
+    telemetry_stop();
+    printf("deti_coins_cpu_avx2_template_search: %lu DETI coin%s matching \"%s\" found in %lu attempt%s (expected %.2f coins)\n",
+           total_n_coins, (total_n_coins == 1ul) ? "" : "s", template,
+           total_n_attempts, (total_n_attempts == 1ul) ? "" : "s",
+           (double)total_n_attempts / (double)(1ul << 32));
+}
+
+static void deti_coins_cpu_avx2_special_search(const char *special_text, u32_t offset, u32_t n_threads, u64_t seed)
+{
+    char template[16u + 2u * 52u], *p = template;
+    u32_t length = (u32_t)strlen(special_text);
+
+    if (validate_text_length(special_text))
+        exit(1);
+    if (offset + length > MAX_SPECIAL_TEXT_LENGTH) {
+        fprintf(stderr, "deti_coins_cpu_avx2_special_search: a text with %u characters does not fit at offset %u (at most %lu characters after \"DETI coin \")\n",
+                length, offset, MAX_SPECIAL_TEXT_LENGTH);
+        exit(1);
+    }
+    if (offset > 0u)
+        p += sprintf(p, "?{%u}", offset);
+    for (; *special_text != '\0'; special_text++) {
+        if (strchr("?.*[{\\", *special_text) != NULL)
+            *p++ = '\\';
+        *p++ = *special_text;
+    }
+    *p = '\0';
+    deti_coins_cpu_avx2_template_search(template, n_threads, seed);
+}
+
+#endif
@@ -25,6 +25,7 @@ void deti_coins_cpu_avx_openmp_search(u32_t n_random_words, u32_t number_of_thre
 {
     u32_t total_n_coins = 0;      // Total number of DETI coins found
     u64_t total_n_attempts = 0;   // Total number of attempts
+    telemetry_start("deti_coins_cpu_avx_openmp_search", number_of_threads);
 
     // Parallel region with reduction for total_n_coins and total_n_attempts
     #pragma omp parallel reduction(+:total_n_coins, total_n_attempts) shared(stop_request) num_threads(number_of_threads)
@@ -39,6 +40,10 @@ void deti_coins_cpu_avx_openmp_search(u32_t n_random_words, u32_t number_of_thre
         u32_t var1 = 0x20202020;  
         u32_t var2 = 0x20202020;
 
+        // Pin this worker to its cpu (does nothing when the placement is left to the operating system)
+        u32_t thread = (u32_t)omp_get_thread_num();
+        pin_worker_thread(thread);
+
         // Initialize DETI coins with the lane and thread number
         for (lane = 0u; lane < 4u; lane++) {
             initialize_deti_coin(&coins[lane]);
@@ -47,7 +52,8 @@ void deti_coins_cpu_avx_openmp_search(u32_t n_random_words, u32_t number_of_thre
         }
 
         // Search for DETI coins
-        for (n_attempts = 0ul; stop_request == 0; n_attempts+=4u) {
+        for (n_attempts = 0ul; stop_request == 0 && n_attempts < deti_coin_attempts_limit; n_attempts+=4u) {
+            telemetry_count(thread, n_attempts, n_coins);
             
             // Insert the var1 and var2 to try different combinations
             for (lane = 0u; lane < 4u; lane++) {
@@ -60,6 +66,7 @@ void deti_coins_cpu_avx_openmp_search(u32_t n_random_words, u32_t number_of_thre
 
             // Compute MD5 hashes using AVX
             md5_cpu_avx((v4si *)interleaved_data, (v4si *)interleaved_hash);
+            cross_check_batch(thread, 4u, interleaved_data, interleaved_hash); // sampled check against md5_cpu()
 
             // Check hashes for trailing zeros
             for (lane = 0u; lane < 4u; lane++) {
@@ -68,11 +75,15 @@ void deti_coins_cpu_avx_openmp_search(u32_t n_random_words, u32_t number_of_thre
                     hash[idx] = interleaved_hash[4u * idx + lane];
                 }
 
-                if (hash[3] == 0){
-                    save_deti_coin(coins[lane].coin_as_ints); // Save valid coin
-                    n_coins++;
-                    //printf("Thread %d: Found DETI coin in lane %u: %s\n",
-                    //    omp_get_thread_num(), lane, coins[lane].coin_as_chars);
+                if ((hash[3] & telemetry_near_miss_mask) == 0u) { // a near miss (all hits are near misses)
+                    telemetry_near_miss(thread);
+                    if ((hash[3] & deti_coin_hit_mask) == 0u){
+                        DETI_PROBE4(hit, thread, lane, telemetry.mode, n_attempts + lane);
+                        save_deti_coin(coins[lane].coin_as_ints); // Save valid coin
+                        n_coins++;
+                        //printf("Thread %d: Found DETI coin in lane %u: %s\n",
+                        //    omp_get_thread_num(), lane, coins[lane].coin_as_chars);
+                    }
                 }
             }
 
@@ -90,6 +101,7 @@ void deti_coins_cpu_avx_openmp_search(u32_t n_random_words, u32_t number_of_thre
 
     // Save all found DETI coins and print results
     STORE_DETI_COINS();
+    telemetry_stop();
     printf("deti_coins_cpu_avx_openmp_search: Found %u DETI coin%s in %lu attempt%s (expected %.2f coins)\n",
         total_n_coins, (total_n_coins == 1) ? "" : "s",
         total_n_attempts, (total_n_attempts == 1) ? "" : "s",
@@ -42,7 +42,9 @@ static void deti_coins_cpu_avx_search(u32_t n_random_words)
     }
 
     // Search for DETI coins
-    for (n_attempts = 0ul; stop_request == 0; n_attempts+=4u) {
+    telemetry_start("deti_coins_cpu_avx_search", 1u);
+    for (n_attempts = 0ul; stop_request == 0 && n_attempts < deti_coin_attempts_limit; n_attempts+=4u) {
+        telemetry_count(0u, n_attempts, n_coins);
 
         // Insert the var1 and var2 to try different combinations
         for (lane = 0u; lane < 4u; lane++) {
@@ -55,6 +57,7 @@ static void deti_coins_cpu_avx_search(u32_t n_random_words)
         
         // Compute MD5 hashes for the interleaved coins using AVX
         md5_cpu_avx((v4si *)interleaved_data, (v4si *)interleaved_hash);
+        cross_check_batch(0u, 4u, interleaved_data, interleaved_hash); // sampled check against md5_cpu()
 
         // Check each coin's hash for trailing zeros and determine if it's a DETI coin
         for (lane = 0u; lane < 4u; lane++) {
@@ -63,10 +66,14 @@ static void deti_coins_cpu_avx_search(u32_t n_random_words)
                 hash[idx] = interleaved_hash[4u * idx + lane];
             }
 
-            if (hash[3] == 0){
-                save_deti_coin(coins[lane].coin_as_ints);  // Save the valid DETI coin
-                n_coins++;
-                //printf("Found DETI coin in lane %u: %s\n", lane, coins[lane].coin_as_chars);  // Print the found coin
+            if ((hash[3] & telemetry_near_miss_mask) == 0u) { // a near miss (all hits are near misses)
+                telemetry_near_miss(0u);
+                if ((hash[3] & deti_coin_hit_mask) == 0u){
+                    DETI_PROBE4(hit, 0u, lane, telemetry.mode, n_attempts + lane);
+                    save_deti_coin(coins[lane].coin_as_ints);  // Save the valid DETI coin
+                    n_coins++;
+                    //printf("Found DETI coin in lane %u: %s\n", lane, coins[lane].coin_as_chars);  // Print the found coin
+                }
             }
         }
 
@@ -79,6 +86,7 @@ static void deti_coins_cpu_avx_search(u32_t n_random_words)
 
     // Save all found DETI coins
     STORE_DETI_COINS();
+    telemetry_stop();
 
     // Print results
     printf("deti_coins_cpu_avx_search: Found %u DETI coin%s in %lu attempt%s (expected %.2f coins)\n",
@@ -11,7 +11,7 @@
 
 static void deti_coins_cpu_search(void)
 {
-    u32_t n, idx ,coin[13u], hash[4u];
+    u32_t idx ,coin[13u], hash[4u];
     u64_t n_attempts, n_coins;
     u08_t *bytes;
 
@@ -42,26 +42,25 @@ static void deti_coins_cpu_search(void)
     //
     // find DETI coins
     //
-    for(n_attempts = n_coins = 0ul; stop_request == 0; n_attempts++)
+    telemetry_start("deti_coins_cpu_search",1u);
+    for(n_attempts = n_coins = 0ul; stop_request == 0 && n_attempts < deti_coin_attempts_limit; n_attempts++)
     {
+        telemetry_count(0u,n_attempts,n_coins);
         //
         // compute MD5 hash
         //
         md5_cpu(coin,hash);
         //
-        // byte-reverse each word (that's how the MD5 message digest is printed...)
+        // if the last 32 bits of the MD5 message digest are zero (the last word, before its bytes are reversed for
+        // printing) we have a DETI coin; if the last DETI_NEAR_MISS_BITS are zero we have a near miss (telemetry.h)
         //
-        hash_byte_reverse(hash);
-        //
-        // count the number of trailing zeros of the MD5 hash
-        //
-        n = deti_coin_power(hash);
-        //
-        // if the number of trailing zeros is >= 32 we have a DETI coin
-        //
-        if(n >= 32u){
-            save_deti_coin(coin);
-            n_coins++;
+        if((hash[3] & telemetry_near_miss_mask) == 0u){ // a near miss (all hits are near misses)
+            telemetry_near_miss(0u);
+            if((hash[3] & deti_coin_hit_mask) == 0u){
+                DETI_PROBE4(hit,0u,0u,telemetry.mode,n_attempts);
+                save_deti_coin(coin);
+                n_coins++;
+            }
         }
         //
         // try next combination (byte range: 0x20..0x7E)
@@ -72,6 +71,7 @@ static void deti_coins_cpu_search(void)
         bytes[idx]++;
     }
     STORE_DETI_COINS();
+    telemetry_stop();
     printf("deti_coins_cpu_search: %lu DETI coin%s found in %lu attempt%s (expected %.2f coins)\n",n_coins,(n_coins == 1ul) ? "" : "s",n_attempts,(n_attempts == 1ul) ? "" : "s",(double)n_attempts / (double)(1ul << 32));
 }
 
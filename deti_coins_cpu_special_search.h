@@ -32,15 +32,21 @@ static void deti_coins_cpu_special_search(const char *special_text)
 
     
     // Perform the search for DETI coins
-    for (n_attempts = n_coins = 0ul; stop_request == 0; n_attempts++) {
+    telemetry_start("deti_coins_cpu_special_search", 1u);
+    for (n_attempts = n_coins = 0ul; stop_request == 0 && n_attempts < deti_coin_attempts_limit; n_attempts++) {
+        telemetry_count(0u, n_attempts, n_coins);
         // Compute MD5 hash using the coin as an array of integers
         md5_cpu(coin.coin_as_ints, hash);
 
-        if (hash[3] == 0){
-            save_deti_coin(coin.coin_as_ints);  // Save the coin as integers
-            n_coins++;
+        if ((hash[3] & telemetry_near_miss_mask) == 0u) { // a near miss (all hits are near misses)
+            telemetry_near_miss(0u);
+            if ((hash[3] & deti_coin_hit_mask) == 0u){
+                DETI_PROBE4(hit, 0u, 0u, telemetry.mode, n_attempts);
+                save_deti_coin(coin.coin_as_ints);  // Save the coin as integers
+                n_coins++;
 
-            printf("Found DETI coin: %s\n", coin.coin_as_chars);  // Print the coin as a string
+                printf("Found DETI coin: %s\n", coin.coin_as_chars);  // Print the coin as a string
+            }
         }
 
         // Try the next combination (byte range: 0x20..0x7E)
@@ -54,6 +60,7 @@ static void deti_coins_cpu_special_search(const char *special_text)
 
     // Save all found DETI coins
     STORE_DETI_COINS();
+    telemetry_stop();
 
     // Print the results
     printf("deti_coins_cpu_special_search: %lu DETI coin%s with '%s' found in %lu attempt%s (expected %.2f coins)\n",
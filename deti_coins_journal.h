@@ -0,0 +1,130 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// write-ahead journal of the DETI coins accepted by the server
+//
+// save_deti_coin() keeps the coins in memory until STORE_DETI_COINS() is called, so a crash loses them; the
+// server therefore first appends every verified batch to JOURNAL_FILE, in the record format of the buffer of
+// save_checked_deti_coin() ("Vuv:" or, for a coin with raw bytes, "Ruv:", and the 52 bytes of the coin), and makes it
+// durable with fdatasync() before the coins are acknowledged to their client; once the vault has been updated and
+// synced the journal is emptied, and a journal left behind by a crash is appended to the vault when the server starts,
+// each record as its line of the vault (deti_coin_record_line(), so a coin with raw bytes is escaped); a crash between
+// the vault update and the truncation of the journal can only duplicate coins in the vault, never lose them
+//
+// journal_open() ---------- replay the journal left behind by a previous run and open it for appending
+// journal_record() -------- make the record of a coin
+// journal_append() -------- append some records with one write() (not yet durable)
+// journal_sync() ---------- make the appended coins durable
+// journal_checkpoint() ---- update the vault with STORE_DETI_COINS(), sync it, and empty the journal
+//
+
+#ifndef DETI_COINS_JOURNAL
+#define DETI_COINS_JOURNAL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define JOURNAL_FILE "deti_coins_journal.txt"
+#define JOURNAL_RECORD_SIZE (14u * 4u) // same as a record of the buffer of save_checked_deti_coin()
+
+static const char *journal_file = JOURNAL_FILE; // the file actually used (the regression and a scratch server use other ones)
+static int journal_fd = -1;
+
+// fsync() a file given its name (returns -1 on failure)
+static int journal_sync_file(const char *file_name) {
+    int fd = open(file_name, O_WRONLY | O_CLOEXEC);
+
+    if (fd < 0 || fsync(fd) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+static void journal_open(void) {
+    u32_t records[1024][14];
+    char line[DETI_COIN_MAX_RECORD_SIZE];
+    u64_t n_records = 0;
+    size_t n, size;
+    FILE *journal, *vault;
+
+    // Replay a journal left behind by a previous run (a partial record at its end was never acknowledged)
+    if ((journal = fopen(journal_file, "r")) != NULL) {
+        if ((vault = fopen(deti_coins_vault_file, "a")) == NULL) {
+            fprintf(stderr, "journal_open: unable to update file \"%s\"\n", deti_coins_vault_file);
+            exit(1);
+        }
+        while ((n = fread(records, JOURNAL_RECORD_SIZE, sizeof(records) / JOURNAL_RECORD_SIZE, journal)) > 0)
+            for (size_t i = 0; i < n; i++, n_records++) {
+                size = deti_coin_record_line(records[i], line);
+                if (fwrite(line, 1, size, vault) != size) {
+                    fprintf(stderr, "journal_open: unable to update file \"%s\"\n", deti_coins_vault_file);
+                    exit(1);
+                }
+            }
+        fclose(journal);
+        if (fflush(vault) != 0 || fsync(fileno(vault)) != 0 || fclose(vault) != 0) {
+            fprintf(stderr, "journal_open: unable to update file \"%s\"\n", deti_coins_vault_file);
+            exit(1);
+        }
+        if (n_records > 0)
+            printf("Journal: %lu coin%s of a previous run moved to \"%s\"\n", n_records, (n_records == 1) ? "" : "s",
+                   deti_coins_vault_file);
+    }
+    if ((journal_fd = open(journal_file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0 ||
+        fsync(journal_fd) != 0) {
+        fprintf(stderr, "journal_open: %s: %s\n", journal_file, strerror(errno));
+        exit(1);
+    }
+}
+
+// Make the record of a coin (with the header that save_checked_deti_coin() gives it)
+static void journal_record(u32_t record[14], const u32_t coin[13], u32_t power) {
+    power -= 32u;
+    record[0] = ((u32_t)'V' << 0) | (((u32_t)'0' + power / 10u) << 8) | (((u32_t)'0' + power % 10u) << 16) | ((u32_t)':' << 24);
+    if (!deti_coin_is_printable(coin))
+        record[0] ^= (u32_t)('V' ^ 'R');
+    memcpy(&record[1], coin, 13u * sizeof(u32_t));
+}
+
+// Append n records made by journal_record() with a single write()
+static void journal_append(const u32_t records[][14], u32_t n) {
+    const u08_t *p = (const u08_t *)records;
+    size_t left = (size_t)n * JOURNAL_RECORD_SIZE;
+
+    while (left > 0) {
+        ssize_t written = write(journal_fd, p, left);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0) {
+            fprintf(stderr, "journal_append: %s: %s\n", journal_file, strerror(errno));
+            exit(1);
+        }
+        p += written;
+        left -= (size_t)written;
+    }
+}
+
+static void journal_sync(void) {
+    if (fdatasync(journal_fd) != 0) {
+        fprintf(stderr, "journal_sync: %s: %s\n", journal_file, strerror(errno));
+        exit(1);
+    }
+}
+
+static void journal_checkpoint(void) {
+    STORE_DETI_COINS();
+    if (journal_sync_file(deti_coins_vault_file) != 0 && errno != ENOENT) {
+        fprintf(stderr, "journal_checkpoint: %s: %s\n", deti_coins_vault_file, strerror(errno));
+        return; // keep the journal
+    }
+    if (ftruncate(journal_fd, 0) != 0)
+        fprintf(stderr, "journal_checkpoint: %s: %s\n", journal_file, strerror(errno));
+}
+
+#endif
@@ -0,0 +1,53 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// numbered keyspace of the client/server search
+//
+// a template is a 52-byte DETI coin ("DETI coin " + a session tag + spaces + '\n'); candidate number index
+// (0 <= index < KEYSPACE_SIZE) is the template with
+//   word KEYSPACE_VAR1_WORD = the ASCII code of index % 95^4 (4 base-95 digits, least significant byte first)
+//   word KEYSPACE_VAR2_WORD = the ASCII code of index / 95^4
+// so consecutive indices are exactly the sequence produced by next_ascii_code(); a lease is a range of indices
+// of one template, always a whole number of KEYSPACE_CHUNK_SIZE chunks
+//
+// keyspace_word() ---------- ASCII code of a number (0 <= number < 95^4)
+// keyspace_make_coin() ----- candidate number index of a template
+//
+
+#ifndef DETI_COINS_KEYSPACE
+#define DETI_COINS_KEYSPACE
+
+#include <string.h>
+
+#define KEYSPACE_VAR1_WORD  10u
+#define KEYSPACE_VAR2_WORD  11u
+#define KEYSPACE_WORD_SIZE  (95ul * 95ul * 95ul * 95ul)           // values of a word
+#define KEYSPACE_CHUNK_SIZE (1ul << 22)                           // candidates handed to a worker thread at a time
+#define KEYSPACE_SIZE       ((KEYSPACE_WORD_SIZE * KEYSPACE_WORD_SIZE) / KEYSPACE_CHUNK_SIZE * KEYSPACE_CHUNK_SIZE) // candidates of a template (whole chunks)
+#define KEYSPACE_LEASE_SIZE (1ul << 32)                           // candidates of a fresh lease
+#define KEYSPACE_MAX_LEASE_CHUNKS (KEYSPACE_LEASE_SIZE / KEYSPACE_CHUNK_SIZE)
+#define KEYSPACE_TAG_LENGTH 8u                                    // session tag placed after "DETI coin "
+
+typedef struct {
+    u32_t lease_id;
+    u32_t template_id;
+    u64_t first; // first candidate index
+    u64_t count; // number of candidates
+    u32_t template[13];
+} keyspace_lease_t;
+
+static inline u32_t keyspace_word(u64_t number) {
+    u32_t word = 0u, byte;
+
+    for (byte = 0u; byte < 4u; byte++, number /= 95ul)
+        word |= (u32_t)(0x20ul + number % 95ul) << (8u * byte);
+    return word;
+}
+
+static inline void keyspace_make_coin(const u32_t template[13], u64_t index, u32_t coin[13]) {
+    memcpy(coin, template, 13u * sizeof(u32_t));
+    coin[KEYSPACE_VAR1_WORD] = keyspace_word(index % KEYSPACE_WORD_SIZE);
+    coin[KEYSPACE_VAR2_WORD] = keyspace_word(index / KEYSPACE_WORD_SIZE);
+}
+
+#endif
@@ -0,0 +1,174 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// client/server wire protocol
+//
+// every message is a frame made of an 8-byte header followed by a payload:
+//   byte 0 ...... protocol version (PROTOCOL_VERSION)
+//   byte 1 ...... message type (MSG_*)
+//   bytes 2-3 ... reserved (zero)
+//   bytes 4-7 ... payload length in bytes (little-endian)
+// all integers are little-endian and are written byte by byte, so the layout does not depend on struct padding;
+// a DETI coin is always sent as its 52 raw bytes
+//
+// payloads:
+//   MSG_HELLO ........... client -> server   u32 number of threads, u32 number of SIMD lanes per thread, and, only
+//                                            for a relay, u32 number of leases it wants to hold at the same time
+//   MSG_LEASE ........... server -> client   u32 lease id, u32 template id, u64 first index, u64 count, 52-byte template
+//   MSG_LEASE_REQUEST ... client -> server   (empty) ask for one more lease
+//   MSG_REVOKE .......... server -> client   u32 lease id (the lease expired and was given to another client)
+//   MSG_COINS ........... client -> server   u32 number of coins n, then n records of 52 bytes (n <= PROTOCOL_MAX_COINS)
+//   MSG_HITS ............ client -> server   u32 number of coins n, then n records of u32 template id, u64 candidate
+//                                            index (n <= PROTOCOL_MAX_HITS); the compact form of MSG_COINS for coins
+//                                            of a server template, which the server rebuilds with keyspace_make_coin()
+//   MSG_COINS_ACK ....... server -> client   u32 number of coins received on the connection (MSG_COINS and MSG_HITS)
+//                                            that are durable in the server journal or were rejected; sent when
+//                                            none of them is still being verified (the client keeps the others)
+//   MSG_PROGRESS ........ client -> server   u64 attempts so far, u32 coins so far, u32 number of acks n, then n
+//                                            records of u32 lease id, u64 candidates done (counted from the lease
+//                                            start, all of them completed; n <= PROTOCOL_MAX_ACKS)
+//   MSG_RESULT .......... client -> server   same as MSG_PROGRESS (final totals; the client closes the connection next)
+//
+// leases (see deti_coins_keyspace.h) are handed out by the server; a lease that is not acknowledged for
+// PROTOCOL_LEASE_TIMEOUT seconds, or whose client disconnects, is reissued from its first undone candidate
+//
+
+#ifndef DETI_COINS_PROTOCOL
+#define DETI_COINS_PROTOCOL
+
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "deti_coins_keyspace.h"
+
+#define PROTOCOL_VERSION      5u
+#define PROTOCOL_HEADER_SIZE  8u
+#define PROTOCOL_COIN_SIZE    52u
+#define PROTOCOL_MAX_COINS    64u // Max number of coins in one MSG_COINS message
+#define PROTOCOL_MAX_PAYLOAD  (4u + PROTOCOL_MAX_COINS * PROTOCOL_COIN_SIZE)
+#define PROTOCOL_HIT_SIZE     12u
+#define PROTOCOL_MAX_HITS     256u // Max number of coins in one MSG_HITS message
+#define PROTOCOL_MAX_ACKS     8u  // Max number of lease acks in one MSG_PROGRESS message
+#define PROTOCOL_LEASE_SIZE   (24u + PROTOCOL_COIN_SIZE)
+#define PROTOCOL_PROGRESS_SIZE(n_acks) (16u + 12u * (n_acks))
+#define PROTOCOL_HEARTBEAT_PERIOD 5 // Seconds between two MSG_PROGRESS messages
+#define PROTOCOL_LEASE_TIMEOUT 60 // Seconds without an ack after which a lease is reissued
+
+#define MSG_HELLO          1u
+#define MSG_LEASE          2u
+#define MSG_COINS          3u
+#define MSG_PROGRESS       4u
+#define MSG_RESULT         5u
+#define MSG_LEASE_REQUEST  6u
+#define MSG_REVOKE         7u
+#define MSG_HITS           8u
+#define MSG_COINS_ACK      9u
+
+//
+// little-endian serialization helpers
+//
+
+static inline void put_u32(u08_t *p, u32_t v) {
+    p[0] = (u08_t)v;
+    p[1] = (u08_t)(v >> 8);
+    p[2] = (u08_t)(v >> 16);
+    p[3] = (u08_t)(v >> 24);
+}
+
+static inline void put_u64(u08_t *p, u64_t v) {
+    put_u32(p, (u32_t)v);
+    put_u32(p + 4, (u32_t)(v >> 32));
+}
+
+static inline u32_t get_u32(const u08_t *p) {
+    return (u32_t)p[0] | ((u32_t)p[1] << 8) | ((u32_t)p[2] << 16) | ((u32_t)p[3] << 24);
+}
+
+static inline u64_t get_u64(const u08_t *p) {
+    return (u64_t)get_u32(p) | ((u64_t)get_u32(p + 4) << 32);
+}
+
+static inline void protocol_put_lease(u08_t *payload, const keyspace_lease_t *lease) {
+    put_u32(&payload[0], lease->lease_id);
+    put_u32(&payload[4], lease->template_id);
+    put_u64(&payload[8], lease->first);
+    put_u64(&payload[16], lease->count);
+    memcpy(&payload[24], lease->template, PROTOCOL_COIN_SIZE);
+}
+
+static inline void protocol_get_lease(const u08_t *payload, keyspace_lease_t *lease) {
+    lease->lease_id = get_u32(&payload[0]);
+    lease->template_id = get_u32(&payload[4]);
+    lease->first = get_u64(&payload[8]);
+    lease->count = get_u64(&payload[16]);
+    memcpy(lease->template, &payload[24], PROTOCOL_COIN_SIZE);
+}
+
+/**
+ * @brief Writes a frame header.
+ *
+ * @param header Where to write the PROTOCOL_HEADER_SIZE bytes.
+ * @param type The message type (MSG_*).
+ * @param length The payload length.
+ */
+static inline void protocol_put_header(u08_t *header, u32_t type, u32_t length) {
+    header[0] = (u08_t)PROTOCOL_VERSION;
+    header[1] = (u08_t)type;
+    header[2] = 0;
+    header[3] = 0;
+    put_u32(&header[4], length);
+}
+
+/**
+ * @brief Validates a frame header.
+ *
+ * @param header The PROTOCOL_HEADER_SIZE bytes of the header.
+ * @param type Where to store the message type.
+ * @param length Where to store the payload length.
+ * @return 0 if the header is acceptable, -1 otherwise (wrong version or payload too large).
+ */
+static inline int protocol_get_header(const u08_t *header, u32_t *type, u32_t *length) {
+    *type = header[1];
+    *length = get_u32(&header[4]);
+    if (header[0] != PROTOCOL_VERSION || *length > PROTOCOL_MAX_PAYLOAD)
+        return -1;
+    return 0;
+}
+
+//
+// blocking helpers (used by the client)
+//
+
+static int send_all(int fd, const void *data, size_t size) {
+    const u08_t *p = data;
+
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends one frame (header and payload, with a single send() call when possible) on a blocking socket.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int protocol_send(int fd, u32_t type, const u08_t *payload, u32_t length) {
+    u08_t frame[PROTOCOL_HEADER_SIZE + PROTOCOL_MAX_PAYLOAD];
+
+    if (length > PROTOCOL_MAX_PAYLOAD)
+        return -1;
+    protocol_put_header(frame, type, length);
+    if (length > 0)
+        memcpy(&frame[PROTOCOL_HEADER_SIZE], payload, length);
+    return send_all(fd, frame, PROTOCOL_HEADER_SIZE + length);
+}
+
+#endif
@@ -0,0 +1,439 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// known-answer regression of the search engines
+//
+// test_md5_cpu_*() only check raw hashes; here each search engine runs over a small window of its enumeration and the
+// coins it reports are compared with known answers, so that a bug in the interleaving, in the lane or thread tags, or
+// in the hit check of a search loop is caught:
+//   planted hits -- the hit check is relaxed to REGRESSION_POWER zero bits (deti_coin_hit_mask), so that a window of
+//                   REGRESSION_WINDOW candidates holds a dozen or so hits; the engines that always start at the beginning
+//                   of their enumeration (deti_coins_cpu_*_search(), the OpenMP ones with REGRESSION_THREADS threads)
+//                   stop after REGRESSION_WINDOW attempts (deti_coin_attempts_limit), the keyspace engines of the client
+//                   and of the shared-memory workers search the window of the template of a vault coin around it
+//   a vault coin -- the keyspace engines search the same window with the normal hit check and must report that coin only
+//   the journal --- a journal of the server left behind by a crash, with a coin with raw bytes, is replayed into a
+//                   scratch vault, which must then hold the line of each coin (escaped for the raw one)
+//   the relay ----- the relay forwards two coins to a loopback "server", loses it before they are acknowledged and
+//                   reconnects; the coins sent again by its clients must reach the new upstream connection
+// the reported coins are captured (deti_coin_capture) instead of being saved, each one is checked with md5_cpu(), and
+// their number and fingerprint (sum of the first words of their MD5 hashes) must match the known answers, which were
+// computed independently of this code; if the window, the enumeration of an engine or REGRESSION_POWER change, so do
+// the answers
+//
+// regression_tests() --- run the engines of this build (returns the number of failures)
+//
+
+#ifndef DETI_COINS_REGRESSION
+#define DETI_COINS_REGRESSION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define REGRESSION_POWER   10u           // zero bits of a planted hit
+#define REGRESSION_WINDOW  16384u        // attempts of each engine (of each thread); a multiple of MAX_CLIENT_LANES
+#define REGRESSION_THREADS 2u            // threads of the OpenMP engines
+#define REGRESSION_MAX_COINS 256u
+#define REGRESSION_SEED    2024u         // seed of the random fill of the template searches
+#define REGRESSION_TEMPLATE "?{30}[0-9a-f]{8}KAT" // fast word of 16^4 values, constant last word
+#define REGRESSION_RAW_TEMPLATE "?{34}*{4}.{3}"   // raw bytes: a counter as the fast word, no '\n' in the last word
+#define REGRESSION_VAULT_COIN "DETI coin f3t46Hgn                      VZ:B%      \n"
+
+typedef struct {
+    const char *engine;
+    u32_t n_coins;     // planted hits in the window
+    u32_t fingerprint; // sum of the first words of their MD5 hashes
+} regression_answer_t;
+
+static const regression_answer_t regression_answers[] = {
+    { "cpu",             13u, 0x72e8732eu },
+    { "cpu_special",     17u, 0x0b0f58e8u }, // special text "KAT"
+    { "cpu_avx",         18u, 0xc1151b28u },
+    { "cpu_avx2",        12u, 0x539a1c33u },
+    { "cpu_avx512",      13u, 0x2f1abfa3u },
+    { "cpu_avx_openmp",  26u, 0xc29d6ca9u },
+    { "cpu_avx2_openmp", 28u, 0xe1116e99u },
+    { "cpu_avx2_special", 34u, 0x736f33beu }, // "KAT" at offset 5, seed REGRESSION_SEED (chunks 0 and 1)
+    { "cpu_avx2_template", 32u, 0x957d6810u }, // REGRESSION_TEMPLATE, seed REGRESSION_SEED (chunks 0 and 1)
+    { "cpu_avx2_raw",     39u, 0x4795a004u }, // REGRESSION_RAW_TEMPLATE, idem
+    { "keyspace",        16u, 0xfc54739fu }, // all client_* and shm_* engines
+    { "vault_coin",       1u, 0x8ea2441fu }  // idem, normal hit check
+};
+
+static struct {
+    u32_t n_coins;
+    u32_t coins[REGRESSION_MAX_COINS][13];
+} regression_capture;
+
+// called by save_deti_coin() (from any thread of the OpenMP engines)
+static void regression_capture_coin(u32_t coin[13]) {
+    u32_t n = __atomic_fetch_add(&regression_capture.n_coins, 1u, __ATOMIC_RELAXED);
+
+    if (n < REGRESSION_MAX_COINS)
+        memcpy(regression_capture.coins[n], coin, sizeof(regression_capture.coins[n]));
+}
+
+//
+// run an engine with the hooks set and its output sent to /dev/null
+//
+
+static int regression_stdout = -1;
+
+static void regression_begin(u32_t power, u64_t attempts_limit) {
+    int fd;
+
+    regression_capture.n_coins = 0u;
+    deti_coin_hit_mask = (power >= 32u) ? 0xFFFFFFFFu : __builtin_bswap32((1u << power) - 1u); // see hash_byte_reverse()
+    deti_coin_attempts_limit = attempts_limit;
+    deti_coin_capture = regression_capture_coin;
+    telemetry_near_miss_configure();
+    fflush(stdout);
+    if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+        regression_stdout = dup(STDOUT_FILENO);
+        (void)dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+}
+
+static void regression_end(void) {
+    fflush(stdout);
+    if (regression_stdout >= 0) {
+        (void)dup2(regression_stdout, STDOUT_FILENO);
+        close(regression_stdout);
+        regression_stdout = -1;
+    }
+    deti_coin_hit_mask = 0xFFFFFFFFu;
+    deti_coin_attempts_limit = 0xFFFFFFFFFFFFFFFFul;
+    deti_coin_capture = NULL;
+    telemetry_near_miss_configure();
+}
+
+// compare the captured coins with the known answer (returns 1 on a failure)
+static int regression_check(const char *engine, const char *answer, u32_t power) {
+    const regression_answer_t *a = NULL;
+    u32_t n_coins = regression_capture.n_coins, fingerprint = 0u, n_bad = 0u, hash[4], record[14], parsed[13];
+    char line[DETI_COIN_MAX_RECORD_SIZE];
+
+    for (u32_t i = 0u; i < sizeof(regression_answers) / sizeof(regression_answers[0]); i++)
+        if (strcmp(regression_answers[i].engine, answer) == 0)
+            a = &regression_answers[i];
+    if (n_coins > REGRESSION_MAX_COINS)
+        n_coins = REGRESSION_MAX_COINS;
+    for (u32_t i = 0u; i < n_coins; i++) {
+        md5_cpu(regression_capture.coins[i], hash);
+        fingerprint += hash[0];
+        hash_byte_reverse(hash);
+        if (deti_coin_format_is_good(regression_capture.coins[i]) == 0 || deti_coin_power(hash) < power) {
+            if (n_bad++ == 0u)
+                fprintf(stderr, "regression: %s reported a coin that is not a hit: %.52s", engine, (char *)regression_capture.coins[i]);
+        }
+        // its line in the vault (escaped when it has raw bytes) must give it back
+        record[0] = deti_coin_is_printable(regression_capture.coins[i]) ? 0x3A303056u : 0x3A303052u; // "V00:" or "R00:"
+        memcpy(&record[1], regression_capture.coins[i], 13u * sizeof(u32_t));
+        if (deti_coin_parse_record(line, deti_coin_record_line(record, line), parsed) == 0 ||
+            memcmp(parsed, regression_capture.coins[i], sizeof(parsed)) != 0) {
+            if (n_bad++ == 0u)
+                fprintf(stderr, "regression: %s reported a coin whose vault line is wrong: %.*s", engine, (int)deti_coin_record_line(record, line), line);
+        }
+    }
+    if (n_bad == 0u && regression_capture.n_coins == a->n_coins && fingerprint == a->fingerprint) {
+        printf("regression: %-20s %3u coin%s ok\n", engine, a->n_coins, (a->n_coins == 1u) ? " " : "s");
+        return 0;
+    }
+    printf("regression: %-20s FAILED: %u coins (%u not hits or bad vault lines), fingerprint %08x; expected %u coins, fingerprint %08x\n", engine,
+           regression_capture.n_coins, n_bad, fingerprint, a->n_coins, a->fingerprint);
+    return 1;
+}
+
+//
+// the keyspace engines
+//
+
+// index of a coin of the keyspace of its template (the inverse of keyspace_make_coin())
+static u64_t regression_keyspace_index(const u32_t coin[13]) {
+    u64_t var1 = 0u, var2 = 0u;
+
+    for (int byte = 3; byte >= 0; byte--) {
+        var1 = 95ul * var1 + ((coin[KEYSPACE_VAR1_WORD] >> (8 * byte)) & 0xFFu) - 0x20u;
+        var2 = 95ul * var2 + ((coin[KEYSPACE_VAR2_WORD] >> (8 * byte)) & 0xFFu) - 0x20u;
+    }
+    return var1 + KEYSPACE_WORD_SIZE * var2;
+}
+
+static void regression_client_slice(const client_engine_t *engine, const u32_t template[13], u64_t first) {
+    client_hit_ring_t *ring = &client_hit_rings[0];
+    client_chunk_t chunk;
+    u32_t coin[13];
+
+    memset(&chunk, 0, sizeof(chunk));
+    memcpy(chunk.template, template, sizeof(chunk.template));
+    client.engine = engine;
+    (void)client_search_slice(0u, &chunk, first, REGRESSION_WINDOW);
+    for (; ring->tail != ring->head; ring->tail++) {
+        keyspace_make_coin(template, ring->hits[ring->tail % CLIENT_HIT_RING_SIZE].index, coin);
+        regression_capture_coin(coin);
+    }
+    for (u32_t i = 0u; i < ring->n_overflow; i++) {
+        keyspace_make_coin(template, ring->overflow[i].index, coin);
+        regression_capture_coin(coin);
+    }
+    memset(ring, 0, sizeof(*ring));
+    client.engine = NULL;
+}
+
+static void regression_shm_slice(const client_engine_t *engine, const u32_t template[13], u64_t first) {
+    static shm_segment_t segment;
+    u64_t overflow[SHM_WORKER_OVERFLOW], index;
+    u32_t n_overflow = 0u, worker, coin[13];
+
+    memset(&segment, 0, sizeof(segment));
+    for (u32_t i = 0u; i < SHM_HIT_RING_SIZE; i++)
+        segment.hits[i].sequence = i;
+    memcpy(segment.template, template, sizeof(segment.template));
+    (void)shm_search_slice(&segment, engine, 0u, first, REGRESSION_WINDOW, overflow, &n_overflow);
+    while (shm_pop_hit(&segment, &worker, &index) == 0) {
+        keyspace_make_coin(template, index, coin);
+        regression_capture_coin(coin);
+    }
+    for (u32_t i = 0u; i < n_overflow; i++) {
+        keyspace_make_coin(template, overflow[i], coin);
+        regression_capture_coin(coin);
+    }
+}
+
+static int regression_keyspace_engines(void) {
+    coin_t vault_coin;
+    u32_t template[13];
+    u64_t first;
+    char name[32];
+    int n_failures = 0;
+
+    memcpy(vault_coin.coin_as_chars, REGRESSION_VAULT_COIN, 52u);
+    memcpy(template, vault_coin.coin_as_ints, sizeof(template));
+    template[KEYSPACE_VAR1_WORD] = template[KEYSPACE_VAR2_WORD] = 0x20202020u;
+    first = (regression_keyspace_index(vault_coin.coin_as_ints) - REGRESSION_WINDOW / 2u) & ~(u64_t)(MAX_CLIENT_LANES - 1u);
+    for (u32_t i = 0u; i < sizeof(client_engines) / sizeof(client_engines[0]); i++) {
+        const client_engine_t *engine = &client_engines[i];
+        if (!engine->supported()) {
+            printf("regression: client_%-13s skipped (not supported by this processor)\n", engine->name);
+            continue;
+        }
+        for (int pass = 0; pass < 2; pass++) {
+            const char *answer = (pass == 0) ? "keyspace" : "vault_coin";
+            u32_t power = (pass == 0) ? REGRESSION_POWER : 32u;
+            snprintf(name, sizeof(name), "client_%s%s", engine->name, (power < 32u) ? "" : " (vault)");
+            regression_begin(power, 0xFFFFFFFFFFFFFFFFul);
+            regression_client_slice(engine, template, first);
+            regression_end();
+            n_failures += regression_check(name, answer, power);
+            snprintf(name, sizeof(name), "shm_%s%s", engine->name, (power < 32u) ? "" : " (vault)");
+            regression_begin(power, 0xFFFFFFFFFFFFFFFFul);
+            regression_shm_slice(engine, template, first);
+            regression_end();
+            n_failures += regression_check(name, answer, power);
+        }
+    }
+    return n_failures;
+}
+
+//
+// the replay of the journal of the server
+//
+
+#ifdef DETI_COINS_JOURNAL
+static int regression_journal_replay(void) {
+    char directory[] = "/tmp/deti_coins_regression_XXXXXX", vault_name[64], journal_name[64], *line = NULL;
+    const char *vault_file = deti_coins_vault_file, *saved_journal_file = journal_file;
+    u32_t coins[2][13], records[2][14], parsed[13], n_lines = 0u, n_good = 0u;
+    size_t size = 0;
+    ssize_t length;
+    FILE *fp;
+    int fd;
+
+    // a printable coin and one with raw bytes, a '\n' among them (power 33, so the lines start with "V01:" and "R01:")
+    memcpy(coins[0], REGRESSION_VAULT_COIN, 52u);
+    memcpy(coins[1], REGRESSION_VAULT_COIN, 52u);
+    memcpy((u08_t *)coins[1] + 20u, "\x00\\\n\xff", 4u);
+    journal_record(records[0], coins[0], 33u);
+    journal_record(records[1], coins[1], 33u);
+    if (mkdtemp(directory) == NULL) {
+        perror("regression: mkdtemp");
+        return 1;
+    }
+    snprintf(vault_name, sizeof(vault_name), "%s/vault.txt", directory);
+    snprintf(journal_name, sizeof(journal_name), "%s/journal.txt", directory);
+    if ((fd = open(journal_name, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 || write(fd, records, sizeof(records)) != (ssize_t)sizeof(records)) {
+        perror("regression: journal");
+        return 1;
+    }
+    close(fd);
+
+    // replay it (as a restarted server does) and read the scratch vault back
+    deti_coins_vault_file = vault_name;
+    journal_file = journal_name;
+    regression_begin(32u, 0xFFFFFFFFFFFFFFFFul);
+    journal_open();
+    close(journal_fd);
+    journal_fd = -1;
+    regression_end();
+    deti_coins_vault_file = vault_file;
+    journal_file = saved_journal_file;
+    if ((fp = fopen(vault_name, "r")) != NULL) {
+        for (; (length = getline(&line, &size, fp)) > 0; n_lines++)
+            if (n_lines < 2u && line[0] == ((n_lines == 0u) ? 'V' : 'R') && strncmp(&line[1], "01:", 3) == 0 &&
+                deti_coin_parse_record(line, (u32_t)length, parsed) && memcmp(parsed, coins[n_lines], sizeof(parsed)) == 0)
+                n_good++;
+        fclose(fp);
+    }
+    free(line);
+    (void)unlink(vault_name);
+    (void)unlink(journal_name);
+    (void)rmdir(directory);
+    if (n_lines == 2u && n_good == 2u) {
+        printf("regression: %-20s %3u coins ok\n", "journal replay", n_good);
+        return 0;
+    }
+    printf("regression: %-20s FAILED: %u lines in the vault, %u of them right; expected 2 lines (\"V01:\" and \"R01:\")\n",
+           "journal replay", n_lines, n_good);
+    return 1;
+}
+#endif
+
+//
+// the relay after the loss of its upstream connection
+//
+
+#ifdef RELAY
+// Read the hello of a relay and its MSG_COINS frame (returns the number of these coins that were received)
+static u32_t regression_relay_receive(int fd, u08_t coins[2][PROTOCOL_COIN_SIZE]) {
+    u08_t header[PROTOCOL_HEADER_SIZE], payload[4u + 2u * PROTOCOL_COIN_SIZE];
+    u32_t type, length, n_good = 0u;
+
+    for (int frame = 0; frame < 2; frame++) {
+        if (recv(fd, header, PROTOCOL_HEADER_SIZE, MSG_WAITALL) != (ssize_t)PROTOCOL_HEADER_SIZE ||
+            protocol_get_header(header, &type, &length) < 0 || length > sizeof(payload) ||
+            recv(fd, payload, length, MSG_WAITALL) != (ssize_t)length)
+            return 0u;
+    }
+    if (type != MSG_COINS || length < 4u || get_u32(payload) * PROTOCOL_COIN_SIZE != length - 4u)
+        return 0u;
+    for (u32_t i = 0u; i < get_u32(payload) && i < 2u; i++)
+        n_good += (memcmp(&payload[4u + i * PROTOCOL_COIN_SIZE], coins[i], PROTOCOL_COIN_SIZE) == 0);
+    return n_good;
+}
+
+static int regression_relay_reconnect(void) {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    struct timeval timeout = { .tv_sec = 2 };
+    socklen_t address_size = sizeof(address);
+    u08_t coins[2][PROTOCOL_COIN_SIZE];
+    u32_t n_good[2] = { 0u, 0u };
+    int listen_fd, epoll_fd, server_fd, saved_stderr;
+
+    memcpy(coins[0], REGRESSION_VAULT_COIN, PROTOCOL_COIN_SIZE);
+    memcpy(coins[1], REGRESSION_VAULT_COIN, PROTOCOL_COIN_SIZE);
+    coins[1][20] ^= 1u;
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listen_fd, 2) < 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&address, &address_size) < 0 || (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("regression: relay");
+        return 1;
+    }
+    upstream.host = "127.0.0.1";
+    upstream.port = ntohs(address.sin_port);
+    regression_begin(32u, 0xFFFFFFFFFFFFFFFFul);
+    fflush(stderr);
+    saved_stderr = dup(STDERR_FILENO);
+    (void)dup2(STDOUT_FILENO, STDERR_FILENO); // the "connection lost" message goes to /dev/null too
+
+    // the first server gets both coins and goes away without acknowledging them; the second one must get them again
+    for (int round = 0; round < 2; round++) {
+        server_fd = -1;
+        if (relay_upstream_connect(epoll_fd) < 0 || (server_fd = accept(listen_fd, NULL, NULL)) < 0)
+            break;
+        (void)setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (relay_forward(coins[0], 0) == 0 && relay_forward(coins[1], 0) == 0 && relay_send_batches() == 0 &&
+            relay_flush_upstream(epoll_fd) == 0)
+            n_good[round] = regression_relay_receive(server_fd, coins);
+        relay_upstream_lost(epoll_fd, "regression");
+        close(server_fd);
+    }
+
+    fflush(stderr);
+    if (saved_stderr >= 0) {
+        (void)dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+    }
+    regression_end();
+    upstream.backoff = 1;
+    close(epoll_fd);
+    close(listen_fd);
+    if (n_good[0] == 2u && n_good[1] == 2u) {
+        printf("regression: %-20s %3u coins ok\n", "relay reconnection", n_good[1]);
+        return 0;
+    }
+    printf("regression: %-20s FAILED: %u of 2 coins forwarded before the upstream connection was lost, %u of 2 after it\n",
+           "relay reconnection", n_good[0], n_good[1]);
+    return 1;
+}
+#endif
+
+//
+// all engines of this build
+//
+
+static int regression_tests(void) {
+    int n_failures = 0;
+
+#define REGRESSION_RUN(engine, call)                                           \
+    do {                                                                       \
+        regression_begin(REGRESSION_POWER, (u64_t)REGRESSION_WINDOW);          \
+        call;                                                                  \
+        regression_end();                                                      \
+        n_failures += regression_check(engine, engine, REGRESSION_POWER);      \
+    } while (0)
+
+    REGRESSION_RUN("cpu", deti_coins_cpu_search());
+    REGRESSION_RUN("cpu_special", deti_coins_cpu_special_search("KAT"));
+#ifdef DETI_COINS_CPU_AVX_SEARCH
+    REGRESSION_RUN("cpu_avx", deti_coins_cpu_avx_search(1u));
+#endif
+#ifdef DETI_COINS_CPU_AVX2_SEARCH
+    REGRESSION_RUN("cpu_avx2", deti_coins_cpu_avx2_search(1u));
+#endif
+#ifdef DETI_COINS_CPU_AVX512_SEARCH
+    REGRESSION_RUN("cpu_avx512", deti_coins_cpu_avx512_search(1u));
+#endif
+#ifdef DETI_COINS_CPU_AVX_OPENMP_SEARCH
+    REGRESSION_RUN("cpu_avx_openmp", deti_coins_cpu_avx_openmp_search(1u, REGRESSION_THREADS));
+#endif
+#ifdef DETI_COINS_CPU_AVX2_OPENMP_SEARCH
+    REGRESSION_RUN("cpu_avx2_openmp", deti_coins_cpu_avx2_openmp_search(1u, REGRESSION_THREADS));
+#endif
+#ifdef DETI_COINS_CPU_AVX2_TEMPLATE_SEARCH
+    REGRESSION_RUN("cpu_avx2_special", deti_coins_cpu_avx2_special_search("KAT", 5u, REGRESSION_THREADS, REGRESSION_SEED));
+    REGRESSION_RUN("cpu_avx2_template", deti_coins_cpu_avx2_template_search(REGRESSION_TEMPLATE, REGRESSION_THREADS, REGRESSION_SEED));
+    REGRESSION_RUN("cpu_avx2_raw", deti_coins_cpu_avx2_template_search(REGRESSION_RAW_TEMPLATE, REGRESSION_THREADS, REGRESSION_SEED));
+#endif
+#undef REGRESSION_RUN
+    n_failures += regression_keyspace_engines();
+#ifdef DETI_COINS_JOURNAL
+    n_failures += regression_journal_replay();
+#endif
+#ifdef RELAY
+    n_failures += regression_relay_reconnect();
+#endif
+    if (n_failures == 0)
+        printf("regression: all engines found exactly the known coins\n");
+    else
+        printf("regression: %d engine%s FAILED\n", n_failures, (n_failures == 1) ? "" : "s");
+    return n_failures;
+}
+
+#endif
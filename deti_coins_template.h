@@ -0,0 +1,258 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// coin templates, compiled into an enumeration plan
+//
+// a template describes the 41 bytes between "DETI coin " and the '\n' (bytes 10 to 50 of the coin), one atom per byte:
+//   c ---------- the printable ASCII character c (except ?, ., *, [, { and \)
+//   \c --------- the character c (\?, \., \*, \[, \{ and \\ are the literal ?, ., *, [, { and \)
+//   \xHH ------- the byte with the hexadecimal code HH (lower case)
+//   ? ---------- any printable ASCII character (0x20..0x7E)
+//   . ---------- any byte except '\n' (raw bytes, see below)
+//   * ---------- any byte (raw bytes)
+//   [set] ------ any character of the set: characters and ranges like a-z (\ escapes, a - first or last is literal);
+//                [^set] is any printable ASCII character not in the set
+//   atom{n} ---- n copies of the atom
+// a template shorter than 41 bytes is completed with ?; for example "[A-F]{4}-KAT-?{6}[0-9]{8}"
+// the raw bytes are opt-in: the coins that have them are not text (the vault escapes them, see deti_coins_vault.h); with
+// *{4} on a word (bytes 12 to 47, template positions 2 to 37), for example "?{34}*{4}???", that word is a plain counter
+//
+// the plan says what each word of the coin does:
+//   constant --- all its bytes are fixed
+//   fast ------- it takes consecutive values, one per lane (byte 4 * fast_word is the least significant digit, the radix
+//                of a digit is the size of the set of its byte); it is the last word with 2^32 values, which is a plain
+//                counter (eight lanes are a vector add), if there is one, otherwise the last word with at least
+//                PLAN_MIN_FAST_VALUES values (or the one with the most values), so the words before it, which are the
+//                same in a whole chunk of values, give the longest possible midstate
+//   slow ------- its varying bytes are digits of the slow number of a chunk (the first varying byte is the least
+//                significant digit), added to a random offset chosen from the seed of the search
+//
+// compile_coin_template() ---- parse a template into a plan (terminates the program on a bad template)
+// plan_fast_word() ----------- value number index of the fast word
+// plan_next_fast_word() ------ the value after a given one (wraps around)
+// plan_randomize() ----------- choose the random offsets of the slow digits
+// plan_chunk_coin() ---------- the coin of a chunk, given its slow number (the fast word holds its first value)
+// print_coin_plan() ---------- print the role of each word
+//
+
+#ifndef DETI_COINS_TEMPLATE
+#define DETI_COINS_TEMPLATE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "search_utilities.h"
+
+#define PLAN_MIN_FAST_VALUES 4096u // values of a good fast word (512 batches of 8 lanes per midstate)
+
+typedef struct {
+    coin_t base;                  // the fixed bytes; each varying byte holds the first character of its set
+    u32_t radix[52];              // size of the set of each byte (1 for a fixed byte)
+    u08_t charset[52][256];       // characters of each set, in increasing order
+    u08_t fast_successor[4][256]; // next character of the set of each byte of the fast word (0 after the last one)
+    u32_t fast_word;
+    u64_t n_fast_values;          // values of the fast word
+    int fast_counter;             // the fast word takes all 2^32 values (value number index is the word index)
+    u32_t n_slow;
+    u08_t slow_bytes[52];         // varying bytes outside the fast word, least significant digit first
+    u64_t n_slow_values;          // slow numbers (0: more than 2^64)
+    u32_t slow_offset[52];        // random offset of each slow digit
+} coin_plan_t;
+
+static void __attribute__((noreturn)) coin_template_error(const char *template, const char *p, const char *message) {
+    fprintf(stderr, "compile_coin_template: %s at position %ld of \"%s\"\n", message, (long)(p - template), template);
+    exit(1);
+}
+
+// one character (possibly escaped) of a template
+static u08_t coin_template_character(const char *template, const char **p) {
+    int high, low;
+
+    if (**p == '\\' && (*p)[1] == 'x' && (high = hex_digit_value((*p)[2])) >= 0 && (low = hex_digit_value((*p)[3])) >= 0) {
+        *p += 4;
+        return (u08_t)(16 * high + low);
+    }
+    if (**p == '\\')
+        (*p)++;
+    if (**p < ' ' || **p > '~')
+        coin_template_error(template, *p, (**p == '\0') ? "unexpected end" : "non-printable character");
+    return (u08_t)*(*p)++;
+}
+
+static void compile_coin_template(const char *template, coin_plan_t *plan) {
+    const char *p = template;
+    u08_t in_set[256];
+    u32_t pos = 10u, idx, w, n_copies;
+    u64_t n_values;
+
+    memset(plan, 0, sizeof(*plan));
+    initialize_deti_coin(&plan->base);
+    for (idx = 0u; idx < 52u; idx++) {
+        plan->radix[idx] = 1u;
+        plan->charset[idx][0] = (u08_t)plan->base.coin_as_chars[idx];
+    }
+    while (pos < 51u) {
+        // one atom
+        memset(in_set, 0, sizeof(in_set));
+        if (*p == '\0') {
+            for (idx = 0x20u; idx <= 0x7Eu; idx++)
+                in_set[idx] = 1u; // the missing bytes are ?
+        } else if (*p == '?') {
+            p++;
+            for (idx = 0x20u; idx <= 0x7Eu; idx++)
+                in_set[idx] = 1u;
+        } else if (*p == '.' || *p == '*') {
+            for (idx = 0u; idx < 256u; idx++)
+                in_set[idx] = (*p == '*' || idx != (u32_t)'\n');
+            p++;
+        } else if (*p == '[') {
+            int negate = (*++p == '^');
+            u08_t first, last;
+
+            if (negate)
+                p++;
+            do {
+                first = last = coin_template_character(template, &p);
+                if (*p == '-' && p[1] != ']') {
+                    p++;
+                    last = coin_template_character(template, &p);
+                    if (last < first)
+                        coin_template_error(template, p - 1, "bad range");
+                }
+                for (idx = first; idx <= last; idx++)
+                    in_set[idx] = 1u;
+            } while (*p != ']');
+            p++;
+            if (negate)
+                for (idx = 0x20u; idx <= 0x7Eu; idx++)
+                    in_set[idx] ^= 1u;
+        } else
+            in_set[coin_template_character(template, &p)] = 1u;
+        // its copies
+        n_copies = 1u;
+        if (*p == '{') {
+            unsigned long count;
+            char *end;
+
+            errno = 0;
+            count = strtoul(p + 1, &end, 10);
+            if (p[1] < '0' || p[1] > '9' || *end != '}' || count == 0ul)
+                coin_template_error(template, p, "bad repetition");
+            if (errno == ERANGE || count > 51ul - pos)
+                coin_template_error(template, p, "more than 41 bytes");
+            n_copies = (u32_t)count;
+            p = end + 1;
+        }
+        for (; n_copies > 0u; n_copies--, pos++) {
+            if (pos >= 51u)
+                coin_template_error(template, p, "more than 41 bytes");
+            plan->radix[pos] = 0u;
+            for (idx = 0u; idx < 256u; idx++)
+                if (in_set[idx] != 0u)
+                    plan->charset[pos][plan->radix[pos]++] = (u08_t)idx;
+            if (plan->radix[pos] == 0u)
+                coin_template_error(template, p, "empty set");
+            plan->base.coin_as_chars[pos] = (char)plan->charset[pos][0];
+        }
+    }
+    if (*p != '\0')
+        coin_template_error(template, p, "more than 41 bytes");
+
+    // the fast word
+    plan->n_fast_values = 1u;
+    for (w = 2u; w < 13u; w++) {
+        for (n_values = 1u, idx = 4u * w; idx < 4u * w + 4u; idx++)
+            n_values *= plan->radix[idx];
+        if (plan->fast_counter && n_values < (1ul << 32))
+            continue; // a plain counter is better
+        if (n_values > 1u && (n_values >= PLAN_MIN_FAST_VALUES || (plan->n_fast_values < PLAN_MIN_FAST_VALUES && n_values >= plan->n_fast_values))) {
+            plan->fast_word = w;
+            plan->n_fast_values = n_values;
+            plan->fast_counter = (n_values == (1ul << 32));
+        }
+    }
+    if (plan->n_fast_values == 1u) {
+        fprintf(stderr, "compile_coin_template: \"%s\" has no varying byte\n", template);
+        exit(1);
+    }
+    for (idx = 0u; idx < 4u; idx++) {
+        u32_t byte = 4u * plan->fast_word + idx;
+        for (u32_t c = 1u; c < plan->radix[byte]; c++)
+            plan->fast_successor[idx][plan->charset[byte][c - 1u]] = plan->charset[byte][c];
+    }
+
+    // the slow bytes
+    plan->n_slow_values = 1u;
+    for (idx = 10u; idx < 51u; idx++)
+        if (plan->radix[idx] > 1u && idx / 4u != plan->fast_word) {
+            plan->slow_bytes[plan->n_slow++] = (u08_t)idx;
+            if (plan->n_slow_values != 0u)
+                plan->n_slow_values = (plan->n_slow_values <= 0xFFFFFFFFFFFFFFFFul / plan->radix[idx]) ? plan->n_slow_values * plan->radix[idx] : 0u;
+        }
+}
+
+static inline u32_t plan_fast_word(const coin_plan_t *plan, u64_t index) {
+    u32_t word = 0u, byte, pos;
+
+    for (byte = 0u; byte < 4u; byte++) {
+        pos = 4u * plan->fast_word + byte;
+        word |= (u32_t)plan->charset[pos][index % plan->radix[pos]] << (8u * byte);
+        index /= plan->radix[pos];
+    }
+    return word;
+}
+
+static inline u32_t plan_next_fast_word(const coin_plan_t *plan, u32_t word) {
+    u32_t byte, shift, c = plan->fast_successor[0][word & 0xFFu];
+
+    if (__builtin_expect(c != 0u, 1)) // no carry (the common case)
+        return (word & 0xFFFFFF00u) | c;
+    for (byte = 0u; byte < 4u; byte++) {
+        shift = 8u * byte;
+        c = plan->fast_successor[byte][(word >> shift) & 0xFFu];
+        word &= ~(0xFFu << shift);
+        if (c != 0u)
+            return word | (c << shift);
+        word |= (u32_t)plan->charset[4u * plan->fast_word + byte][0] << shift; // carry
+    }
+    return word;
+}
+
+static void plan_randomize(coin_plan_t *plan, u64_t seed) {
+    for (u32_t idx = 0u; idx < plan->n_slow; idx++) {
+        seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+        plan->slow_offset[idx] = (u32_t)((seed >> 33) % plan->radix[plan->slow_bytes[idx]]);
+    }
+}
+
+static void plan_chunk_coin(const coin_plan_t *plan, u64_t slow, u64_t first_fast_value, coin_t *coin) {
+    *coin = plan->base;
+    for (u32_t idx = 0u; idx < plan->n_slow; idx++) {
+        u32_t pos = plan->slow_bytes[idx], radix = plan->radix[pos];
+        coin->coin_as_chars[pos] = (char)plan->charset[pos][(plan->slow_offset[idx] + slow % radix) % radix];
+        slow /= radix;
+    }
+    coin->coin_as_ints[plan->fast_word] = plan_fast_word(plan, first_fast_value);
+}
+
+static void print_coin_plan(const char *name, const coin_plan_t *plan) {
+    char roles[14];
+
+    for (u32_t w = 0u; w < 13u; w++) {
+        roles[w] = 'c';
+        for (u32_t idx = 4u * w; idx < 4u * w + 4u; idx++)
+            if (plan->radix[idx] > 1u)
+                roles[w] = (w == plan->fast_word) ? 'F' : 's';
+    }
+    roles[13] = '\0';
+    printf("%s: plan %s (c constant, F fast, s slow words), %lu values of the fast word (midstate of %u words), %u slow bytes",
+           name, roles, plan->n_fast_values, plan->fast_word, plan->n_slow);
+    if (plan->n_slow_values != 0u)
+        printf(" (%lu combinations)\n", plan->n_slow_values);
+    else
+        printf(" (more than 2^64 combinations)\n");
+    fflush(stdout);
+}
+
+#endif
@@ -3,7 +3,17 @@
 //
 // Arquiteturas de Alto Desempenho 2024/2025
 //
-// save_deti_coin() --- save a DETI coin in a temporary buffer; with a NULL argument, update the DETI coins file vault
+// save_deti_coin() ------------ save a DETI coin in a temporary buffer; with a NULL argument, update the DETI coins file vault
+// deti_coin_format_is_good() -- check the format of a DETI coin (does not terminate the program on a bad coin)
+// save_checked_deti_coin() ---- save a DETI coin already checked (its power is known); with a NULL argument, update the vault
+// deti_coin_is_printable() ---- check if the bytes between "DETI coin " and the '\n' are printable ASCII
+// deti_coin_record_line() ----- the line of the vault of a coin (escaped when it has raw bytes)
+// deti_coin_parse_record() ---- get the coin of a line of the vault
+//
+// the bytes between "DETI coin " and the '\n' of a DETI coin may be anything (the raw-byte templates of
+// deti_coins_template.h produce such coins); each coin is a line of the vault:
+//   "Vuv:" and the 52 bytes of the coin, when its bytes 10 to 50 are printable ASCII (0x20..0x7E)
+//   "Ruv:" and bytes 0 to 50 of the coin, with \\ for \ and \xHH for a byte outside 0x20..0x7E, and then its '\n'
 //
 
 #ifndef DETI_COINS_VAULT
@@ -11,28 +21,163 @@
 
 #define DETI_COINS_VAULT_FILE  "deti_coins_vault.txt"
 
+static const char *deti_coins_vault_file = DETI_COINS_VAULT_FILE; // the file actually updated (the regression and a scratch server use other ones)
+
 #define STORE_DETI_COINS()  save_deti_coin(NULL)
 
-static void save_deti_coin(u32_t coin[13])
+//
+// hooks of the known-answer regression (deti_coins_regression.h)
+//   deti_coin_hit_mask ------- bits of the last word of the MD5 hash (as computed, before hash_byte_reverse()) that the
+//                              search loops require to be zero; all of them for a DETI coin, fewer for planted hits
+//   deti_coin_attempts_limit - attempts after which the search loops (each thread of the OpenMP ones) stop
+//   deti_coin_capture -------- when not NULL, save_deti_coin() hands the coins to it instead of checking and saving them
+//
+
+static u32_t deti_coin_hit_mask = 0xFFFFFFFFu;
+static u64_t deti_coin_attempts_limit = 0xFFFFFFFFFFFFFFFFul;
+static void (*deti_coin_capture)(u32_t coin[13]) = NULL;
+
+#include "probes.h"
+
+static const u08_t deti_coin_template[52u] =
+{
+  [ 0u] = (u08_t)'D',
+  [ 1u] = (u08_t)'E',
+  [ 2u] = (u08_t)'T',
+  [ 3u] = (u08_t)'I',
+  [ 4u] = (u08_t)' ',
+  [ 5u] = (u08_t)'c',
+  [ 6u] = (u08_t)'o',
+  [ 7u] = (u08_t)'i',
+  [ 8u] = (u08_t)'n',
+  [ 9u] = (u08_t)' ',
+  [51u] = (u08_t)'\n'
+};
+
+//
+// returns 1 if the coin has the appropriate format
+//
+
+static int deti_coin_format_is_good(const u32_t coin[13])
+{
+  u32_t idx;
+
+  for(idx = 0u;idx < 52u;idx++)
+    if(deti_coin_template[idx] != (u08_t)0 && deti_coin_template[idx] != ((const u08_t *)coin)[idx])
+      return 0;
+  return 1;
+}
+
+//
+// vault records
+//
+
+#define DETI_COIN_MAX_RECORD_SIZE (4u + 4u * 51u + 1u)
+
+static int hex_digit_value(char c)
+{ // -1 if c is not a lower case hexadecimal digit
+  return (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+static int deti_coin_is_printable(const u32_t coin[13])
+{
+  u32_t idx;
+
+  for(idx = 10u;idx < 51u;idx++)
+    if(((const u08_t *)coin)[idx] < (u08_t)0x20 || ((const u08_t *)coin)[idx] > (u08_t)0x7E)
+      return 0;
+  return 1;
+}
+
+static u32_t deti_coin_record_line(const u32_t record[14],char line[DETI_COIN_MAX_RECORD_SIZE])
+{ // a record of the buffer ("Vuv:" or "Ruv:" and the coin) -> its line in the vault (returns its size)
+  static const char hex[16] = "0123456789abcdef";
+  const u08_t *coin = (const u08_t *)&record[1];
+  u32_t idx,n;
+
+  memcpy((void *)line,(const void *)record,(size_t)4);
+  if(line[0] == 'V')
+  {
+    memcpy((void *)&line[4],(const void *)coin,(size_t)52);
+    return 56u;
+  }
+  for(n = 4u,idx = 0u;idx < 51u;idx++)
+    if(coin[idx] == (u08_t)'\\')
+    {
+      line[n++] = '\\';
+      line[n++] = '\\';
+    }
+    else if(coin[idx] < (u08_t)0x20 || coin[idx] > (u08_t)0x7E)
+    {
+      line[n++] = '\\';
+      line[n++] = 'x';
+      line[n++] = hex[coin[idx] >> 4];
+      line[n++] = hex[coin[idx] & 15u];
+    }
+    else
+      line[n++] = (char)coin[idx];
+  line[n++] = '\n';
+  return n;
+}
+
+static int deti_coin_parse_record(const char *line,u32_t length,u32_t coin[13])
+{ // a line of the vault (with its '\n') -> its coin (returns 1 if the line is good)
+  u08_t *bytes = (u08_t *)coin;
+  u32_t idx,n;
+  int high,low;
+
+  if(length == 56u && line[0] == 'V' && line[3] == ':')
+  {
+    memcpy((void *)bytes,(const void *)&line[4],(size_t)52);
+    return deti_coin_format_is_good(coin);
+  }
+  if(length < 56u || line[0] != 'R' || line[3] != ':' || line[length - 1u] != '\n')
+    return 0;
+  for(n = 4u,idx = 0u;idx < 51u && n < length - 1u;idx++)
+    if(line[n] != '\\')
+      bytes[idx] = (u08_t)line[n++];
+    else if(line[n + 1u] == '\\')
+    {
+      bytes[idx] = (u08_t)'\\';
+      n += 2u;
+    }
+    else
+    {
+      high = (n + 4u < length && line[n + 1u] == 'x') ? hex_digit_value(line[n + 2u]) : -1;
+      low = (high >= 0) ? hex_digit_value(line[n + 3u]) : -1;
+      if(low < 0)
+        return 0;
+      bytes[idx] = (u08_t)(16 * high + low);
+      n += 4u;
+    }
+  if(idx != 51u || n != length - 1u)
+    return 0;
+  bytes[51] = (u08_t)'\n';
+  return deti_coin_format_is_good(coin);
+}
+
+//
+// vault statistics (read, without locking, by the telemetry monitor)
+//
+
+static struct
+{
+  u64_t n_flushes;  // updates of the vault file
+  u64_t n_written;  // DETI coins written by them
+  u32_t n_buffered; // DETI coins waiting in the buffer
+}
+deti_coins_vault_stats;
+
+static void save_checked_deti_coin(u32_t coin[13],u32_t n)
 {
 # define MAX_SAVED_DETI_COINS 65536u
   static u32_t saved_deti_coins[MAX_SAVED_DETI_COINS * 14u];
   static u32_t n_saved_deti_coins = 0u;
-  static u08_t deti_coin_template[52u] =
-  {
-    [ 0u] = (u08_t)'D',
-    [ 1u] = (u08_t)'E',
-    [ 2u] = (u08_t)'T',
-    [ 3u] = (u08_t)'I',
-    [ 4u] = (u08_t)' ',
-    [ 5u] = (u08_t)'c',
-    [ 6u] = (u08_t)'o',
-    [ 7u] = (u08_t)'i',
-    [ 8u] = (u08_t)'n',
-    [ 9u] = (u08_t)' ',
-    [51u] = (u08_t)'\n'
-  };
-  u32_t idx,n,header,hash[4];
+  static u32_t n_saved_raw_deti_coins = 0u; // coins of the buffer with raw bytes (written one at a time, escaped)
+  static u64_t first_saved_ns; // time of the append of the oldest DETI coin in the buffer (probes.h)
+  u64_t now_ns;
+  u32_t idx,header;
+  int failed;
   FILE *fp;
 
   //
@@ -42,34 +187,85 @@ static void save_deti_coin(u32_t coin[13])
   {
     if(n_saved_deti_coins > 0u)
     {
-      fp = fopen(DETI_COINS_VAULT_FILE,"a");
-      if(fp == NULL                                                                                                        ||
-         fwrite((void *)&saved_deti_coins[0],(size_t)(14 * 4),(size_t)n_saved_deti_coins,fp) != (size_t)n_saved_deti_coins ||
-         fflush(fp) != 0                                                                                                   ||
-         fclose(fp) != 0)
+      now_ns = probe_time_ns();
+      DETI_PROBE2(vault_flush_start,n_saved_deti_coins,now_ns - first_saved_ns);
+      fp = fopen(deti_coins_vault_file,"a");
+      failed = (fp == NULL);
+      if(failed == 0 && n_saved_raw_deti_coins == 0u)
+        failed = (fwrite((void *)&saved_deti_coins[0],(size_t)(14 * 4),(size_t)n_saved_deti_coins,fp) != (size_t)n_saved_deti_coins);
+      for(idx = 0u;failed == 0 && n_saved_raw_deti_coins > 0u && idx < n_saved_deti_coins;idx++)
+      { // one line at a time, escaping the coins with raw bytes
+        char line[DETI_COIN_MAX_RECORD_SIZE];
+        u32_t size = deti_coin_record_line(&saved_deti_coins[14u * idx],line);
+
+        failed = (fwrite((void *)line,(size_t)1,(size_t)size,fp) != (size_t)size);
+      }
+      if(failed != 0 || fflush(fp) != 0 || fclose(fp) != 0)
       {
-        fprintf(stderr,"save_deti_coin: unable to update file \"" DETI_COINS_VAULT_FILE "\"\n");
+        fprintf(stderr,"save_deti_coin: unable to update file \"%s\"\n",deti_coins_vault_file);
         exit(1);
       }
+      deti_coins_vault_stats.n_flushes++;
+      deti_coins_vault_stats.n_written += (u64_t)n_saved_deti_coins;
+      DETI_PROBE3(vault_flush_end,n_saved_deti_coins,probe_time_ns() - now_ns,probe_time_ns() - first_saved_ns);
     }
     n_saved_deti_coins = 0u;
+    n_saved_raw_deti_coins = 0u;
+    deti_coins_vault_stats.n_buffered = 0u;
+  }
+  if(coin == NULL)
+    return;
+  //
+  // save the DETI coin in the buffer; the value of coin is the number of trailing zeros minus 32
+  // format of each line: "Vuv:" "coin_data" where u and v are ascii digits that encode, in base 10, the reported power of the DETI coin
+  // (a coin with raw bytes is kept with an "Ruv:" header and escaped when the buffer is written)
+  //
+  now_ns = probe_time_ns();
+  if(n_saved_deti_coins == 0u)
+    first_saved_ns = now_ns;
+  DETI_PROBE3(vault_append,n,n_saved_deti_coins + 1u,now_ns);
+  n -= 32u;
+  header = ((u32_t)'V' << 0) | (((u32_t)'0' + n / 10u) << 8) | (((u32_t)'0' + n % 10u) << 16) | ((u32_t)':'  << 24);
+  if(deti_coin_is_printable(coin) == 0)
+  {
+    header ^= (u32_t)('V' ^ 'R');
+    n_saved_raw_deti_coins++;
   }
+  n = 14u * n_saved_deti_coins++;
+  saved_deti_coins[n] = header;
+  for(idx = 0u;idx < 13u;idx++)
+    saved_deti_coins[n + 1u + idx] = coin[idx];
+  deti_coins_vault_stats.n_buffered = n_saved_deti_coins;
+# undef MAX_SAVED_DETI_COINS
+}
+
+static void save_deti_coin(u32_t coin[13])
+{
+  u32_t idx,n,hash[4];
+
   if(coin == NULL)
+  {
+    save_checked_deti_coin(NULL,0u);
+    return;
+  }
+  if(deti_coin_capture != NULL)
+  {
+    deti_coin_capture(coin);
     return;
+  }
   //
   // make sure that the coin has the appropriate format
   //
-  for(idx = 0u;idx < 52u;idx++)
-    if(deti_coin_template[idx] != (u08_t)0 && deti_coin_template[idx] != ((u08_t *)coin)[idx])
-    {
-      fprintf(stderr,"save_deti_coin: bad DETI coin format\n");
-      for(idx = 0u;idx < 52u;idx++)
-        if(deti_coin_template[idx] != (u08_t)0)
-          fprintf(stderr,"%2d 0x%02X 0x%02X %s\n",idx,(u32_t)(((u08_t *)coin)[idx]),(u32_t)deti_coin_template[idx],(deti_coin_template[idx] != ((u08_t *)coin)[idx]) ? "!=" : "==");
-        else
-          fprintf(stderr,"%2d 0x%02X\n",idx,(u32_t)(((u08_t *)coin)[idx]));
-      exit(1);
-    }
+  if(deti_coin_format_is_good(coin) == 0)
+  {
+    fprintf(stderr,"save_deti_coin: bad DETI coin format\n");
+    for(idx = 0u;idx < 52u;idx++)
+      if(deti_coin_template[idx] != (u08_t)0)
+        fprintf(stderr,"%2d 0x%02X 0x%02X %s\n",idx,(u32_t)(((u08_t *)coin)[idx]),(u32_t)deti_coin_template[idx],(deti_coin_template[idx] != ((u08_t *)coin)[idx]) ? "!=" : "==");
+      else
+        fprintf(stderr,"%2d 0x%02X\n",idx,(u32_t)(((u08_t *)coin)[idx]));
+    exit(1);
+  }
   //
   // compute MD5 hash
   //
@@ -87,17 +283,7 @@ static void save_deti_coin(u32_t coin[13])
     fprintf(stderr,"save_deti_coin: number of zero bits (%u) is too small\n",n);
     exit(1);
   }
-  //
-  // save the DETI coin in the buffer; the value of coin is the number of trailing zeros minus 32
-  // format of each line: "Vuv:" "coin_data" where u and v are ascii digits that encode, in base 10, the reported power of the DETI coin
-  //
-  n -= 32u;
-  header = ((u32_t)'V' << 0) | (((u32_t)'0' + n / 10u) << 8) | (((u32_t)'0' + n % 10u) << 16) | ((u32_t)':'  << 24);
-  n = 14u * n_saved_deti_coins++;
-  saved_deti_coins[n] = header;
-  for(idx = 0u;idx < 13u;idx++)
-    saved_deti_coins[n + 1u + idx] = coin[idx];
-# undef MAX_SAVED_DETI_COINS
+  save_checked_deti_coin(coin,n);
 }
 
 #endif
@@ -0,0 +1,323 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// verification pool of the server
+//
+// the event loop queues every received coin together with the connection that sent it; VERIFY_THREADS worker
+// threads take them VERIFY_BATCH_SIZE at a time, hash VERIFY_LANES coins per call of the widest MD5 engine that was
+// compiled (AVX-512, AVX2, AVX or plain C), and store the good ones in the vault; the number of accepted and of
+// rejected coins of each connection is handed back through a completion list, and an eventfd wakes up the event
+// loop, so a bad coin only costs its sender a rejection instead of terminating the server
+//
+// with VERIFY_JOURNAL the accepted coins of a batch are also appended to the write-ahead journal
+// (deti_coins_journal.h), which is synced before the results of the batch are handed back, so a coin is reported
+// as accepted (and acknowledged to its client) only once it survives a crash of the server
+//
+// a client resends the coins that were not acknowledged when its connection was lost, so some of them may already be
+// stored; a table of VERIFY_DEDUP_SIZE fingerprints of the recently stored coins (as in relay.h, but with sets of
+// VERIFY_DEDUP_WAYS entries, so a few coins sent again and again cannot keep evicting each other) keeps them out of the
+// journal and of the vault, but they are still accepted, and so acknowledged, like the first copy
+//
+// verify_pool_start() --------- start the worker threads
+// verify_pool_push() ---------- queue a received coin (event loop)
+// verify_pool_take_results() -- get the accepted/rejected counts of the coins verified so far (event loop)
+// verify_pool_stop() ---------- verify the queued coins, stop the worker threads and update the vault
+//
+
+#ifndef DETI_COINS_VERIFY
+#define DETI_COINS_VERIFY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include "deti_coins_journal.h"
+
+#define VERIFY_THREADS     2u  // Worker threads of the verification pool
+#define VERIFY_BATCH_SIZE  64u // Max number of coins taken from the queue at a time
+#define VERIFY_FLUSH_PERIOD 10 // Seconds between two vault updates (and journal truncations)
+#define VERIFY_DEDUP_SIZE  (1u << 16) // Fingerprints of the recently stored coins (a power of two)
+#define VERIFY_DEDUP_WAYS  4u  // Entries of a set of the fingerprint table (the oldest one is replaced)
+#ifndef VERIFY_JOURNAL
+# define VERIFY_JOURNAL    1   // Make the accepted coins durable before reporting them (0 to benchmark without it)
+#endif
+
+#if defined(MD5_CPU_AVX512)
+# define VERIFY_LANES   16u
+# define VERIFY_MD5(data, hash) md5_cpu_avx512((v16si *)(data), (v16si *)(hash))
+#elif defined(MD5_CPU_AVX2)
+# define VERIFY_LANES   8u
+# define VERIFY_MD5(data, hash) md5_cpu_avx2((v8si *)(data), (v8si *)(hash))
+#elif defined(MD5_CPU_AVX)
+# define VERIFY_LANES   4u
+# define VERIFY_MD5(data, hash) md5_cpu_avx((v4si *)(data), (v4si *)(hash))
+#else
+# define VERIFY_LANES   1u
+# define VERIFY_MD5(data, hash) md5_cpu((data), (hash))
+#endif
+
+// A received coin waiting to be verified
+typedef struct {
+    void *owner; // connection that sent the coin
+    u32_t coin[13];
+} verify_item_t;
+
+// Outcome of the verification of some coins of one connection
+typedef struct {
+    void *owner;
+    u32_t n_accepted, n_rejected;
+} verify_result_t;
+
+static struct {
+    pthread_mutex_t mutex;       // protects everything below except vault_mutex
+    pthread_cond_t not_empty;
+    pthread_mutex_t vault_mutex; // save_checked_deti_coin() and the journal are not thread safe
+    verify_item_t *items;        // ring buffer of the queued coins
+    size_t head, n_items, capacity;
+    verify_result_t *results;    // completion list (taken by the event loop)
+    size_t n_results, results_capacity;
+    u64_t n_verified, n_rejected, n_duplicates;
+    u64_t dedup[VERIFY_DEDUP_SIZE]; // protected by vault_mutex
+    int event_fd;                // signaled when results are added
+    int stop;
+    pthread_t threads[VERIFY_THREADS];
+} verify_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .vault_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .event_fd = -1,
+};
+
+static void verify_pool_push(void *owner, const u32_t coin[13]) {
+    pthread_mutex_lock(&verify_pool.mutex);
+    if (verify_pool.n_items == verify_pool.capacity) {
+        // Grow the ring buffer (unwrapping it)
+        size_t new_capacity = (verify_pool.capacity == 0) ? 1024 : 2 * verify_pool.capacity;
+        verify_item_t *items = malloc(new_capacity * sizeof(verify_item_t));
+        if (items == NULL) {
+            fprintf(stderr, "verify_pool_push: out of memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < verify_pool.n_items; i++)
+            items[i] = verify_pool.items[(verify_pool.head + i) % verify_pool.capacity];
+        free(verify_pool.items);
+        verify_pool.items = items;
+        verify_pool.head = 0;
+        verify_pool.capacity = new_capacity;
+    }
+    verify_item_t *item = &verify_pool.items[(verify_pool.head + verify_pool.n_items) % verify_pool.capacity];
+    item->owner = owner;
+    memcpy(item->coin, coin, sizeof(item->coin));
+    verify_pool.n_items++;
+    pthread_cond_signal(&verify_pool.not_empty);
+    pthread_mutex_unlock(&verify_pool.mutex);
+}
+
+// Moves the results gathered so far to *results (the caller frees it) and returns their number
+static size_t verify_pool_take_results(verify_result_t **results) {
+    u64_t counter;
+    size_t n_results;
+
+    if (read(verify_pool.event_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+        perror("verify_pool_take_results: read");
+    pthread_mutex_lock(&verify_pool.mutex);
+    *results = verify_pool.results;
+    n_results = verify_pool.n_results;
+    verify_pool.results = NULL;
+    verify_pool.n_results = verify_pool.results_capacity = 0;
+    pthread_mutex_unlock(&verify_pool.mutex);
+    return n_results;
+}
+
+// Hashes up to VERIFY_LANES coins with one call of the MD5 engine and returns their powers (0 for a bad coin)
+static void verify_coins(const verify_item_t *items, u32_t n_items, u32_t power[VERIFY_LANES]) {
+    u32_t data[13u * VERIFY_LANES] __attribute__((aligned(64)));
+    u32_t hash[4u * VERIFY_LANES] __attribute__((aligned(64)));
+    u32_t lane, idx, h[4];
+
+    for (lane = 0u; lane < VERIFY_LANES; lane++) // the unused lanes hash a copy of the last coin
+        for (idx = 0u; idx < 13u; idx++)
+            data[VERIFY_LANES * idx + lane] = items[(lane < n_items) ? lane : n_items - 1u].coin[idx];
+    VERIFY_MD5(data, hash);
+    for (lane = 0u; lane < n_items; lane++) {
+        power[lane] = 0u;
+        if (hash[VERIFY_LANES * 3u + lane] != 0u || !deti_coin_format_is_good(items[lane].coin))
+            continue;
+        for (idx = 0u; idx < 4u; idx++)
+            h[idx] = hash[VERIFY_LANES * idx + lane];
+        hash_byte_reverse(h);
+        power[lane] = deti_coin_power(h);
+    }
+}
+
+static u64_t verify_fingerprint(const u32_t coin[13]) {
+    const u08_t *data = (const u08_t *)coin;
+    u64_t h = 0xCBF29CE484222325ul; // FNV-1a
+
+    for (u32_t i = 0u; i < 13u * 4u; i++)
+        h = (h ^ data[i]) * 0x100000001B3ul;
+    return h | 1ul; // 0 marks an empty entry
+}
+
+// Returns 1 if the coin was stored recently (and remembers it otherwise); called with vault_mutex held
+static int verify_is_duplicate(const u32_t coin[13]) {
+    u64_t fingerprint = verify_fingerprint(coin);
+    u64_t *set = &verify_pool.dedup[fingerprint & (VERIFY_DEDUP_SIZE - VERIFY_DEDUP_WAYS)];
+
+    for (u32_t way = 0u; way < VERIFY_DEDUP_WAYS; way++)
+        if (set[way] == fingerprint)
+            return 1;
+    memmove(&set[1], &set[0], (VERIFY_DEDUP_WAYS - 1u) * sizeof(set[0]));
+    set[0] = fingerprint;
+    return 0;
+}
+
+// Adds the outcome of one coin to the completion list (consecutive coins of a connection share one entry)
+static void verify_add_result(verify_result_t *results, u32_t *n_results, void *owner, int accepted) {
+    if (*n_results == 0u || results[*n_results - 1u].owner != owner) {
+        results[*n_results].owner = owner;
+        results[*n_results].n_accepted = results[*n_results].n_rejected = 0u;
+        (*n_results)++;
+    }
+    if (accepted)
+        results[*n_results - 1u].n_accepted++;
+    else
+        results[*n_results - 1u].n_rejected++;
+}
+
+static void *verify_thread(void *arg) {
+    verify_item_t batch[VERIFY_BATCH_SIZE];
+    verify_result_t results[VERIFY_BATCH_SIZE];
+    u32_t records[VERIFY_BATCH_SIZE][14], accepted[VERIFY_BATCH_SIZE], accepted_power[VERIFY_BATCH_SIZE];
+    u32_t n_batch, n_results, n_rejected, n_accepted, n_stored, i, j, power[VERIFY_LANES];
+    u64_t one = 1;
+    int first_thread = (arg == (void *)0), pending = 0, stop;
+    time_t last_flush = time(NULL);
+
+    for (;;) {
+        pthread_mutex_lock(&verify_pool.mutex);
+        while (verify_pool.n_items == 0 && !verify_pool.stop) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            if (pthread_cond_timedwait(&verify_pool.not_empty, &verify_pool.mutex, &deadline) == ETIMEDOUT)
+                break;
+        }
+        for (n_batch = 0u; n_batch < VERIFY_BATCH_SIZE && verify_pool.n_items > 0; n_batch++) {
+            batch[n_batch] = verify_pool.items[verify_pool.head];
+            verify_pool.head = (verify_pool.head + 1) % verify_pool.capacity;
+            verify_pool.n_items--;
+        }
+        stop = verify_pool.stop && verify_pool.n_items == 0;
+        pthread_mutex_unlock(&verify_pool.mutex);
+
+        if (n_batch > 0u) {
+            n_results = n_rejected = n_accepted = 0u;
+            for (i = 0u; i < n_batch; i += VERIFY_LANES) {
+                u32_t n = (n_batch - i < VERIFY_LANES) ? n_batch - i : VERIFY_LANES;
+                verify_coins(&batch[i], n, power);
+                for (j = 0u; j < n; j++) {
+                    if (power[j] >= 32u) {
+                        accepted[n_accepted] = i + j;
+                        accepted_power[n_accepted++] = power[j];
+                    } else {
+                        n_rejected++;
+                    }
+                    verify_add_result(results, &n_results, batch[i + j].owner, power[j] >= 32u);
+                }
+            }
+
+            // Group commit: one write() and one fdatasync() for all the accepted coins of the batch that are not
+            // duplicates (the sync is done outside of the vault mutex; a duplicate may still be waiting for the sync of
+            // another thread, but the journal is synced in order, so the sync of this thread covers it as well)
+            n_stored = 0u;
+            if (n_accepted > 0u) {
+                pthread_mutex_lock(&verify_pool.vault_mutex);
+                for (j = 0u; j < n_accepted; j++)
+                    if (!verify_is_duplicate(batch[accepted[j]].coin)) {
+                        accepted[n_stored] = accepted[j];
+                        accepted_power[n_stored] = accepted_power[j];
+                        journal_record(records[n_stored++], batch[accepted[j]].coin, accepted_power[j]);
+                    }
+                if (VERIFY_JOURNAL && n_stored > 0u)
+                    journal_append(records, n_stored);
+                for (j = 0u; j < n_stored; j++)
+                    save_checked_deti_coin(batch[accepted[j]].coin, accepted_power[j]);
+                pthread_mutex_unlock(&verify_pool.vault_mutex);
+                pending = 1;
+                if (VERIFY_JOURNAL)
+                    journal_sync();
+            }
+
+            // Hand the results to the event loop
+            pthread_mutex_lock(&verify_pool.mutex);
+            if (verify_pool.n_results + n_results > verify_pool.results_capacity) {
+                size_t new_capacity = 2 * verify_pool.results_capacity + VERIFY_BATCH_SIZE;
+                verify_result_t *new_results = realloc(verify_pool.results, new_capacity * sizeof(verify_result_t));
+                if (new_results == NULL) {
+                    fprintf(stderr, "verify_thread: out of memory\n");
+                    exit(1);
+                }
+                verify_pool.results = new_results;
+                verify_pool.results_capacity = new_capacity;
+            }
+            memcpy(&verify_pool.results[verify_pool.n_results], results, n_results * sizeof(verify_result_t));
+            verify_pool.n_results += n_results;
+            verify_pool.n_verified += n_batch;
+            verify_pool.n_rejected += n_rejected;
+            verify_pool.n_duplicates += n_accepted - n_stored;
+            pthread_mutex_unlock(&verify_pool.mutex);
+            if (write(verify_pool.event_fd, &one, sizeof(one)) < 0)
+                perror("verify_thread: write");
+        }
+
+        // The first thread updates the vault from time to time (verify_pool_stop() does the last update)
+        if (first_thread && pending && time(NULL) - last_flush >= VERIFY_FLUSH_PERIOD) {
+            pthread_mutex_lock(&verify_pool.vault_mutex);
+            if (VERIFY_JOURNAL)
+                journal_checkpoint();
+            else
+                save_checked_deti_coin(NULL, 0u);
+            pthread_mutex_unlock(&verify_pool.vault_mutex);
+            last_flush = time(NULL);
+            pending = 0;
+        }
+        if (stop)
+            return NULL;
+    }
+}
+
+// Replays the journal of a previous run, starts the worker threads and returns the eventfd to be watched by the event loop
+static int verify_pool_start(void) {
+    if (VERIFY_JOURNAL)
+        journal_open();
+    if ((verify_pool.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned long i = 0; i < VERIFY_THREADS; i++)
+        if (pthread_create(&verify_pool.threads[i], NULL, verify_thread, (void *)i) != 0) {
+            perror("Failed to create a verification thread");
+            exit(EXIT_FAILURE);
+        }
+    return verify_pool.event_fd;
+}
+
+static void verify_pool_stop(void) {
+    pthread_mutex_lock(&verify_pool.mutex);
+    verify_pool.stop = 1;
+    pthread_cond_broadcast(&verify_pool.not_empty);
+    pthread_mutex_unlock(&verify_pool.mutex);
+    for (u32_t i = 0; i < VERIFY_THREADS; i++)
+        pthread_join(verify_pool.threads[i], NULL);
+    if (VERIFY_JOURNAL)
+        journal_checkpoint();
+    else
+        STORE_DETI_COINS();
+}
+
+#endif
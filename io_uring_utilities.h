@@ -0,0 +1,178 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// minimal io_uring support through the raw system calls (no liburing)
+//
+// io_ring_setup() ---------- create a ring (returns -1, with errno set, when io_uring is not available)
+// io_ring_get_sqe() -------- get a cleared submission queue entry (submits the queued ones when the queue is full)
+// io_ring_submit() --------- submit the queued entries and wait for at least wait_nr completions
+// io_ring_peek_cqe() ------- get the next completion, or NULL
+// io_ring_cqe_seen() ------- consume the completion returned by io_ring_peek_cqe()
+// io_ring_exit() ----------- destroy a ring
+// io_buffers_setup() ------- register a ring of provided buffers (for multishot receives)
+// io_buffers_recycle() ----- give a buffer back to the kernel
+//
+
+#ifndef IO_URING_UTILITIES
+#define IO_URING_UTILITIES
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define IO_URING_AVAILABLE 1
+# endif
+#endif
+
+#ifdef IO_URING_AVAILABLE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned n_queued; // entries filled but not yet submitted
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+} io_ring_t;
+
+// A ring of provided buffers (buffer group) for the receives with IOSQE_BUFFER_SELECT
+typedef struct {
+    struct io_uring_buf_ring *ring;
+    u08_t *buffers;
+    unsigned n_buffers, buffer_size;
+    unsigned short group;
+} io_buffers_t;
+
+static int io_ring_setup(io_ring_t *ring, unsigned sq_entries, unsigned cq_entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+    if ((ring->fd = (int)syscall(__NR_io_uring_setup, sq_entries, &params)) < 0)
+        return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        ring->fd = -1;
+        errno = ENOSYS; // too old
+        return -1;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size; // one mapping for both rings
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        ring->fd = -1;
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+    ring->sq_head = (unsigned *)((u08_t *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((u08_t *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((u08_t *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((u08_t *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((u08_t *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((u08_t *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((u08_t *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((u08_t *)ring->cq_ring + params.cq_off.cqes);
+    ring->sq_entries = params.sq_entries;
+    return 0;
+}
+
+static int io_ring_submit(io_ring_t *ring, unsigned wait_nr) {
+    unsigned n = ring->n_queued;
+    int r;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + n, __ATOMIC_RELEASE);
+    ring->n_queued = 0;
+    r = (int)syscall(__NR_io_uring_enter, ring->fd, n, wait_nr, (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    return (r < 0) ? -1 : 0;
+}
+
+static struct io_uring_sqe *io_ring_get_sqe(io_ring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE), index;
+    struct io_uring_sqe *sqe;
+
+    while (*ring->sq_tail + ring->n_queued - head >= ring->sq_entries) {
+        (void)io_ring_submit(ring, 0); // the queue is full
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+    index = (*ring->sq_tail + ring->n_queued) & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->n_queued++;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static struct io_uring_cqe *io_ring_peek_cqe(io_ring_t *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+static void io_ring_cqe_seen(io_ring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static void io_ring_exit(io_ring_t *ring) {
+    if (ring->fd < 0)
+        return;
+    munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+static void io_buffers_recycle(io_buffers_t *b, unsigned bid) {
+    unsigned short tail = b->ring->tail;
+    struct io_uring_buf *buf = &b->ring->bufs[tail & (b->n_buffers - 1)];
+
+    buf->addr = (u64_t)(uintptr_t)&b->buffers[(size_t)bid * b->buffer_size];
+    buf->len = b->buffer_size;
+    buf->bid = (unsigned short)bid;
+    __atomic_store_n(&b->ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static int io_buffers_setup(io_ring_t *ring, io_buffers_t *b, unsigned short group, unsigned n_buffers, unsigned buffer_size) {
+    struct io_uring_buf_reg reg;
+    size_t ring_size = n_buffers * sizeof(struct io_uring_buf);
+
+    b->group = group;
+    b->n_buffers = n_buffers; // a power of two
+    b->buffer_size = buffer_size;
+    b->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    b->buffers = malloc((size_t)n_buffers * buffer_size);
+    if (b->ring == MAP_FAILED || b->buffers == NULL)
+        return -1;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (u64_t)(uintptr_t)b->ring;
+    reg.ring_entries = n_buffers;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+    b->ring->tail = 0;
+    for (unsigned bid = 0; bid < n_buffers; bid++)
+        io_buffers_recycle(b, bid);
+    return 0;
+}
+
+#endif
+#endif
@@ -0,0 +1,382 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// load_generator() --- benchmark of server() with thousands of simulated client_search() miners
+//
+// a single-threaded epoll event loop opens n_clients connections to a server on localhost and speaks the client
+// protocol (deti_coins_protocol.h) without hashing anything: after the hello each connection reports, every
+// LOAD_TICK milliseconds, the synthetic coins that are due at its hit rate (one MSG_HITS frame with random
+// candidates of its lease, which the server rebuilds, verifies and rejects) and sends heartbeats at its heartbeat
+// rate; only when asked to (replay_vault), the coins of the vault (DETI_COINS_VAULT_FILE) are sent instead with
+// MSG_COINS, so the coins are accepted and go through the journal of the server, as the real ones do; the server must
+// then be started with a scratch vault (see server()), or it appends them to the real vault once more
+//
+// measured on the client side of each connection:
+//   accept latency ..... from connect() to the first MSG_LEASE (accept, hello and lease issue by the server)
+//   ingestion rate ..... coins covered by a MSG_COINS_ACK per second
+//   ack latency ........ from the send() of a coin frame to the MSG_COINS_ACK that covers it
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include "deti_coins_protocol.h"
+#include "server_avx.h" // MAX_EPOLL_EVENTS and raise_open_files_limit()
+
+#ifndef LOAD_GENERATOR
+#define LOAD_GENERATOR
+
+#define LOAD_TICK 10 // Milliseconds between two passes over the connections
+#define LOAD_OUTPUT_SIZE 4096u // Send buffer of each connection (a tick with no room for its frame is skipped)
+#define LOAD_MAX_IN_FLIGHT 64u // Coin frames of a connection waiting for their ack (more are not sent)
+#define LOAD_MAX_VAULT_COINS 1024u // Coins taken from the vault
+#define LOAD_DRAIN_TIME 2 // Seconds allowed at the end for the last acks
+
+// A coin frame waiting for its ack
+typedef struct {
+    u32_t coins_after; // coins sent on the connection including this frame
+    double send_time;
+} load_frame_t;
+
+// State of one simulated miner
+typedef struct {
+    int fd;
+    int connected;       // the non-blocking connect() has completed
+    int has_lease;
+    u32_t n_leases;      // leases received
+    keyspace_lease_t lease;
+    double connect_time;
+    double next_hit, next_heartbeat; // times of the next coin and of the next heartbeat
+    u32_t coins_sent, coins_acked;
+    u32_t head, n_in_flight;
+    load_frame_t in_flight[LOAD_MAX_IN_FLIGHT];
+    u32_t n_input, n_output;
+    u08_t input[PROTOCOL_HEADER_SIZE + PROTOCOL_LEASE_SIZE];
+    u08_t output[LOAD_OUTPUT_SIZE];
+} load_connection_t;
+
+// Latency samples in microseconds
+typedef struct {
+    u32_t *samples;
+    size_t n_samples, capacity;
+} load_samples_t;
+
+static struct {
+    load_samples_t accept_latency, ack_latency;
+    u64_t n_coins_sent, n_coins_acked, n_heartbeats, n_skipped_ticks;
+    u32_t n_connected, n_failed, n_closed;
+    u32_t n_vault_coins;
+    u32_t vault_coins[LOAD_MAX_VAULT_COINS][13];
+} load;
+
+static double load_now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+static void load_add_sample(load_samples_t *s, double seconds) {
+    if (s->n_samples == s->capacity) {
+        s->capacity = (s->capacity == 0) ? 4096 : 2 * s->capacity;
+        if ((s->samples = realloc(s->samples, s->capacity * sizeof(u32_t))) == NULL) {
+            fprintf(stderr, "load_add_sample: out of memory\n");
+            exit(1);
+        }
+    }
+    s->samples[s->n_samples++] = (u32_t)(1.0e6 * seconds + 0.5);
+}
+
+static int load_compare_samples(const void *a, const void *b) {
+    u32_t x = *(const u32_t *)a, y = *(const u32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void load_print_samples(const char *name, load_samples_t *s) {
+    if (s->n_samples == 0) {
+        printf("%s: no samples\n", name);
+        return;
+    }
+    qsort(s->samples, s->n_samples, sizeof(u32_t), load_compare_samples);
+    printf("%s: %zu samples, p50 = %.3f ms, p99 = %.3f ms, max = %.3f ms\n", name, s->n_samples,
+           1.0e-3 * s->samples[s->n_samples / 2], 1.0e-3 * s->samples[(99 * s->n_samples) / 100],
+           1.0e-3 * s->samples[s->n_samples - 1]);
+}
+
+// Take (up to LOAD_MAX_VAULT_COINS) coins of the vault, to be sent as accepted coins
+static void load_read_vault(void) {
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    FILE *fp;
+
+    if ((fp = fopen(DETI_COINS_VAULT_FILE, "r")) == NULL)
+        return;
+    while (load.n_vault_coins < LOAD_MAX_VAULT_COINS && (length = getline(&line, &size, fp)) > 0)
+        if (deti_coin_parse_record(line, (u32_t)length, load.vault_coins[load.n_vault_coins]))
+            load.n_vault_coins++;
+    free(line);
+    fclose(fp);
+}
+
+// Append a frame to the output of a connection (returns -1 if there is no room for it)
+static int load_queue_frame(load_connection_t *c, u32_t type, const u08_t *payload, u32_t length) {
+    if (c->n_output + PROTOCOL_HEADER_SIZE + length > LOAD_OUTPUT_SIZE)
+        return -1;
+    protocol_put_header(&c->output[c->n_output], type, length);
+    if (length > 0)
+        memcpy(&c->output[c->n_output + PROTOCOL_HEADER_SIZE], payload, length);
+    c->n_output += PROTOCOL_HEADER_SIZE + length;
+    return 0;
+}
+
+// Send the pending output (returns -1 if the connection must be closed)
+static int load_flush(int epoll_fd, load_connection_t *c) {
+    struct epoll_event event;
+    u32_t n_sent = 0;
+
+    while (n_sent < c->n_output) {
+        ssize_t n = send(c->fd, &c->output[n_sent], c->n_output - n_sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            break;
+        if (n <= 0)
+            return -1;
+        n_sent += (u32_t)n;
+    }
+    memmove(c->output, &c->output[n_sent], c->n_output - n_sent);
+    c->n_output -= n_sent;
+    event.events = (c->n_output > 0) ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = c;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+}
+
+static void load_close(int epoll_fd, load_connection_t *c) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    load.n_closed++;
+}
+
+// Handle the frames sent by the server (returns -1 if the connection must be closed)
+static int load_receive(load_connection_t *c) {
+    u32_t type, length, used = 0;
+    ssize_t n;
+
+    while ((n = recv(c->fd, &c->input[c->n_input], sizeof(c->input) - c->n_input, MSG_DONTWAIT)) > 0) {
+        c->n_input += (u32_t)n;
+        while (c->n_input - used >= PROTOCOL_HEADER_SIZE) {
+            if (protocol_get_header(&c->input[used], &type, &length) < 0 || PROTOCOL_HEADER_SIZE + length > sizeof(c->input))
+                return -1;
+            if (c->n_input - used < PROTOCOL_HEADER_SIZE + length)
+                break;
+            const u08_t *payload = &c->input[used + PROTOCOL_HEADER_SIZE];
+            if (type == MSG_LEASE && length == PROTOCOL_LEASE_SIZE) {
+                if (c->n_leases++ == 0)
+                    load_add_sample(&load.accept_latency, load_now() - c->connect_time);
+                protocol_get_lease(payload, &c->lease);
+                c->has_lease = 1;
+            } else if (type == MSG_COINS_ACK && length == 4) {
+                double now = load_now();
+                u32_t n_acked = get_u32(payload);
+                while (c->n_in_flight > 0 && c->in_flight[c->head].coins_after <= n_acked) {
+                    load_add_sample(&load.ack_latency, now - c->in_flight[c->head].send_time);
+                    c->head = (c->head + 1) % LOAD_MAX_IN_FLIGHT;
+                    c->n_in_flight--;
+                }
+                load.n_coins_acked += n_acked - c->coins_acked;
+                c->coins_acked = n_acked;
+            } else if (type == MSG_REVOKE && length == 4) {
+                c->has_lease = 0; // a heartbeat acked a lease the server no longer knows about: ask for another one
+                (void)load_queue_frame(c, MSG_LEASE_REQUEST, NULL, 0);
+            }
+            used += PROTOCOL_HEADER_SIZE + length;
+        }
+        memmove(c->input, &c->input[used], c->n_input - used);
+        c->n_input -= used;
+        used = 0;
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        return -1;
+    return 0;
+}
+
+// Queue the coins and the heartbeat that are due
+static void load_generate(load_connection_t *c, double now, double hit_rate, double heartbeat_rate) {
+    u08_t payload[4u + PROTOCOL_MAX_COINS * PROTOCOL_COIN_SIZE];
+    u32_t n_coins = 0, max_coins = (load.n_vault_coins > 0) ? PROTOCOL_MAX_COINS : PROTOCOL_MAX_HITS, length;
+
+    if (!c->has_lease)
+        return;
+    if (hit_rate > 0.0)
+        while (c->next_hit <= now && n_coins < max_coins) {
+            if (load.n_vault_coins > 0) {
+                memcpy(&payload[4u + n_coins * PROTOCOL_COIN_SIZE], load.vault_coins[random() % load.n_vault_coins], PROTOCOL_COIN_SIZE);
+            } else {
+                put_u32(&payload[4u + n_coins * PROTOCOL_HIT_SIZE], c->lease.template_id);
+                put_u64(&payload[8u + n_coins * PROTOCOL_HIT_SIZE], c->lease.first + (u64_t)random() % c->lease.count);
+            }
+            n_coins++;
+            c->next_hit += 1.0 / hit_rate;
+        }
+    if (n_coins > 0) {
+        length = 4u + n_coins * ((load.n_vault_coins > 0) ? PROTOCOL_COIN_SIZE : PROTOCOL_HIT_SIZE);
+        put_u32(payload, n_coins);
+        if (c->n_in_flight == LOAD_MAX_IN_FLIGHT ||
+            load_queue_frame(c, (load.n_vault_coins > 0) ? MSG_COINS : MSG_HITS, payload, length) < 0) {
+            load.n_skipped_ticks++; // the coins are dropped (the server does not keep up)
+        } else {
+            c->coins_sent += n_coins;
+            c->in_flight[(c->head + c->n_in_flight) % LOAD_MAX_IN_FLIGHT] = (load_frame_t){ c->coins_sent, now };
+            c->n_in_flight++;
+            load.n_coins_sent += n_coins;
+        }
+    }
+    if (heartbeat_rate > 0.0 && c->next_heartbeat <= now) {
+        put_u64(&payload[0], 0);
+        put_u32(&payload[8], c->coins_sent);
+        put_u32(&payload[12], 1);
+        put_u32(&payload[16], c->lease.lease_id);
+        put_u64(&payload[20], 0); // nothing done, but the lease does not expire
+        if (load_queue_frame(c, MSG_PROGRESS, payload, PROTOCOL_PROGRESS_SIZE(1)) == 0)
+            load.n_heartbeats++;
+        c->next_heartbeat = now + 1.0 / heartbeat_rate;
+    }
+}
+
+// Open a non-blocking connection to the server (returns -1 on failure)
+static int load_connect(int epoll_fd, load_connection_t *c, u32_t port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    struct epoll_event event;
+
+    memset(c, 0, sizeof(*c));
+    if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    c->connect_time = load_now();
+    if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    event.events = EPOLLIN | EPOLLOUT; // EPOLLOUT: the connection is established
+    event.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void load_generator(u32_t port, u32_t n_clients, double hit_rate, double heartbeat_rate, int replay_vault) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    load_connection_t *miners;
+    double start, stop = 0.0, now, last_tick = 0.0;
+    int epoll_fd;
+
+    (void)signal(SIGINT, alarm_signal_handler);
+    (void)signal(SIGPIPE, SIG_IGN);
+    raise_open_files_limit();
+    if (replay_vault) {
+        load_read_vault();
+        if (load.n_vault_coins == 0u) {
+            fprintf(stderr, "load_generator: no coins to replay in \"" DETI_COINS_VAULT_FILE "\"\n");
+            exit(1);
+        }
+    }
+    printf("Load generator: %u connections to port %u, %.3f coins/s and %.3f heartbeats/s per connection, %s\n", n_clients, port,
+           hit_rate, heartbeat_rate, (load.n_vault_coins > 0) ? "coins of the vault (accepted; the server must use a scratch vault)" : "random candidates (rejected)");
+    fflush(stdout);
+    if ((miners = calloc(n_clients, sizeof(load_connection_t))) == NULL) {
+        fprintf(stderr, "load_generator: out of memory\n");
+        exit(1);
+    }
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    start = load_now();
+    for (u32_t i = 0; i < n_clients; i++)
+        if (load_connect(epoll_fd, &miners[i], port) < 0) {
+            miners[i].fd = -1;
+            load.n_failed++;
+        }
+
+    // Event loop (after a stop request it only waits, for at most LOAD_DRAIN_TIME seconds, for the last acks)
+    for (;;) {
+        int n_events = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, LOAD_TICK);
+        now = load_now();
+        for (int i = 0; i < n_events; i++) {
+            load_connection_t *c = events[i].data.ptr;
+            if (c->fd < 0)
+                continue;
+            if (!c->connected && (events[i].events & EPOLLOUT)) {
+                int error = 0;
+                socklen_t error_size = sizeof(error);
+                u08_t payload[8];
+                if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &error_size) < 0 || error != 0) {
+                    load_close(epoll_fd, c);
+                    load.n_failed++;
+                    continue;
+                }
+                c->connected = 1;
+                load.n_connected++;
+                c->next_hit = now + (double)random() / (double)RAND_MAX / ((hit_rate > 0.0) ? hit_rate : 1.0); // random phases
+                c->next_heartbeat = now + (double)random() / (double)RAND_MAX / ((heartbeat_rate > 0.0) ? heartbeat_rate : 1.0);
+                put_u32(&payload[0], 1);
+                put_u32(&payload[4], 1);
+                (void)load_queue_frame(c, MSG_HELLO, payload, 8);
+            }
+            if (((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && load_receive(c) < 0) || load_flush(epoll_fd, c) < 0)
+                load_close(epoll_fd, c);
+        }
+        if (stop_request != 0 && stop == 0.0) {
+            stop = now;
+            printf("Load generator: stopping, waiting for the last acks\n");
+            fflush(stdout);
+        }
+        if (stop != 0.0) {
+            u32_t n_waiting = 0;
+            for (u32_t i = 0; i < n_clients; i++)
+                n_waiting += (miners[i].fd >= 0 && miners[i].n_in_flight > 0);
+            if (n_waiting == 0 || now - stop >= LOAD_DRAIN_TIME)
+                break;
+            continue;
+        }
+        if (now - last_tick >= 1.0e-3 * LOAD_TICK) {
+            for (u32_t i = 0; i < n_clients; i++) {
+                load_connection_t *c = &miners[i];
+                if (c->fd < 0 || !c->connected)
+                    continue;
+                load_generate(c, now, hit_rate, heartbeat_rate);
+                if (c->n_output > 0 && load_flush(epoll_fd, c) < 0)
+                    load_close(epoll_fd, c);
+            }
+            last_tick = now;
+        }
+    }
+
+    // Report
+    if (stop == 0.0)
+        stop = now;
+    printf("Load generator: %u connection%s established, %u failed, %u closed by the server\n", load.n_connected,
+           (load.n_connected == 1) ? "" : "s", load.n_failed, load.n_closed);
+    load_print_samples("Accept latency (connect to first lease)", &load.accept_latency);
+    printf("Coins: %lu sent, %lu acknowledged in %.3f s (%.0f coins/s), %lu heartbeats, %lu ticks skipped (no room)\n",
+           load.n_coins_sent, load.n_coins_acked, stop - start, (double)load.n_coins_acked / (stop - start), load.n_heartbeats,
+           load.n_skipped_ticks);
+    load_print_samples("Ack latency (coin frame sent to MSG_COINS_ACK)", &load.ack_latency);
+    for (u32_t i = 0; i < n_clients; i++)
+        if (miners[i].fd >= 0)
+            close(miners[i].fd);
+    close(epoll_fd);
+    free(miners);
+}
+
+#endif
@@ -80,21 +80,10 @@
 #define MD5_OP(F,a,b,c,d,x,s,ac)  a += F(b,c,d) + x + C(ac); if(s != 0) a = ROTATE(a,s); a += b
 
 //
-// the custom md5 code (message with exactly 52 bytes)
+// the custom md5 code (message with exactly 52 bytes), in pieces shared with the midstate variants below
 //
 
-#define CUSTOM_MD5_CODE()                           \
-  do                                                \
-  {                                                 \
-    /* initial state */                             \
-    STATE(0) = C(0x67452301u);                      \
-    STATE(1) = C(0xEFCDAB89u);                      \
-    STATE(2) = C(0x98BADCFEu);                      \
-    STATE(3) = C(0x10325476u);                      \
-    a = STATE(0);                                   \
-    b = STATE(1);                                   \
-    c = STATE(2);                                   \
-    d = STATE(3);                                   \
+#define MD5_LOAD_DATA()                             \
     /* initial data (13*4 bytes) + padding */       \
     X( 0) = DATA( 0);                               \
     X( 1) = DATA( 1);                               \
@@ -111,24 +100,9 @@
     X(12) = DATA(12);                               \
     X(13) = C(0x00000080u); /* padding */           \
     X(14) = C(13u * 32u);   /* number  */           \
-    X(15) = C(0x00000000u); /* of bits */           \
-    /* first round */                               \
-    MD5_OP(MD5_F,a,b,c,d,X( 0),MD5_11,0xD76AA478u); \
-    MD5_OP(MD5_F,d,a,b,c,X( 1),MD5_12,0xE8C7B756u); \
-    MD5_OP(MD5_F,c,d,a,b,X( 2),MD5_13,0x242070DBu); \
-    MD5_OP(MD5_F,b,c,d,a,X( 3),MD5_14,0xC1BDCEEEu); \
-    MD5_OP(MD5_F,a,b,c,d,X( 4),MD5_11,0xF57C0FAFu); \
-    MD5_OP(MD5_F,d,a,b,c,X( 5),MD5_12,0x4787C62Au); \
-    MD5_OP(MD5_F,c,d,a,b,X( 6),MD5_13,0xA8304613u); \
-    MD5_OP(MD5_F,b,c,d,a,X( 7),MD5_14,0xFD469501u); \
-    MD5_OP(MD5_F,a,b,c,d,X( 8),MD5_11,0x698098D8u); \
-    MD5_OP(MD5_F,d,a,b,c,X( 9),MD5_12,0x8B44F7AFu); \
-    MD5_OP(MD5_F,c,d,a,b,X(10),MD5_13,0xFFFF5BB1u); \
-    MD5_OP(MD5_F,b,c,d,a,X(11),MD5_14,0x895CD7BEu); \
-    MD5_OP(MD5_F,a,b,c,d,X(12),MD5_11,0x6B901122u); \
-    MD5_OP(MD5_F,d,a,b,c,X(13),MD5_12,0xFD987193u); \
-    MD5_OP(MD5_F,c,d,a,b,X(14),MD5_13,0xA679438Eu); \
-    MD5_OP(MD5_F,b,c,d,a,X(15),MD5_14,0x49B40821u); \
+    X(15) = C(0x00000000u); /* of bits */
+
+#define MD5_ROUNDS_2_TO_4()                         \
     /* second round */                              \
     MD5_OP(MD5_G,a,b,c,d,X( 1),MD5_21,0xF61E2562u); \
     MD5_OP(MD5_G,d,a,b,c,X( 6),MD5_22,0xC040B340u); \
@@ -179,7 +153,9 @@
     MD5_OP(MD5_I,a,b,c,d,X( 4),MD5_41,0xF7537E82u); \
     MD5_OP(MD5_I,d,a,b,c,X(11),MD5_42,0xBD3AF235u); \
     MD5_OP(MD5_I,c,d,a,b,X( 2),MD5_43,0x2AD7D2BBu); \
-    MD5_OP(MD5_I,b,c,d,a,X( 9),MD5_44,0xEB86D391u); \
+    MD5_OP(MD5_I,b,c,d,a,X( 9),MD5_44,0xEB86D391u);
+
+#define MD5_FINISH()                                \
     /* update state */                              \
     STATE(0) += a;                                  \
     STATE(1) += b;                                  \
@@ -189,8 +165,121 @@
     HASH(0) = STATE(0);                             \
     HASH(1) = STATE(1);                             \
     HASH(2) = STATE(2);                             \
-    HASH(3) = STATE(3);                             \
+    HASH(3) = STATE(3);
+
+#define CUSTOM_MD5_CODE()                           \
+  do                                                \
+  {                                                 \
+    /* initial state */                             \
+    STATE(0) = C(0x67452301u);                      \
+    STATE(1) = C(0xEFCDAB89u);                      \
+    STATE(2) = C(0x98BADCFEu);                      \
+    STATE(3) = C(0x10325476u);                      \
+    a = STATE(0);                                   \
+    b = STATE(1);                                   \
+    c = STATE(2);                                   \
+    d = STATE(3);                                   \
+    MD5_LOAD_DATA();                                \
+    /* first round */                               \
+    MD5_OP(MD5_F,a,b,c,d,X( 0),MD5_11,0xD76AA478u); \
+    MD5_OP(MD5_F,d,a,b,c,X( 1),MD5_12,0xE8C7B756u); \
+    MD5_OP(MD5_F,c,d,a,b,X( 2),MD5_13,0x242070DBu); \
+    MD5_OP(MD5_F,b,c,d,a,X( 3),MD5_14,0xC1BDCEEEu); \
+    MD5_OP(MD5_F,a,b,c,d,X( 4),MD5_11,0xF57C0FAFu); \
+    MD5_OP(MD5_F,d,a,b,c,X( 5),MD5_12,0x4787C62Au); \
+    MD5_OP(MD5_F,c,d,a,b,X( 6),MD5_13,0xA8304613u); \
+    MD5_OP(MD5_F,b,c,d,a,X( 7),MD5_14,0xFD469501u); \
+    MD5_OP(MD5_F,a,b,c,d,X( 8),MD5_11,0x698098D8u); \
+    MD5_OP(MD5_F,d,a,b,c,X( 9),MD5_12,0x8B44F7AFu); \
+    MD5_OP(MD5_F,c,d,a,b,X(10),MD5_13,0xFFFF5BB1u); \
+    MD5_OP(MD5_F,b,c,d,a,X(11),MD5_14,0x895CD7BEu); \
+    MD5_OP(MD5_F,a,b,c,d,X(12),MD5_11,0x6B901122u); \
+    MD5_OP(MD5_F,d,a,b,c,X(13),MD5_12,0xFD987193u); \
+    MD5_OP(MD5_F,c,d,a,b,X(14),MD5_13,0xA679438Eu); \
+    MD5_OP(MD5_F,b,c,d,a,X(15),MD5_14,0x49B40821u); \
+    MD5_ROUNDS_2_TO_4();                            \
+    MD5_FINISH();                                   \
   }                                                 \
   while(0)
 
+//
+// midstate variants, for messages whose first n words (0 <= n <= 13) are the same in many messages: the state after
+// the first n steps of the first round depends only on them (step i of the first round uses X(i))
+//   CUSTOM_MD5_MIDSTATE_CODE(n) ------- compute that state (a, b, c and d) into MIDSTATE(0..3)
+//   CUSTOM_MD5_FROM_MIDSTATE_CODE(n) -- compute the MD5 hash starting from it (the other 64 - n steps)
+// they also need MIDSTATE(idx) --- how to access the midstate at index idx, 0 <= idx < 4
+//
+
+#define CUSTOM_MD5_MIDSTATE_CODE(n)                                   \
+  do                                                                  \
+  {                                                                   \
+    /* initial state */                                               \
+    a = C(0x67452301u);                                               \
+    b = C(0xEFCDAB89u);                                               \
+    c = C(0x98BADCFEu);                                               \
+    d = C(0x10325476u);                                               \
+    MD5_LOAD_DATA();                                                  \
+    /* the first n steps of the first round */                        \
+    if((n) >  0u) { MD5_OP(MD5_F,a,b,c,d,X( 0),MD5_11,0xD76AA478u); } \
+    if((n) >  1u) { MD5_OP(MD5_F,d,a,b,c,X( 1),MD5_12,0xE8C7B756u); } \
+    if((n) >  2u) { MD5_OP(MD5_F,c,d,a,b,X( 2),MD5_13,0x242070DBu); } \
+    if((n) >  3u) { MD5_OP(MD5_F,b,c,d,a,X( 3),MD5_14,0xC1BDCEEEu); } \
+    if((n) >  4u) { MD5_OP(MD5_F,a,b,c,d,X( 4),MD5_11,0xF57C0FAFu); } \
+    if((n) >  5u) { MD5_OP(MD5_F,d,a,b,c,X( 5),MD5_12,0x4787C62Au); } \
+    if((n) >  6u) { MD5_OP(MD5_F,c,d,a,b,X( 6),MD5_13,0xA8304613u); } \
+    if((n) >  7u) { MD5_OP(MD5_F,b,c,d,a,X( 7),MD5_14,0xFD469501u); } \
+    if((n) >  8u) { MD5_OP(MD5_F,a,b,c,d,X( 8),MD5_11,0x698098D8u); } \
+    if((n) >  9u) { MD5_OP(MD5_F,d,a,b,c,X( 9),MD5_12,0x8B44F7AFu); } \
+    if((n) > 10u) { MD5_OP(MD5_F,c,d,a,b,X(10),MD5_13,0xFFFF5BB1u); } \
+    if((n) > 11u) { MD5_OP(MD5_F,b,c,d,a,X(11),MD5_14,0x895CD7BEu); } \
+    if((n) > 12u) { MD5_OP(MD5_F,a,b,c,d,X(12),MD5_11,0x6B901122u); } \
+    if((n) > 13u) { MD5_OP(MD5_F,d,a,b,c,X(13),MD5_12,0xFD987193u); } \
+    if((n) > 14u) { MD5_OP(MD5_F,c,d,a,b,X(14),MD5_13,0xA679438Eu); } \
+    if((n) > 15u) { MD5_OP(MD5_F,b,c,d,a,X(15),MD5_14,0x49B40821u); } \
+    MIDSTATE(0) = a;                                                  \
+    MIDSTATE(1) = b;                                                  \
+    MIDSTATE(2) = c;                                                  \
+    MIDSTATE(3) = d;                                                  \
+  }                                                                   \
+  while(0)
+
+#define CUSTOM_MD5_FROM_MIDSTATE_CODE(n)                                           \
+  do                                                                               \
+  {                                                                                \
+    /* initial state */                                                            \
+    STATE(0) = C(0x67452301u);                                                     \
+    STATE(1) = C(0xEFCDAB89u);                                                     \
+    STATE(2) = C(0x98BADCFEu);                                                     \
+    STATE(3) = C(0x10325476u);                                                     \
+    a = MIDSTATE(0);                                                               \
+    b = MIDSTATE(1);                                                               \
+    c = MIDSTATE(2);                                                               \
+    d = MIDSTATE(3);                                                               \
+    MD5_LOAD_DATA();                                                               \
+    /* the other steps of the first round */                                       \
+    switch(n)                                                                      \
+    {                                                                              \
+      case  0u: MD5_OP(MD5_F,a,b,c,d,X( 0),MD5_11,0xD76AA478u); /* fall through */ \
+      case  1u: MD5_OP(MD5_F,d,a,b,c,X( 1),MD5_12,0xE8C7B756u); /* fall through */ \
+      case  2u: MD5_OP(MD5_F,c,d,a,b,X( 2),MD5_13,0x242070DBu); /* fall through */ \
+      case  3u: MD5_OP(MD5_F,b,c,d,a,X( 3),MD5_14,0xC1BDCEEEu); /* fall through */ \
+      case  4u: MD5_OP(MD5_F,a,b,c,d,X( 4),MD5_11,0xF57C0FAFu); /* fall through */ \
+      case  5u: MD5_OP(MD5_F,d,a,b,c,X( 5),MD5_12,0x4787C62Au); /* fall through */ \
+      case  6u: MD5_OP(MD5_F,c,d,a,b,X( 6),MD5_13,0xA8304613u); /* fall through */ \
+      case  7u: MD5_OP(MD5_F,b,c,d,a,X( 7),MD5_14,0xFD469501u); /* fall through */ \
+      case  8u: MD5_OP(MD5_F,a,b,c,d,X( 8),MD5_11,0x698098D8u); /* fall through */ \
+      case  9u: MD5_OP(MD5_F,d,a,b,c,X( 9),MD5_12,0x8B44F7AFu); /* fall through */ \
+      case 10u: MD5_OP(MD5_F,c,d,a,b,X(10),MD5_13,0xFFFF5BB1u); /* fall through */ \
+      case 11u: MD5_OP(MD5_F,b,c,d,a,X(11),MD5_14,0x895CD7BEu); /* fall through */ \
+      case 12u: MD5_OP(MD5_F,a,b,c,d,X(12),MD5_11,0x6B901122u); /* fall through */ \
+      case 13u: MD5_OP(MD5_F,d,a,b,c,X(13),MD5_12,0xFD987193u); /* fall through */ \
+      case 14u: MD5_OP(MD5_F,c,d,a,b,X(14),MD5_13,0xA679438Eu); /* fall through */ \
+      case 15u: MD5_OP(MD5_F,b,c,d,a,X(15),MD5_14,0x49B40821u); /* fall through */ \
+      default: break;                                                              \
+    }                                                                              \
+    MD5_ROUNDS_2_TO_4();                                                           \
+    MD5_FINISH();                                                                  \
+  }                                                                                \
+  while(0)
+
 #endif
@@ -0,0 +1,299 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// benchmark of the MD5 implementations with hardware performance counters (perf_counters.h)
+//
+// each thread hashes its own messages for the given time, with the counters of that thread running; the report has,
+// per thread and in total, the hashes per second, the nanoseconds and cycles per hash, the instructions per cycle
+// (IPC), the branch misses per hash and, where the processor has them, the uops dispatched per cycle to ports 0, 1, 5
+// (the vector ALUs) and 6; a port near 1 uop per cycle means that the code is bound by that port, while a low IPC with
+// no busy port means that it is bound by the latency of the dependency chain of the 64 MD5 steps
+//
+// the efficiency compares the instructions executed with the operations of CUSTOM_MD5_CODE() when each one of them is
+// a single instruction (md5_ideal_operations()), and the ideal operations per cycle with the measured IPC
+//
+// md5_benchmark() --- benchmark one implementation (or all of them) on n_threads threads
+//
+
+#ifndef MD5_BENCHMARK
+#define MD5_BENCHMARK
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "perf_counters.h"
+
+#define MD5_BENCHMARK_BATCH       4096u // md5 calls between two looks at the clock
+#define MD5_BENCHMARK_MAX_THREADS 256u
+
+//
+// operations of one CUSTOM_MD5_CODE() when each one is a single (scalar or vector) instruction: in each of the 64
+// steps, the round function (3 for F, G and I, 2 for H), 3 additions (2 when x is a constant, which happens with
+// X(13), X(14) and X(15) once per round), the rotation (rotate_ops instructions) and the addition of b; then the 4
+// additions of the state
+//
+
+static u32_t md5_ideal_operations(u32_t rotate_ops) {
+    return 16u * (3u + 3u + 2u + 3u) + (64u * 3u - 12u) + 64u * rotate_ops + 64u + 4u;
+}
+
+static double md5_benchmark_elapsed(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + 1.0e-9 * (double)(now.tv_nsec - start->tv_nsec);
+}
+
+//
+// the hash loops (the empty asm statement keeps the compiler from hoisting the hash out of the loop)
+//
+
+#define MD5_BENCHMARK_LOOP(md5_call)                                  \
+    do {                                                              \
+        clock_gettime(CLOCK_MONOTONIC, &start);                       \
+        do {                                                          \
+            for (u32_t i = 0u; i < MD5_BENCHMARK_BATCH; i++) {        \
+                md5_call;                                             \
+                __asm__ volatile("" : : : "memory");                  \
+            }                                                         \
+            n_calls += MD5_BENCHMARK_BATCH;                           \
+        } while (md5_benchmark_elapsed(&start) < seconds);            \
+    } while (0)
+
+static u64_t md5_benchmark_cpu(double seconds) {
+    u32_t data[13u], hash[4u];
+    struct timespec start;
+    u64_t n_calls = 0u;
+
+    for (u32_t idx = 0u; idx < 13u; idx++)
+        data[idx] = (u32_t)random();
+    MD5_BENCHMARK_LOOP(md5_cpu(data, hash));
+    return n_calls;
+}
+
+#ifdef MD5_CPU_AVX
+static u64_t md5_benchmark_avx(double seconds) {
+    u32_t data[13u * 4u] __attribute__((aligned(16))), hash[4u * 4u] __attribute__((aligned(16)));
+    struct timespec start;
+    u64_t n_calls = 0u;
+
+    for (u32_t idx = 0u; idx < 13u * 4u; idx++)
+        data[idx] = (u32_t)random();
+    MD5_BENCHMARK_LOOP(md5_cpu_avx((v4si *)data, (v4si *)hash));
+    return n_calls;
+}
+#endif
+
+#ifdef MD5_CPU_AVX2
+static u64_t md5_benchmark_avx2(double seconds) {
+    u32_t data[13u * 8u] __attribute__((aligned(32))), hash[4u * 8u] __attribute__((aligned(32)));
+    struct timespec start;
+    u64_t n_calls = 0u;
+
+    for (u32_t idx = 0u; idx < 13u * 8u; idx++)
+        data[idx] = (u32_t)random();
+    MD5_BENCHMARK_LOOP(md5_cpu_avx2((v8si *)data, (v8si *)hash));
+    return n_calls;
+}
+#endif
+
+#ifdef MD5_CPU_AVX512
+static u64_t md5_benchmark_avx512(double seconds) {
+    u32_t data[13u * 16u] __attribute__((aligned(64))), hash[4u * 16u] __attribute__((aligned(64)));
+    struct timespec start;
+    u64_t n_calls = 0u;
+
+    for (u32_t idx = 0u; idx < 13u * 16u; idx++)
+        data[idx] = (u32_t)random();
+    MD5_BENCHMARK_LOOP(md5_cpu_avx512((v16si *)data, (v16si *)hash));
+    return n_calls;
+}
+#endif
+
+#ifdef MD5_CPU_NEON
+static u64_t md5_benchmark_neon(double seconds) {
+    u32_t data[13u * 4u] __attribute__((aligned(16))), hash[4u * 4u] __attribute__((aligned(16)));
+    struct timespec start;
+    u64_t n_calls = 0u;
+
+    for (u32_t idx = 0u; idx < 13u * 4u; idx++)
+        data[idx] = (u32_t)random();
+    MD5_BENCHMARK_LOOP(md5_cpu_neon((uint32x4_t *)data, (uint32x4_t *)hash));
+    return n_calls;
+}
+#endif
+
+#undef MD5_BENCHMARK_LOOP
+
+static const struct {
+    const char *name;
+    const char *function;
+    u32_t n_lanes;
+    u32_t rotate_ops; // instructions of ROTATE()
+    u64_t (*run)(double seconds);
+} md5_benchmark_engines[] = {
+    { "cpu", "md5_cpu()", 1u, 1u, md5_benchmark_cpu },
+#ifdef MD5_CPU_AVX
+    { "avx", "md5_cpu_avx()", 4u, 3u, md5_benchmark_avx },
+#endif
+#ifdef MD5_CPU_AVX2
+    { "avx2", "md5_cpu_avx2()", 8u, 3u, md5_benchmark_avx2 },
+#endif
+#ifdef MD5_CPU_AVX512
+    { "avx512", "md5_cpu_avx512()", 16u, 1u, md5_benchmark_avx512 },
+#endif
+#ifdef MD5_CPU_NEON
+    { "neon", "md5_cpu_neon()", 4u, 3u, md5_benchmark_neon },
+#endif
+};
+#define MD5_BENCHMARK_N_ENGINES (sizeof(md5_benchmark_engines) / sizeof(md5_benchmark_engines[0]))
+
+typedef struct {
+    u32_t thread;
+    u32_t engine;
+    u32_t n_threads;
+    double seconds;           // requested
+    double elapsed;           // measured
+    u64_t n_calls;
+    int n_counters;
+    perf_counters_t counters;
+    pthread_t id;
+} md5_benchmark_thread_t;
+
+static u32_t md5_benchmark_ready;
+
+static void *md5_benchmark_thread(void *arg) {
+    md5_benchmark_thread_t *t = (md5_benchmark_thread_t *)arg;
+    struct timespec start;
+
+    pin_worker_thread(t->thread);
+    t->n_counters = perf_counters_open(&t->counters);
+    __atomic_add_fetch(&md5_benchmark_ready, 1u, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&md5_benchmark_ready, __ATOMIC_ACQUIRE) < t->n_threads)
+        ; // all threads start together
+    perf_counters_start(&t->counters);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    t->n_calls = md5_benchmark_engines[t->engine].run(t->seconds);
+    t->elapsed = md5_benchmark_elapsed(&start);
+    perf_counters_stop(&t->counters);
+    perf_counters_close(&t->counters);
+    return NULL;
+}
+
+static void md5_benchmark_print_value(double numerator, double denominator, const char *format) {
+    if (numerator < 0.0 || denominator <= 0.0)
+        printf(" %*s", atoi(format + 2), "-"); // same width as the format
+    else
+        printf(format, numerator / denominator);
+}
+
+// One line of the report (counts of one thread, or the sums of all of them)
+static void md5_benchmark_print_line(const char *label, u32_t engine, double n_calls, double elapsed, const double *value) {
+    double n_hashes = n_calls * (double)md5_benchmark_engines[engine].n_lanes;
+
+    printf("%6s %9.3f %8.3f", label, n_hashes / elapsed * 1.0e-6, elapsed * 1.0e9 / n_hashes);
+    md5_benchmark_print_value(value[PERF_CYCLES], n_hashes, " %8.2f");
+    md5_benchmark_print_value(value[PERF_INSTRUCTIONS], value[PERF_CYCLES], " %5.2f");
+    md5_benchmark_print_value(value[PERF_INSTRUCTIONS], n_hashes, " %8.2f");
+    md5_benchmark_print_value(value[PERF_BRANCH_MISSES], n_hashes, " %10.6f");
+    for (int e = PERF_PORT_0; e <= PERF_PORT_6; e++)
+        md5_benchmark_print_value(value[e], value[PERF_CYCLES], " %5.2f");
+    printf("\n");
+}
+
+static void md5_benchmark_engine(u32_t engine, u32_t n_threads, double seconds) {
+    static md5_benchmark_thread_t threads[MD5_BENCHMARK_MAX_THREADS];
+    double total[PERF_N_EVENTS], n_calls = 0.0, elapsed = 0.0, ideal, busiest = -1.0;
+    int multiplexed = 0, error = 0, busiest_port = -1;
+    char label[16];
+    u32_t thread;
+
+    ideal = (double)md5_ideal_operations(md5_benchmark_engines[engine].rotate_ops);
+    printf("%s: %u lane%s, %.0f ideal operations per call, %u thread%s, %.1f seconds\n", md5_benchmark_engines[engine].function,
+           md5_benchmark_engines[engine].n_lanes, (md5_benchmark_engines[engine].n_lanes == 1u) ? "" : "s", ideal, n_threads,
+           (n_threads == 1u) ? "" : "s", seconds);
+    md5_benchmark_ready = 0u;
+    for (thread = 0u; thread < n_threads; thread++) {
+        threads[thread] = (md5_benchmark_thread_t){ .thread = thread, .engine = engine, .n_threads = n_threads, .seconds = seconds };
+        if (pthread_create(&threads[thread].id, NULL, md5_benchmark_thread, &threads[thread]) != 0) {
+            perror("md5_benchmark: pthread_create");
+            exit(1);
+        }
+    }
+    for (thread = 0u; thread < n_threads; thread++)
+        pthread_join(threads[thread].id, NULL);
+
+    printf("thread  Mhash/s  ns/hash cyc/hash   IPC ins/hash brmiss/hash port0 port1 port5 port6\n");
+    for (int e = 0; e < PERF_N_EVENTS; e++)
+        total[e] = 0.0;
+    for (thread = 0u; thread < n_threads; thread++) {
+        md5_benchmark_thread_t *t = &threads[thread];
+
+        snprintf(label, sizeof(label), "%u", thread);
+        md5_benchmark_print_line(label, engine, (double)t->n_calls, t->elapsed, t->counters.value);
+        n_calls += (double)t->n_calls;
+        if (t->elapsed > elapsed)
+            elapsed = t->elapsed;
+        for (int e = 0; e < PERF_N_EVENTS; e++)
+            total[e] = (total[e] < 0.0 || t->counters.value[e] < 0.0) ? -1.0 : total[e] + t->counters.value[e];
+        multiplexed |= t->counters.multiplexed;
+        if (error == 0)
+            error = t->counters.error;
+    }
+    if (n_threads > 1u) {
+        // the hashes per second of the total are those of all the threads together
+        for (int e = 0; e < PERF_N_EVENTS; e++)
+            if (total[e] >= 0.0)
+                total[e] /= (double)n_threads;
+        md5_benchmark_print_line("mean", engine, n_calls / (double)n_threads, elapsed, total);
+        printf("total %10.3f Mhash/s\n", n_calls * (double)md5_benchmark_engines[engine].n_lanes / elapsed * 1.0e-6);
+    }
+
+    if (total[PERF_CYCLES] < 0.0 || total[PERF_INSTRUCTIONS] < 0.0) {
+        printf("hardware counters not available (perf_event_open: %s), only the times were measured%s\n", strerror(error ? error : ENOENT),
+               (error == EACCES || error == EPERM) ? " (see /proc/sys/kernel/perf_event_paranoid)" : (error == ENOENT) ? " (no PMU, a virtual machine?)" : "");
+        return;
+    }
+    printf("efficiency: %.2f instructions per call for %.0f ideal operations (%.1f%%), %.2f ideal operations per cycle\n",
+           total[PERF_INSTRUCTIONS] / (n_calls / (double)n_threads), ideal,
+           100.0 * ideal * (n_calls / (double)n_threads) / total[PERF_INSTRUCTIONS],
+           ideal * (n_calls / (double)n_threads) / total[PERF_CYCLES]);
+    for (int e = PERF_PORT_0; e <= PERF_PORT_6; e++)
+        if (total[e] >= 0.0 && total[e] / total[PERF_CYCLES] > busiest) {
+            busiest = total[e] / total[PERF_CYCLES];
+            busiest_port = e;
+        }
+    if (busiest_port < 0)
+        printf("bound: unknown (no per-port counters on this processor)\n");
+    else if (busiest >= 0.85)
+        printf("bound: port pressure (%s busy %.0f%% of the cycles)\n", perf_event_names[busiest_port], 100.0 * busiest);
+    else
+        printf("bound: latency (busiest port, %s, busy %.0f%% of the cycles)\n", perf_event_names[busiest_port], 100.0 * busiest);
+    if (multiplexed)
+        printf("(the counters were multiplexed, their values are scaled estimates)\n");
+}
+
+static void md5_benchmark(const char *name, u32_t n_threads, double seconds) {
+    u32_t engine, n_done = 0u;
+
+    if (n_threads > MD5_BENCHMARK_MAX_THREADS)
+        n_threads = MD5_BENCHMARK_MAX_THREADS;
+    for (engine = 0u; engine < MD5_BENCHMARK_N_ENGINES; engine++)
+        if (strcmp(name, "all") == 0 || strcmp(name, md5_benchmark_engines[engine].name) == 0) {
+            if (n_done++ > 0u)
+                printf("\n");
+            md5_benchmark_engine(engine, n_threads, seconds);
+            fflush(stdout);
+        }
+    if (n_done == 0u) {
+        fprintf(stderr, "md5_benchmark: unknown implementation \"%s\" (use all", name);
+        for (engine = 0u; engine < MD5_BENCHMARK_N_ENGINES; engine++)
+            fprintf(stderr, ", %s", md5_benchmark_engines[engine].name);
+        fprintf(stderr, ")\n");
+        exit(1);
+    }
+}
+
+#endif
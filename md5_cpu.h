@@ -6,6 +6,7 @@
 // MD5 hash CPU code
 //
 // md5_cpu() -------- compute the MD5 hash of a message
+// md5_cpu_midstate() --- compute the state after the first n steps, which depend only on the first n words of the message
 // test_md5_cpu() --- test the correctness of md5_cpu() and measure its execution time
 //
 
@@ -34,6 +35,22 @@ static void md5_cpu(u32_t *data,u32_t *hash)
 # undef X
 }
 
+static void md5_cpu_midstate(u32_t *data,u32_t n,u32_t *midstate)
+{ // the first n (0 <= n <= 13) words of a message -> the state after the first n steps (see md5_cpu_avx2_from_midstate())
+  u32_t a,b,c,d,x[16];
+# define C(c)         (c)
+# define ROTATE(x,n)  (((x) << (n)) | ((x) >> (32 - (n))))
+# define DATA(idx)    data[idx]
+# define X(idx)       x[idx]
+# define MIDSTATE(idx) midstate[idx]
+  CUSTOM_MD5_MIDSTATE_CODE(n);
+# undef C
+# undef ROTATE
+# undef DATA
+# undef X
+# undef MIDSTATE
+}
+
 
 //
 // correctness test of md5_cpu()
@@ -4,6 +4,7 @@
 // MD5 hash CPU code using AVX2 instructions (Intel/AMD)
 //
 // md5_cpu_avx2() -------- compute the MD5 hash of a message
+// md5_cpu_avx2_from_midstate() --- the same, for messages that share their first n words (midstate by md5_cpu_midstate())
 // test_md5_cpu_avx2() --- test the correctness of md5_cpu_avx2() and measure its execution time
 //
 
@@ -38,6 +39,29 @@ static void md5_cpu_avx2(v8si *interleaved4_data, v8si *interleaved4_hash)
 # undef X
 }
 
+static void md5_cpu_avx2_from_midstate(v8si *interleaved4_data, v8si *interleaved4_hash, const u32_t *midstate, u32_t n)
+{
+    // eight interleaved messages whose first n words are the same -> eight interleaved MD5 hashes (64 - n steps)
+    v8si a, b, c, d, interleaved4_state[4], interleaved4_x[16];
+# define C(c)         (v8si){ (int)(c),(int)(c),(int)(c),(int)(c), (int)(c),(int)(c),(int)(c),(int)(c) }
+# define ROTATE(x,n)  (__builtin_ia32_pslldi256(x, n) | __builtin_ia32_psrldi256(x, 32 - (n)))
+# define DATA(idx)    interleaved4_data[idx]
+# define HASH(idx)    interleaved4_hash[idx]
+# define STATE(idx)   interleaved4_state[idx]
+# define X(idx)       interleaved4_x[idx]
+# define MIDSTATE(idx) C(midstate[idx])
+
+    CUSTOM_MD5_FROM_MIDSTATE_CODE(n);
+
+# undef C
+# undef ROTATE
+# undef DATA
+# undef HASH
+# undef STATE
+# undef X
+# undef MIDSTATE
+}
+
 //
 // correctness test of md5_cpu_avx2() --- test_md5_cpu_avx2() must be called first!
 //
@@ -73,7 +97,7 @@ static void test_md5_cpu_avx2(void)
         //
         for (lane = 0u; lane < 8u; lane++)  // for each message number
             for (idx = 0u; idx < 4u; idx++)   // for each hash word
-                if (interleaved_test_hash[8u * idx + lane] != hth[8u * lane + idx])
+                if (interleaved_test_hash[8u * idx + lane] != hth[4u * lane + idx])
                 {
                     fprintf(stderr, "test_md5_cpu_avx2: MD5 hash error for message %u\n", 8u * n + lane);
                     exit(1);
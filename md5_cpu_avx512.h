@@ -76,7 +76,7 @@ static void test_md5_cpu_avx512(void)
         //
         for (lane = 0u; lane < 16u; lane++)  // for each message number
             for (idx = 0u; idx < 4u; idx++)   // for each hash word
-                if (interleaved_test_hash[16u * idx + lane] != hth[16u * lane + idx])
+                if (interleaved_test_hash[16u * idx + lane] != hth[4u * lane + idx])
                 {
                     fprintf(stderr, "test_md5_cpu_avx512: MD5 hash error for message %u\n", 16u * n + lane);
                     exit(1);
@@ -0,0 +1,347 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// microbenchmarks of the components of the search loops
+//
+// each component is run in batches of n operations, with n doubled until a batch takes MICROBENCHMARK_BATCH_NS; after
+// MICROBENCHMARK_WARMUP untimed batches, n_samples batches are timed with the time stamp counter (rdtsc, converted to
+// ns with its frequency measured against CLOCK_MONOTONIC; elsewhere CLOCK_MONOTONIC itself) and, when perf_event_open()
+// allows it, with the core cycle counter (perf_counters.h); the report has, per operation, the median, minimum and 90th
+// percentile of the ns, their interquartile range relative to the median, and the median of the tsc and core cycles
+//
+// the vault components work in a temporary directory, so the real vault is never touched
+//
+// microbenchmarks() --- run all the components, or the ones whose name starts with the given prefix
+//
+
+#ifndef MICROBENCHMARKS
+#define MICROBENCHMARKS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "perf_counters.h"
+#include "deti_coins_keyspace.h"
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define MICROBENCHMARK_TSC 1
+#endif
+
+#define MICROBENCHMARK_BATCH_NS  2000000.0 // target duration of a batch (2 ms)
+#define MICROBENCHMARK_WARMUP    5u
+#define MICROBENCHMARK_SAMPLES   31u       // default number of timed batches
+#define MICROBENCHMARK_MAX_SAMPLES 1001u
+
+static volatile u64_t microbenchmark_sink; // keeps the results of the components alive
+static double microbenchmark_tsc_ghz = 1.0; // ticks per ns
+
+static inline u64_t microbenchmark_ticks(void) {
+#ifdef MICROBENCHMARK_TSC
+    _mm_lfence(); // do not let rdtsc run ahead of the code being timed
+    return __rdtsc();
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64_t)now.tv_sec * 1000000000ul + (u64_t)now.tv_nsec;
+#endif
+}
+
+static void microbenchmark_calibrate(void) {
+#ifdef MICROBENCHMARK_TSC
+    struct timespec t0, t1;
+    u64_t c0, c1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    c0 = microbenchmark_ticks();
+    do
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    while ((double)(t1.tv_sec - t0.tv_sec) * 1.0e9 + (double)(t1.tv_nsec - t0.tv_nsec) < 1.0e8);
+    c1 = microbenchmark_ticks();
+    microbenchmark_tsc_ghz = (double)(c1 - c0) / ((double)(t1.tv_sec - t0.tv_sec) * 1.0e9 + (double)(t1.tv_nsec - t0.tv_nsec));
+#endif
+}
+
+//
+// the components: each one does n operations and returns the ticks of the part that is timed (all of it, except for
+// the vault flush, which must first fill the buffer)
+//
+
+#define MICROBENCHMARK_TIMED(code)                  \
+    do {                                            \
+        u64_t start = microbenchmark_ticks();       \
+        code;                                       \
+        return microbenchmark_ticks() - start;      \
+    } while (0)
+
+static const char microbenchmark_coin[53] = "DETI coin f3t46Hgn                      VZ:B%      \n"; // a coin of power 32
+
+static u64_t microbenchmark_next_ascii_code(u64_t n) {
+    u32_t var = 0x20202020u;
+
+    MICROBENCHMARK_TIMED({
+        for (u64_t i = 0u; i < n; i++)
+            var = next_ascii_code(var);
+        microbenchmark_sink = var;
+    });
+}
+
+static u64_t microbenchmark_keyspace_word(u64_t n) {
+    u32_t sum = 0u;
+
+    MICROBENCHMARK_TIMED({
+        for (u64_t i = 0u; i < n; i++)
+            sum += keyspace_word(i % KEYSPACE_WORD_SIZE);
+        microbenchmark_sink = sum;
+    });
+}
+
+static u64_t microbenchmark_keyspace_make_coin(u64_t n) {
+    u32_t template[13], coin[13], sum = 0u;
+
+    memcpy(template, microbenchmark_coin, sizeof(template));
+    MICROBENCHMARK_TIMED({
+        for (u64_t i = 0u; i < n; i++) {
+            keyspace_make_coin(template, i * 7919ul, coin);
+            sum += coin[KEYSPACE_VAR1_WORD] ^ coin[KEYSPACE_VAR2_WORD];
+        }
+        microbenchmark_sink = sum;
+    });
+}
+
+// The AoS -> SoA interleave of the 8-lane search loops (update var1 and var2 of each coin, then interleave 13 words)
+static u64_t microbenchmark_interleave_x8(u64_t n) {
+    coin_t coins[8];
+    u32_t interleaved_data[13u * 8u] __attribute__((aligned(32))), var1 = 0x20202020u, var2 = 0x20202020u;
+
+    for (u32_t lane = 0u; lane < 8u; lane++)
+        memcpy(coins[lane].coin_as_ints, microbenchmark_coin, 52u);
+    MICROBENCHMARK_TIMED({
+        for (u64_t i = 0u; i < n; i++) {
+            for (u32_t lane = 0u; lane < 8u; lane++) {
+                coins[lane].coin_as_ints[6] = var1;
+                coins[lane].coin_as_ints[9] = var2;
+                for (u32_t idx = 0u; idx < 13u; idx++)
+                    interleaved_data[8u * idx + lane] = coins[lane].coin_as_ints[idx];
+            }
+            __asm__ volatile("" : : "r"(interleaved_data) : "memory");
+            var1 = next_ascii_code(var1);
+        }
+    });
+}
+
+// The per-lane hit check of the 8-lane search loops (copy the 4 hash words of each lane, test the last one)
+static u64_t microbenchmark_hit_check_x8(u64_t n) {
+    u32_t interleaved_hash[4u * 8u] __attribute__((aligned(32))), n_hits = 0u;
+
+    for (u32_t idx = 0u; idx < 4u * 8u; idx++)
+        interleaved_hash[idx] = (u32_t)random() | 1u;
+    MICROBENCHMARK_TIMED({
+        for (u64_t i = 0u; i < n; i++) {
+            __asm__ volatile("" : : "r"(interleaved_hash) : "memory");
+            for (u32_t lane = 0u; lane < 8u; lane++) {
+                u32_t hash[4u];
+                for (u32_t idx = 0u; idx < 4u; idx++)
+                    hash[idx] = interleaved_hash[8u * idx + lane];
+                if (hash[3] == 0u)
+                    n_hits++;
+            }
+        }
+        microbenchmark_sink = n_hits;
+    });
+}
+
+static u64_t microbenchmark_deti_coin_power(u64_t n) {
+    u32_t hash[4], sum = 0u;
+
+    MICROBENCHMARK_TIMED({
+        for (u64_t i = 0u; i < n; i++) {
+            hash[0] = 0x1f44a28eu; hash[1] = 0x764ecbbau; hash[2] = 0x79f3debbu; hash[3] = (u32_t)i << (i & 31u);
+            hash_byte_reverse(hash);
+            sum += deti_coin_power(hash);
+        }
+        microbenchmark_sink = sum;
+    });
+}
+
+#define MICROBENCHMARK_MD5(name, md5_call, n_lanes, align, type)                         \
+static u64_t microbenchmark_##name(u64_t n) {                                            \
+    u32_t data[13u * n_lanes] __attribute__((aligned(align)));                           \
+    u32_t hash[4u * n_lanes] __attribute__((aligned(align)));                            \
+                                                                                         \
+    for (u32_t idx = 0u; idx < 13u * n_lanes; idx++)                                     \
+        data[idx] = (u32_t)random();                                                     \
+    MICROBENCHMARK_TIMED({                                                               \
+        for (u64_t i = 0u; i < n; i++) {                                                 \
+            md5_call((type *)data, (type *)hash);                                        \
+            __asm__ volatile("" : : : "memory");                                         \
+        }                                                                                \
+        microbenchmark_sink = hash[0];                                                   \
+    });                                                                                  \
+}
+
+MICROBENCHMARK_MD5(md5_cpu, md5_cpu, 1u, 4, u32_t)
+#ifdef MD5_CPU_AVX
+MICROBENCHMARK_MD5(md5_cpu_avx, md5_cpu_avx, 4u, 16, v4si)
+#endif
+#ifdef MD5_CPU_AVX2
+MICROBENCHMARK_MD5(md5_cpu_avx2, md5_cpu_avx2, 8u, 32, v8si)
+#endif
+#ifdef MD5_CPU_AVX512
+MICROBENCHMARK_MD5(md5_cpu_avx512, md5_cpu_avx512, 16u, 64, v16si)
+#endif
+#ifdef MD5_CPU_NEON
+MICROBENCHMARK_MD5(md5_cpu_neon, md5_cpu_neon, 4u, 16, uint32x4_t)
+#endif
+#undef MICROBENCHMARK_MD5
+
+// save_deti_coin() of a coin (format check, md5_cpu(), append to the buffer); the buffer is emptied between batches
+static u64_t microbenchmark_save_deti_coin(u64_t n) {
+    u32_t coin[13];
+    u64_t ticks;
+
+    memcpy(coin, microbenchmark_coin, sizeof(coin));
+    ticks = microbenchmark_ticks();
+    for (u64_t i = 0u; i < n; i++)
+        save_deti_coin(coin);
+    ticks = microbenchmark_ticks() - ticks;
+    STORE_DETI_COINS();
+    return ticks;
+}
+
+// Flush of a buffer of 64 coins to the vault file (only the flush is timed)
+static u64_t microbenchmark_vault_flush(u64_t n) {
+    u32_t coin[13];
+    u64_t ticks = 0u, start;
+
+    memcpy(coin, microbenchmark_coin, sizeof(coin));
+    for (u64_t i = 0u; i < n; i++) {
+        for (u32_t j = 0u; j < 64u; j++)
+            save_checked_deti_coin(coin, 32u);
+        start = microbenchmark_ticks();
+        STORE_DETI_COINS();
+        ticks += microbenchmark_ticks() - start;
+    }
+    return ticks;
+}
+
+#undef MICROBENCHMARK_TIMED
+
+static const struct {
+    const char *name;
+    const char *operation;
+    u64_t max_n;            // largest batch (0: no limit)
+    int partly_timed;       // the core cycles of the batch are not those of the operations
+    u64_t (*run)(u64_t n);
+} microbenchmark_components[] = {
+    { "next_ascii_code", "call", 0u, 0, microbenchmark_next_ascii_code },
+    { "keyspace_word", "call", 0u, 0, microbenchmark_keyspace_word },
+    { "keyspace_make_coin", "call", 0u, 0, microbenchmark_keyspace_make_coin },
+    { "interleave_x8", "8 coins", 0u, 0, microbenchmark_interleave_x8 },
+    { "md5_cpu", "1 hash", 0u, 0, microbenchmark_md5_cpu },
+#ifdef MD5_CPU_AVX
+    { "md5_cpu_avx", "4 hashes", 0u, 0, microbenchmark_md5_cpu_avx },
+#endif
+#ifdef MD5_CPU_AVX2
+    { "md5_cpu_avx2", "8 hashes", 0u, 0, microbenchmark_md5_cpu_avx2 },
+#endif
+#ifdef MD5_CPU_AVX512
+    { "md5_cpu_avx512", "16 hashes", 0u, 0, microbenchmark_md5_cpu_avx512 },
+#endif
+#ifdef MD5_CPU_NEON
+    { "md5_cpu_neon", "4 hashes", 0u, 0, microbenchmark_md5_cpu_neon },
+#endif
+    { "hit_check_x8", "8 lanes", 0u, 0, microbenchmark_hit_check_x8 },
+    { "deti_coin_power", "call", 0u, 0, microbenchmark_deti_coin_power },
+    { "save_deti_coin", "append", 32768u, 0, microbenchmark_save_deti_coin },
+    { "vault_flush", "64 coins", 0u, 1, microbenchmark_vault_flush },
+};
+#define MICROBENCHMARK_N_COMPONENTS (sizeof(microbenchmark_components) / sizeof(microbenchmark_components[0]))
+
+static int microbenchmark_compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void microbenchmark_component(u32_t c, u32_t n_samples, perf_counters_t *counters, int have_cycles) {
+    static double ns[MICROBENCHMARK_MAX_SAMPLES], cycles[MICROBENCHMARK_MAX_SAMPLES];
+    u64_t n = 1u, max_n = microbenchmark_components[c].max_n;
+    u32_t s;
+
+    // batch size and warmup
+    while ((double)microbenchmark_components[c].run(n) / microbenchmark_tsc_ghz < MICROBENCHMARK_BATCH_NS && (max_n == 0u || 2u * n <= max_n))
+        n *= 2u;
+    for (s = 0u; s < MICROBENCHMARK_WARMUP; s++)
+        (void)microbenchmark_components[c].run(n);
+    // samples
+    for (s = 0u; s < n_samples; s++) {
+        perf_counters_start(counters);
+        ns[s] = (double)microbenchmark_components[c].run(n) / microbenchmark_tsc_ghz / (double)n;
+        perf_counters_stop(counters);
+        cycles[s] = (have_cycles && counters->value[PERF_CYCLES] >= 0.0) ? counters->value[PERF_CYCLES] / (double)n : -1.0;
+    }
+    qsort(ns, n_samples, sizeof(double), microbenchmark_compare);
+    qsort(cycles, n_samples, sizeof(double), microbenchmark_compare);
+
+    printf("%-19s %-9s %9lu %11.3f %11.3f %11.3f %6.2f%%", microbenchmark_components[c].name, microbenchmark_components[c].operation, n,
+           ns[n_samples / 2u], ns[0], ns[(9u * n_samples) / 10u], 100.0 * (ns[(3u * n_samples) / 4u] - ns[n_samples / 4u]) / ns[n_samples / 2u]);
+#ifdef MICROBENCHMARK_TSC
+    printf(" %11.2f", ns[n_samples / 2u] * microbenchmark_tsc_ghz);
+#else
+    printf(" %11s", "-");
+#endif
+    if (cycles[n_samples / 2u] >= 0.0 && !microbenchmark_components[c].partly_timed)
+        printf(" %11.2f\n", cycles[n_samples / 2u]);
+    else
+        printf(" %11s\n", "-");
+    fflush(stdout);
+}
+
+static void microbenchmarks(const char *prefix, u32_t n_samples) {
+    char directory[] = "/tmp/deti_coins_microbenchmarks_XXXXXX", cwd[4096];
+    perf_counters_t counters;
+    int have_cycles;
+    u32_t c, n_done = 0u; // components to run
+
+    if (n_samples == 0u || n_samples > MICROBENCHMARK_MAX_SAMPLES)
+        n_samples = MICROBENCHMARK_SAMPLES;
+    for (c = 0u; c < MICROBENCHMARK_N_COMPONENTS; c++)
+        if (strncmp(microbenchmark_components[c].name, prefix, strlen(prefix)) == 0)
+            n_done++;
+    if (n_done == 0u) {
+        fprintf(stderr, "microbenchmarks: no component starts with \"%s\"\n", prefix);
+        exit(1);
+    }
+    // the vault components write deti_coins_vault.txt in the current directory
+    if (getcwd(cwd, sizeof(cwd)) == NULL || mkdtemp(directory) == NULL || chdir(directory) != 0) {
+        perror("microbenchmarks: temporary directory");
+        exit(1);
+    }
+    microbenchmark_calibrate();
+    have_cycles = perf_counters_open(&counters) > 0 && counters.fd[PERF_CYCLES] >= 0;
+#ifdef MICROBENCHMARK_TSC
+    printf("time stamp counter: %.3f GHz; ", microbenchmark_tsc_ghz);
+#else
+    printf("no time stamp counter, CLOCK_MONOTONIC is used; ");
+#endif
+    if (have_cycles)
+        printf("core cycles from perf_event_open()\n");
+    else
+        printf("no core cycles (perf_event_open: %s)\n", strerror(counters.error ? counters.error : ENOENT));
+    printf("%u samples per component, each a batch of about %.0f ms, after %u warmup batches\n", n_samples, MICROBENCHMARK_BATCH_NS * 1.0e-6,
+           MICROBENCHMARK_WARMUP);
+    printf("%-19s %-9s %9s %11s %11s %11s %7s %11s %11s\n", "component", "operation", "ops/batch", "ns/op", "min ns/op", "p90 ns/op", "iqr",
+           "tsc cyc/op", "core cyc/op");
+    for (c = 0u; c < MICROBENCHMARK_N_COMPONENTS; c++)
+        if (strncmp(microbenchmark_components[c].name, prefix, strlen(prefix)) == 0)
+            microbenchmark_component(c, n_samples, &counters, have_cycles);
+    perf_counters_close(&counters);
+    (void)unlink(DETI_COINS_VAULT_FILE);
+    if (chdir(cwd) != 0 || rmdir(directory) != 0)
+        perror("microbenchmarks: cleanup");
+}
+
+#endif
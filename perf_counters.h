@@ -0,0 +1,194 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// hardware performance counters of the calling thread (Linux perf_event_open(); elsewhere nothing is counted)
+//
+// the counters are opened by the thread that is going to be measured (pid 0, any cpu), user space only, so that the
+// default kernel.perf_event_paranoid setting (2) allows them; each counter is opened on its own, and when the kernel
+// has to multiplex them its value is scaled by time_enabled / time_running
+//
+// the per-port counters (uops dispatched to the vector ALU ports 0, 1 and 5, and to port 6) are raw model-specific
+// events, so they are only opened on the Intel cores whose encoding is known (Skylake to Emerald Rapids)
+//
+// perf_counters_open() ----- open the counters of the calling thread (returns the number of counters opened)
+// perf_counters_start() ---- reset and enable them
+// perf_counters_stop() ----- disable them and read their (scaled) values
+// perf_counters_close() ---- close them
+//
+
+#ifndef PERF_COUNTERS
+#define PERF_COUNTERS
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/perf_event.h>)
+#  define PERF_COUNTERS_AVAILABLE 1
+# endif
+#endif
+
+#ifdef PERF_COUNTERS_AVAILABLE
+# include <unistd.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <linux/perf_event.h>
+#endif
+
+#define PERF_CYCLES        0
+#define PERF_INSTRUCTIONS  1
+#define PERF_BRANCH_MISSES 2
+#define PERF_PORT_0        3
+#define PERF_PORT_1        4
+#define PERF_PORT_5        5
+#define PERF_PORT_6        6
+#define PERF_N_EVENTS      7
+
+static const char *perf_event_names[PERF_N_EVENTS] = { "cycles", "instructions", "branch-misses", "port0", "port1", "port5", "port6" };
+
+typedef struct {
+    int fd[PERF_N_EVENTS];         // -1 when the counter is not available
+    double value[PERF_N_EVENTS];   // scaled counts of the last perf_counters_start() .. perf_counters_stop() interval
+    int multiplexed;               // some counter did not run all the time
+    int error;                     // errno of the first failed perf_event_open() (0 if none failed)
+} perf_counters_t;
+
+#ifdef PERF_COUNTERS_AVAILABLE
+
+//
+// raw event code of UOPS_DISPATCHED.PORT_n on this processor (0 when it is not known); the unit masks of ports 0, 1, 5
+// and 6 are 0x01, 0x02, 0x20 and 0x40 on all of them
+//
+
+static unsigned perf_port_event_code(void) {
+    static int code = -1;
+    char line[256];
+    int family = -1, model = -1, intel = 0;
+    FILE *fp;
+
+    if (code >= 0)
+        return (unsigned)code;
+    code = 0;
+    if ((fp = fopen("/proc/cpuinfo", "r")) == NULL)
+        return 0u;
+    while (fgets(line, sizeof(line), fp) != NULL && (family < 0 || model < 0)) {
+        if (strncmp(line, "vendor_id", 9) == 0 && strstr(line, "GenuineIntel") != NULL)
+            intel = 1;
+        (void)sscanf(line, "cpu family : %d", &family);
+        (void)sscanf(line, "model : %d", &model);
+    }
+    fclose(fp);
+    if (!intel || family != 6)
+        return 0u;
+    switch (model) {
+        case 0x4E: case 0x5E: case 0x55: case 0x8E: case 0x9E: case 0xA5: case 0xA6: // Skylake and its derivatives
+        case 0x6A: case 0x6C: case 0x7D: case 0x7E: case 0x8C: case 0x8D:            // Ice Lake and Tiger Lake
+            code = 0xA1;
+            break;
+        case 0x8F: case 0x97: case 0x9A: case 0xB7: case 0xBA: case 0xBF: case 0xCF: // Golden Cove and Raptor Cove
+            code = 0xB2;
+            break;
+    }
+    return (unsigned)code;
+}
+
+static int perf_event_open_counter(u32_t type, u64_t config) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int perf_counters_open(perf_counters_t *pc) {
+    static const u64_t port_umask[4] = { 0x01, 0x02, 0x20, 0x40 };
+    unsigned port_code = perf_port_event_code();
+    int e, n = 0;
+
+    memset(pc, 0, sizeof(*pc));
+    for (e = 0; e < PERF_N_EVENTS; e++) {
+        if (e == PERF_CYCLES)
+            pc->fd[e] = perf_event_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        else if (e == PERF_INSTRUCTIONS)
+            pc->fd[e] = perf_event_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        else if (e == PERF_BRANCH_MISSES)
+            pc->fd[e] = perf_event_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        else if (port_code != 0u)
+            pc->fd[e] = perf_event_open_counter(PERF_TYPE_RAW, (port_umask[e - PERF_PORT_0] << 8) | port_code);
+        else
+            pc->fd[e] = -1;
+        if (pc->fd[e] >= 0)
+            n++;
+        else if (pc->error == 0 && (e < PERF_PORT_0 || port_code != 0u))
+            pc->error = errno;
+    }
+    return n;
+}
+
+static void perf_counters_start(perf_counters_t *pc) {
+    for (int e = 0; e < PERF_N_EVENTS; e++)
+        if (pc->fd[e] >= 0) {
+            (void)ioctl(pc->fd[e], PERF_EVENT_IOC_RESET, 0);
+            (void)ioctl(pc->fd[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+static void perf_counters_stop(perf_counters_t *pc) {
+    u64_t data[3]; // value, time enabled, time running
+
+    for (int e = 0; e < PERF_N_EVENTS; e++)
+        if (pc->fd[e] >= 0)
+            (void)ioctl(pc->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+    pc->multiplexed = 0;
+    for (int e = 0; e < PERF_N_EVENTS; e++) {
+        pc->value[e] = -1.0;
+        if (pc->fd[e] < 0 || read(pc->fd[e], data, sizeof(data)) != (ssize_t)sizeof(data) || data[2] == 0u)
+            continue;
+        pc->value[e] = (double)data[0];
+        if (data[2] < data[1]) {
+            pc->value[e] *= (double)data[1] / (double)data[2];
+            pc->multiplexed = 1;
+        }
+    }
+}
+
+static void perf_counters_close(perf_counters_t *pc) {
+    for (int e = 0; e < PERF_N_EVENTS; e++)
+        if (pc->fd[e] >= 0) {
+            close(pc->fd[e]);
+            pc->fd[e] = -1;
+        }
+}
+
+#else
+
+static int perf_counters_open(perf_counters_t *pc) {
+    memset(pc, 0, sizeof(*pc));
+    for (int e = 0; e < PERF_N_EVENTS; e++)
+        pc->fd[e] = -1;
+    pc->error = ENOSYS;
+    return 0;
+}
+
+static void perf_counters_start(perf_counters_t *pc) {
+    (void)pc;
+}
+
+static void perf_counters_stop(perf_counters_t *pc) {
+    for (int e = 0; e < PERF_N_EVENTS; e++)
+        pc->value[e] = -1.0;
+}
+
+static void perf_counters_close(perf_counters_t *pc) {
+    (void)pc;
+}
+
+#endif
+#endif
@@ -0,0 +1,64 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// USDT static probes (provider deti_coins) for bpftrace, perf or SystemTap on a running miner
+//
+// with <sys/sdt.h> (systemtap-sdt-dev) each probe is a single nop plus an ELF note, so a probe that nobody attaches to
+// costs nothing; without it, or with -DDETI_PROBES=0, the probes are compiled out
+//
+//   batch             thread, tid, mode, attempts, coins, ns since the last batch probe of the thread
+//                     (every DETI_PROBE_BATCH_PERIOD calls of telemetry_count(), that is, batches or slices)
+//   hit               thread, lane, mode, position (candidate index in the keyspace modes, attempts of the thread otherwise)
+//   vault_append      power, coins in the buffer, CLOCK_MONOTONIC ns of the append
+//   vault_flush_start coins, ns the oldest of them waited in the buffer
+//   vault_flush_end   coins, ns of the write, ns from the append of the oldest coin to the end of the write
+//   server_accept     client id, fd, active clients
+//   server_disconnect client id, fd, coins received, coins accepted, ns connected
+//
+// example: bpftrace -e 'usdt:./deti_coins_intel:deti_coins:vault_flush_end { @hit_to_durable_us = hist(arg2 / 1000); }' -p PID
+//
+
+#ifndef PROBES
+#define PROBES
+
+#include <time.h>
+
+#ifndef DETI_PROBES
+# if defined(__linux__) && defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+#   define DETI_PROBES 1
+#  endif
+# endif
+#endif
+#ifndef DETI_PROBES
+# define DETI_PROBES 0
+#endif
+
+#ifndef DETI_PROBE_BATCH_PERIOD
+# define DETI_PROBE_BATCH_PERIOD 65536u // a power of two
+#endif
+
+#if DETI_PROBES
+# include <sys/sdt.h>
+# define DETI_PROBE2(name,a,b)           DTRACE_PROBE2(deti_coins,name,a,b)
+# define DETI_PROBE3(name,a,b,c)         DTRACE_PROBE3(deti_coins,name,a,b,c)
+# define DETI_PROBE4(name,a,b,c,d)       DTRACE_PROBE4(deti_coins,name,a,b,c,d)
+# define DETI_PROBE5(name,a,b,c,d,e)     DTRACE_PROBE5(deti_coins,name,a,b,c,d,e)
+# define DETI_PROBE6(name,a,b,c,d,e,f)   DTRACE_PROBE6(deti_coins,name,a,b,c,d,e,f)
+#else
+# define DETI_PROBE2(name,a,b)           do { (void)(a); (void)(b); } while(0)
+# define DETI_PROBE3(name,a,b,c)         do { (void)(a); (void)(b); (void)(c); } while(0)
+# define DETI_PROBE4(name,a,b,c,d)       do { (void)(a); (void)(b); (void)(c); (void)(d); } while(0)
+# define DETI_PROBE5(name,a,b,c,d,e)     do { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); } while(0)
+# define DETI_PROBE6(name,a,b,c,d,e,f)   do { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); (void)(f); } while(0)
+#endif
+
+// CLOCK_MONOTONIC time in nanoseconds (the time base of the probe arguments)
+static inline u64_t probe_time_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64_t)now.tv_sec * 1000000000ul + (u64_t)now.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,788 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// relay() --- coordinator of the client_search() miners of a rack, and a single client of the upstream server()
+//
+// toward its local clients the relay speaks exactly as server() does (leases, coins, heartbeats, acks); toward the
+// upstream server it is one client that holds up to RELAY_MAX_LEASES leases (it asks for them in its hello), so the
+// central server sees one connection per rack instead of one per machine
+//
+// each upstream lease is cut into RELAY_PIECES pieces, and a local lease is one piece; the candidates acknowledged
+// by the local clients are acknowledged upstream as the contiguous prefix of done pieces, a piece whose client
+// disconnects or stops acknowledging is handed to another local client, and when the upstream server revokes a lease
+// the local clients holding its pieces get a MSG_REVOKE too
+//
+// the coins of the local clients are deduplicated (a direct-mapped table of RELAY_DEDUP_SIZE fingerprints catches
+// the coins sent again after a reconnection of a local client; it is cleared with the upstream connection, because the
+// coins that the upstream server has not acknowledged must then be forwarded again) and batched into one MSG_COINS or MSG_HITS frame per type and tick;
+// a local client gets its MSG_COINS_ACK once the upstream server has acknowledged all the coins forwarded up to
+// its last one, so durability stays end to end; when the upstream connection is lost all the local connections
+// are closed (their clients spool the coins not acknowledged and reconnect with backoff) until it is back
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include "deti_coins_protocol.h"
+#include "client_avx.h" // client_open_socket()
+#include "server_avx.h" // MAX_PENDING_CONNECTIONS, MAX_EPOLL_EVENTS and raise_open_files_limit()
+
+#ifndef RELAY
+#define RELAY
+
+#define RELAY_MAX_LEASES 16 // Upstream leases held at the same time (at most MAX_RELAY_LEASES)
+#define RELAY_PIECES 16 // Pieces of an upstream lease (a local lease is one piece)
+#define RELAY_PIECE_SIZE (KEYSPACE_LEASE_SIZE / RELAY_PIECES) // Candidates of a piece (whole chunks)
+#define RELAY_MAX_CLIENT_LEASES MAX_CLIENT_LEASES // Max number of pieces held by a local client
+#define RELAY_DEDUP_SIZE (1u << 16) // Fingerprints of the recently forwarded coins (a power of two)
+#define RELAY_OUTPUT_SIZE 256 // Send buffer of a local connection (a few MSG_LEASE, MSG_REVOKE and MSG_COINS_ACK frames)
+#define RELAY_UPSTREAM_OUTPUT_SIZE (16u * (PROTOCOL_HEADER_SIZE + PROTOCOL_MAX_PAYLOAD)) // Send buffer of the upstream connection
+#define RELAY_TICK 100 // Milliseconds between two upstream batches
+
+typedef struct relay_connection_s relay_connection_t;
+
+// A piece of an upstream lease
+typedef struct {
+    u64_t first, count;         // candidates of the piece
+    u64_t done;                 // candidates done (counted from first, all of them completed)
+    u64_t issued_at;            // done when the piece was handed out (its client acks from there)
+    relay_connection_t *holder; // NULL while nobody is searching the piece
+    u32_t local_lease_id;
+    time_t deadline;            // the piece is handed to another client if it is not acknowledged before this time
+} relay_piece_t;
+
+// A lease of the upstream server
+typedef struct {
+    keyspace_lease_t lease;     // lease_id 0 means that the slot is free
+    u32_t n_pieces;
+    relay_piece_t pieces[RELAY_PIECES];
+} relay_lease_t;
+
+// Local coins acknowledged once the upstream server acknowledges upstream_after coins
+typedef struct {
+    u32_t upstream_after, local_after;
+} relay_mark_t;
+
+// State of one local client connection
+struct relay_connection_s {
+    relay_connection_t *prev, *next;
+    int fd;
+    int want_output;      // EPOLLOUT is enabled
+    u32_t client_id;
+    u32_t n_leases_wanted; // lease requests waiting for a free piece
+    u32_t coins_received, coins_acked;
+    u32_t n_coins;        // coins reported by the last MSG_PROGRESS or MSG_RESULT
+    u64_t n_attempts;     // attempts reported by the last MSG_PROGRESS or MSG_RESULT
+    relay_mark_t *marks;
+    u32_t n_marks, marks_capacity;
+    u32_t n_input, n_output;
+    u08_t input[PROTOCOL_HEADER_SIZE + PROTOCOL_MAX_PAYLOAD];
+    u08_t output[RELAY_OUTPUT_SIZE];
+};
+
+// The upstream connection, the leases and the coin batches (only touched by the event loop)
+static struct {
+    const char *host;
+    u32_t port;
+    int fd;                     // -1 while disconnected
+    int want_output;
+    int lease_requested;        // a MSG_LEASE_REQUEST is waiting for its answer
+    time_t backoff, next_attempt, last_heartbeat;
+    u32_t template_id;          // template of the last upstream lease
+    u32_t coins_forwarded;      // coins put in the batches on this connection (MSG_COINS_ACK counts the same way)
+    u32_t coins_acked;
+    u64_t n_attempts;           // totals of the local clients (relative to the upstream hello)
+    u32_t n_coins;
+    u32_t n_batch_coins, n_batch_hits;
+    u08_t batch_coins[4u + PROTOCOL_MAX_COINS * PROTOCOL_COIN_SIZE];
+    u08_t batch_hits[4u + PROTOCOL_MAX_HITS * PROTOCOL_HIT_SIZE];
+    u32_t n_input, n_output;
+    u08_t input[PROTOCOL_HEADER_SIZE + PROTOCOL_MAX_PAYLOAD];
+    u08_t output[RELAY_UPSTREAM_OUTPUT_SIZE];
+    relay_lease_t leases[RELAY_MAX_LEASES];
+    u64_t dedup[RELAY_DEDUP_SIZE];
+    u64_t n_forwarded, n_duplicates, n_rejected;
+} upstream = { .fd = -1, .backoff = 1 };
+
+static relay_connection_t *relay_connections = NULL;
+static u32_t relay_n_clients = 0, relay_n_connections = 0;
+static u32_t relay_next_lease_id = 1;
+
+//
+// output buffers
+//
+
+static int relay_queue_local(relay_connection_t *c, u32_t type, const u08_t *payload, u32_t length) {
+    if (c->n_output + PROTOCOL_HEADER_SIZE + length > RELAY_OUTPUT_SIZE)
+        return -1;
+    protocol_put_header(&c->output[c->n_output], type, length);
+    if (length > 0)
+        memcpy(&c->output[c->n_output + PROTOCOL_HEADER_SIZE], payload, length);
+    c->n_output += PROTOCOL_HEADER_SIZE + length;
+    return 0;
+}
+
+static int relay_queue_upstream(u32_t type, const u08_t *payload, u32_t length) {
+    if (upstream.fd < 0 || upstream.n_output + PROTOCOL_HEADER_SIZE + length > RELAY_UPSTREAM_OUTPUT_SIZE)
+        return -1;
+    protocol_put_header(&upstream.output[upstream.n_output], type, length);
+    if (length > 0)
+        memcpy(&upstream.output[upstream.n_output + PROTOCOL_HEADER_SIZE], payload, length);
+    upstream.n_output += PROTOCOL_HEADER_SIZE + length;
+    return 0;
+}
+
+// Try to send the pending output of a socket (returns -1 if the connection must be closed)
+static int relay_flush(int epoll_fd, int fd, void *ptr, u08_t *output, u32_t *n_output, int *want_output) {
+    struct epoll_event event;
+    u32_t n_sent = 0;
+
+    while (n_sent < *n_output) {
+        ssize_t n = send(fd, &output[n_sent], *n_output - n_sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            break;
+        if (n <= 0)
+            return -1;
+        n_sent += (u32_t)n;
+    }
+    memmove(output, &output[n_sent], *n_output - n_sent);
+    *n_output -= n_sent;
+    if ((*n_output > 0) == *want_output)
+        return 0;
+    *want_output = (*n_output > 0);
+    event.events = *want_output ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = ptr;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+#define relay_flush_local(epoll_fd, c) relay_flush((epoll_fd), (c)->fd, (c), (c)->output, &(c)->n_output, &(c)->want_output)
+#define relay_flush_upstream(epoll_fd) relay_flush((epoll_fd), upstream.fd, &upstream, upstream.output, &upstream.n_output, &upstream.want_output)
+
+//
+// pieces
+//
+
+static relay_piece_t *relay_find_piece(relay_connection_t *c, u32_t local_lease_id) {
+    for (u32_t i = 0; i < RELAY_MAX_LEASES; i++)
+        for (u32_t j = 0; upstream.leases[i].lease.lease_id != 0 && j < upstream.leases[i].n_pieces; j++)
+            if (upstream.leases[i].pieces[j].holder == c && upstream.leases[i].pieces[j].local_lease_id == local_lease_id)
+                return &upstream.leases[i].pieces[j];
+    return NULL;
+}
+
+static u32_t relay_count_pieces(relay_connection_t *holder) {
+    u32_t n = 0;
+
+    for (u32_t i = 0; i < RELAY_MAX_LEASES; i++)
+        for (u32_t j = 0; upstream.leases[i].lease.lease_id != 0 && j < upstream.leases[i].n_pieces; j++)
+            n += (upstream.leases[i].pieces[j].holder == holder &&
+                  upstream.leases[i].pieces[j].done < upstream.leases[i].pieces[j].count);
+    return n;
+}
+
+// Hand a free piece to a local client (returns -1 if there is none, or no room for the MSG_LEASE)
+static int relay_issue_lease(relay_connection_t *c) {
+    u08_t payload[PROTOCOL_LEASE_SIZE];
+    keyspace_lease_t lease;
+
+    if (c->n_output + PROTOCOL_HEADER_SIZE + PROTOCOL_LEASE_SIZE > RELAY_OUTPUT_SIZE)
+        return -1;
+    for (u32_t i = 0; i < RELAY_MAX_LEASES; i++)
+        for (u32_t j = 0; upstream.leases[i].lease.lease_id != 0 && j < upstream.leases[i].n_pieces; j++) {
+            relay_piece_t *piece = &upstream.leases[i].pieces[j];
+            if (piece->holder != NULL || piece->done == piece->count)
+                continue;
+            lease = upstream.leases[i].lease;
+            lease.lease_id = relay_next_lease_id++;
+            if (relay_next_lease_id == 0)
+                relay_next_lease_id = 1;
+            lease.first = piece->first + piece->done;
+            lease.count = piece->count - piece->done;
+            piece->holder = c;
+            piece->local_lease_id = lease.lease_id;
+            piece->issued_at = piece->done;
+            piece->deadline = time(NULL) + PROTOCOL_LEASE_TIMEOUT;
+            protocol_put_lease(payload, &lease);
+            return relay_queue_local(c, MSG_LEASE, payload, PROTOCOL_LEASE_SIZE);
+        }
+    return -1;
+}
+
+// Answer the lease requests that found no free piece
+static void relay_serve_waiting_clients(int epoll_fd) {
+    for (relay_connection_t *c = relay_connections; c != NULL; c = c->next)
+        if (c->n_leases_wanted > 0) {
+            while (c->n_leases_wanted > 0 && relay_issue_lease(c) == 0)
+                c->n_leases_wanted--;
+            (void)relay_flush_local(epoll_fd, c); // a send error shows up as EPOLLERR of the connection
+        }
+}
+
+// Candidates of an upstream lease done from its start (all of them completed)
+static u64_t relay_lease_done(const relay_lease_t *l) {
+    u64_t done = 0;
+
+    for (u32_t j = 0; j < l->n_pieces; j++) {
+        done += l->pieces[j].done;
+        if (l->pieces[j].done < l->pieces[j].count)
+            break;
+    }
+    return done;
+}
+
+// Give the pieces whose clients stopped acknowledging them to other clients
+static void relay_expire_pieces(int epoll_fd) {
+    time_t now = time(NULL);
+    int expired = 0;
+
+    for (u32_t i = 0; i < RELAY_MAX_LEASES; i++)
+        for (u32_t j = 0; upstream.leases[i].lease.lease_id != 0 && j < upstream.leases[i].n_pieces; j++) {
+            relay_piece_t *piece = &upstream.leases[i].pieces[j];
+            if (piece->holder != NULL && piece->deadline < now) {
+                printf("Relay client %u: lease %u expired\n", piece->holder->client_id, piece->local_lease_id);
+                piece->holder = NULL;
+                expired = 1;
+            }
+        }
+    if (expired)
+        relay_serve_waiting_clients(epoll_fd);
+}
+
+//
+// coins
+//
+
+static u64_t relay_fingerprint(const u08_t *data, u32_t size) {
+    u64_t h = 0xCBF29CE484222325ul; // FNV-1a
+
+    for (u32_t i = 0; i < size; i++)
+        h = (h ^ data[i]) * 0x100000001B3ul;
+    return h | 1ul; // 0 marks an empty entry
+}
+
+// Returns 1 if the coin was forwarded recently (and remembers it otherwise)
+static int relay_is_duplicate(u64_t fingerprint) {
+    u64_t *entry = &upstream.dedup[fingerprint & (RELAY_DEDUP_SIZE - 1u)];
+
+    if (*entry == fingerprint)
+        return 1;
+    *entry = fingerprint;
+    return 0;
+}
+
+// Queue the batched coins upstream (returns -1 if the upstream connection cannot take them)
+static int relay_send_batches(void) {
+    if (upstream.n_batch_coins > 0) {
+        put_u32(upstream.batch_coins, upstream.n_batch_coins);
+        if (relay_queue_upstream(MSG_COINS, upstream.batch_coins, 4u + upstream.n_batch_coins * PROTOCOL_COIN_SIZE) < 0)
+            return -1;
+        upstream.n_batch_coins = 0;
+    }
+    if (upstream.n_batch_hits > 0) {
+        put_u32(upstream.batch_hits, upstream.n_batch_hits);
+        if (relay_queue_upstream(MSG_HITS, upstream.batch_hits, 4u + upstream.n_batch_hits * PROTOCOL_HIT_SIZE) < 0)
+            return -1;
+        upstream.n_batch_hits = 0;
+    }
+    return 0;
+}
+
+// Add a coin (a 52-byte coin, or a 12-byte hit) to its batch; the two batches are never filled at the same time,
+// so the coins reach the upstream server in the order in which they were counted (returns -1 on a full upstream)
+static int relay_forward(const u08_t *data, int is_hit) {
+    if (relay_is_duplicate(relay_fingerprint(data, is_hit ? PROTOCOL_HIT_SIZE : PROTOCOL_COIN_SIZE))) {
+        upstream.n_duplicates++;
+        return 0;
+    }
+    if (((is_hit ? upstream.n_batch_coins : upstream.n_batch_hits) > 0 ||
+         (is_hit ? upstream.n_batch_hits == PROTOCOL_MAX_HITS : upstream.n_batch_coins == PROTOCOL_MAX_COINS)) &&
+        relay_send_batches() < 0)
+        return -1;
+    if (is_hit)
+        memcpy(&upstream.batch_hits[4u + upstream.n_batch_hits++ * PROTOCOL_HIT_SIZE], data, PROTOCOL_HIT_SIZE);
+    else
+        memcpy(&upstream.batch_coins[4u + upstream.n_batch_coins++ * PROTOCOL_COIN_SIZE], data, PROTOCOL_COIN_SIZE);
+    upstream.coins_forwarded++;
+    upstream.n_forwarded++;
+    return 0;
+}
+
+// Send a local client a MSG_COINS_ACK for its coins that the upstream server has acknowledged
+static void relay_acknowledge_coins(relay_connection_t *c) {
+    u32_t n_acked = c->coins_acked, n_done = 0;
+    u08_t payload[4];
+
+    while (n_done < c->n_marks && c->marks[n_done].upstream_after <= upstream.coins_acked)
+        n_acked = c->marks[n_done++].local_after;
+    if (n_acked == c->coins_acked)
+        return;
+    put_u32(payload, n_acked);
+    if (relay_queue_local(c, MSG_COINS_ACK, payload, 4) < 0)
+        return; // retried later
+    memmove(c->marks, &c->marks[n_done], (c->n_marks - n_done) * sizeof(relay_mark_t));
+    c->n_marks -= n_done;
+    c->coins_acked = n_acked;
+}
+
+static void relay_add_mark(relay_connection_t *c) {
+    if (c->n_marks == c->marks_capacity) {
+        c->marks_capacity = (c->marks_capacity == 0) ? 16 : 2 * c->marks_capacity;
+        if ((c->marks = realloc(c->marks, c->marks_capacity * sizeof(relay_mark_t))) == NULL) {
+            fprintf(stderr, "relay_add_mark: out of memory\n");
+            exit(1);
+        }
+    }
+    c->marks[c->n_marks++] = (relay_mark_t){ upstream.coins_forwarded, c->coins_received };
+}
+
+//
+// local connections
+//
+
+static void relay_close_local(int epoll_fd, relay_connection_t *c) {
+    printf("Relay client %u disconnected. Received %u coins.\n", c->client_id, c->coins_received);
+    for (u32_t i = 0; i < RELAY_MAX_LEASES; i++)
+        for (u32_t j = 0; upstream.leases[i].lease.lease_id != 0 && j < upstream.leases[i].n_pieces; j++)
+            if (upstream.leases[i].pieces[j].holder == c)
+                upstream.leases[i].pieces[j].holder = NULL;
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        relay_connections = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->marks);
+    free(c);
+    relay_n_clients--;
+}
+
+// Record the candidates done in a local lease; an ack for a piece the client no longer holds is answered with MSG_REVOKE
+static void relay_acknowledge_lease(relay_connection_t *c, u32_t local_lease_id, u64_t done) {
+    relay_piece_t *piece = relay_find_piece(c, local_lease_id);
+    u08_t payload[4];
+
+    if (piece == NULL || local_lease_id == 0) {
+        put_u32(payload, local_lease_id);
+        (void)relay_queue_local(c, MSG_REVOKE, payload, 4);
+        return;
+    }
+    done += piece->issued_at;
+    if (done > piece->done)
+        piece->done = (done < piece->count) ? done : piece->count;
+    piece->deadline = time(NULL) + PROTOCOL_LEASE_TIMEOUT;
+    if (piece->done == piece->count)
+        piece->holder = NULL; // completed
+}
+
+// Handle one complete frame of a local client (returns -1 if the connection must be closed)
+static int relay_process_local_message(relay_connection_t *c, u32_t type, const u08_t *payload, u32_t length) {
+    switch (type) {
+        case MSG_HELLO:
+            if (length != 8)
+                return -1;
+            printf("Relay client %u: %u threads with %u lanes each\n", c->client_id, get_u32(&payload[0]), get_u32(&payload[4]));
+            /* fall through */
+        case MSG_LEASE_REQUEST:
+            if (type == MSG_LEASE_REQUEST && length != 0)
+                return -1;
+            if (relay_count_pieces(c) + c->n_leases_wanted < RELAY_MAX_CLIENT_LEASES && relay_issue_lease(c) < 0)
+                c->n_leases_wanted++; // served when a piece becomes free
+            return 0;
+        case MSG_COINS:
+        case MSG_HITS: {
+            u32_t size = (type == MSG_COINS) ? PROTOCOL_COIN_SIZE : PROTOCOL_HIT_SIZE;
+            u32_t max = (type == MSG_COINS) ? PROTOCOL_MAX_COINS : PROTOCOL_MAX_HITS;
+            u32_t n = (length >= 4) ? get_u32(&payload[0]) : 0;
+            if (length < 4 || n > max || length != 4 + n * size)
+                return -1;
+            for (u32_t i = 0; i < n; i++) {
+                const u08_t *data = &payload[4 + i * size];
+                if (type == MSG_HITS && get_u32(data) != upstream.template_id) {
+                    upstream.n_rejected++; // not a candidate of the upstream template
+                    continue;
+                }
+                if (relay_forward(data, type == MSG_HITS) < 0)
+                    return -1;
+            }
+            c->coins_received += n;
+            relay_add_mark(c);
+            relay_acknowledge_coins(c); // nothing forwarded is waiting: acknowledge right away
+            return 0;
+        }
+        case MSG_PROGRESS:
+        case MSG_RESULT: {
+            u32_t n_acks = (length >= 16) ? get_u32(&payload[12]) : 0;
+            if (length < 16 || n_acks > PROTOCOL_MAX_ACKS || length != PROTOCOL_PROGRESS_SIZE(n_acks))
+                return -1;
+            if (get_u64(&payload[0]) >= c->n_attempts) {
+                upstream.n_attempts += get_u64(&payload[0]) - c->n_attempts;
+                c->n_attempts = get_u64(&payload[0]);
+            }
+            if (get_u32(&payload[8]) >= c->n_coins) {
+                upstream.n_coins += get_u32(&payload[8]) - c->n_coins;
+                c->n_coins = get_u32(&payload[8]);
+            }
+            for (u32_t i = 0; i < n_acks; i++)
+                relay_acknowledge_lease(c, get_u32(&payload[16 + 12 * i]), get_u64(&payload[20 + 12 * i]));
+            return 0;
+        }
+        default:
+            return -1;
+    }
+}
+
+// Receive and handle the frames of a local client (returns -1 if the connection must be closed)
+static int relay_receive_local(relay_connection_t *c) {
+    u32_t type, length, used = 0;
+    ssize_t n = recv(c->fd, &c->input[c->n_input], sizeof(c->input) - c->n_input, 0);
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n <= 0)
+        return -1;
+    c->n_input += (u32_t)n;
+    while (c->n_input - used >= PROTOCOL_HEADER_SIZE) {
+        if (protocol_get_header(&c->input[used], &type, &length) < 0)
+            return -1;
+        if (c->n_input - used < PROTOCOL_HEADER_SIZE + length)
+            break;
+        if (relay_process_local_message(c, type, &c->input[used + PROTOCOL_HEADER_SIZE], length) < 0) {
+            fprintf(stderr, "Relay client %u: bad message of type %u and length %u\n", c->client_id, type, length);
+            return -1;
+        }
+        used += PROTOCOL_HEADER_SIZE + length;
+    }
+    memmove(c->input, &c->input[used], c->n_input - used);
+    c->n_input -= used;
+    return 0;
+}
+
+static void relay_accept_clients(int epoll_fd, int listen_fd) {
+    struct epoll_event event;
+
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                perror("Failed to accept connection");
+            return;
+        }
+        if (upstream.fd < 0) {
+            close(fd); // no upstream server: the client retries later
+            continue;
+        }
+        relay_connection_t *c = calloc(1, sizeof(relay_connection_t));
+        if (c == NULL) {
+            fprintf(stderr, "relay_accept_clients: out of memory\n");
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->client_id = ++relay_n_connections;
+        event.events = EPOLLIN;
+        event.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("Failed to register connection");
+            close(fd);
+            free(c);
+            continue;
+        }
+        relay_n_clients++;
+        c->next = relay_connections;
+        if (relay_connections != NULL)
+            relay_connections->prev = c;
+        relay_connections = c;
+    }
+}
+
+//
+// upstream connection
+//
+
+// Drop the upstream connection, its leases and all the local connections (their clients keep the coins not
+// acknowledged and reconnect later)
+static void relay_upstream_lost(int epoll_fd, const char *reason) {
+    fprintf(stderr, "relay: %s; reconnecting in %ld second%s\n", reason, (long)upstream.backoff, (upstream.backoff == 1) ? "" : "s");
+    while (relay_connections != NULL)
+        relay_close_local(epoll_fd, relay_connections);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, upstream.fd, NULL);
+    close(upstream.fd);
+    upstream.fd = -1;
+    upstream.next_attempt = time(NULL) + upstream.backoff;
+    memset(upstream.leases, 0, sizeof(upstream.leases));
+    memset(upstream.dedup, 0, sizeof(upstream.dedup)); // the clients send again the coins not acknowledged upstream
+    upstream.n_batch_coins = upstream.n_batch_hits = 0;
+}
+
+static int relay_upstream_connect(int epoll_fd) {
+    struct epoll_event event;
+    u08_t payload[12];
+
+    if ((upstream.fd = client_open_socket(upstream.host, upstream.port)) < 0) {
+        fprintf(stderr, "relay: unable to connect to %s:%u; next attempt in %ld second%s\n", upstream.host, upstream.port,
+                (long)upstream.backoff, (upstream.backoff == 1) ? "" : "s");
+        upstream.next_attempt = time(NULL) + upstream.backoff;
+        upstream.backoff = (2 * upstream.backoff < CLIENT_MAX_BACKOFF) ? 2 * upstream.backoff : CLIENT_MAX_BACKOFF;
+        return -1;
+    }
+    (void)fcntl(upstream.fd, F_SETFL, fcntl(upstream.fd, F_GETFL, 0) | O_NONBLOCK);
+    upstream.n_input = upstream.n_output = 0;
+    upstream.want_output = 0;
+    upstream.lease_requested = 1; // the hello is answered with a lease
+    upstream.coins_forwarded = upstream.coins_acked = 0;
+    upstream.n_attempts = 0;
+    upstream.n_coins = 0;
+    upstream.last_heartbeat = time(NULL);
+    event.events = EPOLLIN;
+    event.data.ptr = &upstream;
+    put_u32(&payload[0], 0); // the threads of the local clients are not known yet
+    put_u32(&payload[4], 0);
+    put_u32(&payload[8], RELAY_MAX_LEASES);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, upstream.fd, &event) < 0 || relay_queue_upstream(MSG_HELLO, payload, 12) < 0) {
+        close(upstream.fd);
+        upstream.fd = -1;
+        upstream.next_attempt = time(NULL) + upstream.backoff;
+        return -1;
+    }
+    printf("Relay connected to %s:%u\n", upstream.host, upstream.port);
+    fflush(stdout);
+    upstream.backoff = 1;
+    return 0;
+}
+
+// Queue heartbeats (at most PROTOCOL_MAX_ACKS lease acks each) with the totals of the local clients
+static void relay_queue_progress(u32_t type) {
+    u08_t payload[PROTOCOL_PROGRESS_SIZE(PROTOCOL_MAX_ACKS)];
+    u32_t i = 0, n_acks, completed[PROTOCOL_MAX_ACKS], n_completed;
+
+    do {
+        for (n_acks = n_completed = 0; i < RELAY_MAX_LEASES && n_acks < PROTOCOL_MAX_ACKS; i++) {
+            relay_lease_t *l = &upstream.leases[i];
+            if (l->lease.lease_id == 0)
+                continue;
+            put_u32(&payload[16 + 12 * n_acks], l->lease.lease_id);
+            put_u64(&payload[20 + 12 * n_acks], relay_lease_done(l));
+            n_acks++;
+            if (relay_lease_done(l) == l->lease.count)
+                completed[n_completed++] = i;
+        }
+        put_u64(&payload[0], upstream.n_attempts);
+        put_u32(&payload[8], upstream.n_coins);
+        put_u32(&payload[12], n_acks);
+        if (relay_queue_upstream((i < RELAY_MAX_LEASES) ? MSG_PROGRESS : type, payload, PROTOCOL_PROGRESS_SIZE(n_acks)) < 0)
+            return; // the completed leases are acknowledged by a later heartbeat
+        for (u32_t j = 0; j < n_completed; j++)
+            upstream.leases[completed[j]].lease.lease_id = 0; // completed (and acknowledged now)
+    } while (i < RELAY_MAX_LEASES);
+    upstream.last_heartbeat = time(NULL);
+}
+
+// Ask for one more upstream lease when few pieces are left for the local clients
+static void relay_request_lease(void) {
+    u32_t n_free_slots = 0, n_free_pieces = 0;
+
+    for (u32_t i = 0; i < RELAY_MAX_LEASES; i++) {
+        relay_lease_t *l = &upstream.leases[i];
+        n_free_slots += (l->lease.lease_id == 0);
+        for (u32_t j = 0; l->lease.lease_id != 0 && j < l->n_pieces; j++)
+            n_free_pieces += (l->pieces[j].holder == NULL && l->pieces[j].done < l->pieces[j].count);
+    }
+    if (n_free_slots > 0 && !upstream.lease_requested && n_free_pieces < RELAY_PIECES / 2 &&
+        relay_queue_upstream(MSG_LEASE_REQUEST, NULL, 0) == 0)
+        upstream.lease_requested = 1;
+}
+
+static void relay_process_upstream_message(int epoll_fd, u32_t type, const u08_t *payload, u32_t length) {
+    if (type == MSG_LEASE && length == PROTOCOL_LEASE_SIZE) {
+        relay_lease_t *l = NULL;
+        upstream.lease_requested = 0;
+        for (u32_t i = 0; i < RELAY_MAX_LEASES && l == NULL; i++)
+            if (upstream.leases[i].lease.lease_id == 0)
+                l = &upstream.leases[i];
+        if (l == NULL) {
+            fprintf(stderr, "relay: unexpected lease ignored\n");
+            return;
+        }
+        memset(l, 0, sizeof(*l));
+        protocol_get_lease(payload, &l->lease);
+        upstream.template_id = l->lease.template_id;
+        l->n_pieces = (u32_t)((l->lease.count + RELAY_PIECE_SIZE - 1) / RELAY_PIECE_SIZE);
+        if (l->n_pieces > RELAY_PIECES || l->n_pieces == 0) {
+            fprintf(stderr, "relay: lease %u of %lu candidates ignored\n", l->lease.lease_id, l->lease.count);
+            l->lease.lease_id = 0;
+            return;
+        }
+        for (u32_t j = 0; j < l->n_pieces; j++) {
+            l->pieces[j].first = l->lease.first + j * RELAY_PIECE_SIZE;
+            l->pieces[j].count = (j + 1 < l->n_pieces) ? RELAY_PIECE_SIZE : l->lease.count - j * RELAY_PIECE_SIZE;
+        }
+        printf("Relay received lease %u: %lu candidates starting at %lu\n", l->lease.lease_id, l->lease.count, l->lease.first);
+        relay_serve_waiting_clients(epoll_fd);
+    } else if (type == MSG_REVOKE && length == 4) {
+        u32_t lease_id = get_u32(payload);
+        for (u32_t i = 0; i < RELAY_MAX_LEASES; i++) {
+            relay_lease_t *l = &upstream.leases[i];
+            if (l->lease.lease_id != lease_id || lease_id == 0)
+                continue;
+            for (u32_t j = 0; j < l->n_pieces; j++)
+                if (l->pieces[j].holder != NULL) {
+                    u08_t revoke[4];
+                    put_u32(revoke, l->pieces[j].local_lease_id);
+                    (void)relay_queue_local(l->pieces[j].holder, MSG_REVOKE, revoke, 4);
+                    (void)relay_flush_local(epoll_fd, l->pieces[j].holder);
+                }
+            l->lease.lease_id = 0;
+        }
+        printf("Relay lease %u revoked by the server\n", lease_id);
+    } else if (type == MSG_COINS_ACK && length == 4) {
+        upstream.coins_acked = get_u32(payload);
+        for (relay_connection_t *c = relay_connections; c != NULL; c = c->next) {
+            relay_acknowledge_coins(c);
+            (void)relay_flush_local(epoll_fd, c);
+        }
+    } else {
+        fprintf(stderr, "relay: unexpected message of type %u and length %u\n", type, length);
+    }
+}
+
+// Receive and handle the frames of the upstream server (returns -1 if the connection must be dropped)
+static int relay_receive_upstream(int epoll_fd) {
+    u32_t type, length, used = 0;
+    ssize_t n = recv(upstream.fd, &upstream.input[upstream.n_input], sizeof(upstream.input) - upstream.n_input, 0);
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n <= 0)
+        return -1;
+    upstream.n_input += (u32_t)n;
+    while (upstream.n_input - used >= PROTOCOL_HEADER_SIZE) {
+        if (protocol_get_header(&upstream.input[used], &type, &length) < 0)
+            return -1;
+        if (upstream.n_input - used < PROTOCOL_HEADER_SIZE + length)
+            break;
+        relay_process_upstream_message(epoll_fd, type, &upstream.input[used + PROTOCOL_HEADER_SIZE], length);
+        used += PROTOCOL_HEADER_SIZE + length;
+    }
+    memmove(upstream.input, &upstream.input[used], upstream.n_input - used);
+    upstream.n_input -= used;
+    return 0;
+}
+
+int relay(u32_t port, const char *upstream_host, u32_t upstream_port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY };
+    struct epoll_event event, events[MAX_EPOLL_EVENTS];
+    int listen_fd, epoll_fd, one = 1;
+    time_t last_expiry = time(NULL);
+
+    (void)alarm(0u); // a long-lived service, as server()
+    (void)signal(SIGINT, alarm_signal_handler);
+    (void)signal(SIGTERM, alarm_signal_handler);
+    (void)signal(SIGPIPE, SIG_IGN);
+    raise_open_files_limit();
+    upstream.host = upstream_host;
+    upstream.port = upstream_port;
+
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    (void)setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, MAX_PENDING_CONNECTIONS) < 0) {
+        perror("Socket binding failed");
+        exit(EXIT_FAILURE);
+    }
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // NULL marks the listening socket
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+    printf("Relay is listening on port %u (upstream server %s:%u)...\n", port, upstream_host, upstream_port);
+    fflush(stdout);
+
+    // Event loop
+    while (stop_request == 0) {
+        int n_events;
+
+        if (upstream.fd < 0 && time(NULL) >= upstream.next_attempt)
+            (void)relay_upstream_connect(epoll_fd);
+        n_events = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, RELAY_TICK);
+        if (n_events < 0 && errno != EINTR) {
+            perror("epoll_wait error");
+            break;
+        }
+        for (int i = 0; i < n_events; i++) {
+            relay_connection_t *c = events[i].data.ptr;
+            if (c == NULL) {
+                relay_accept_clients(epoll_fd, listen_fd);
+            } else if (events[i].data.ptr == (void *)&upstream) {
+                if (upstream.fd < 0)
+                    continue; // lost while handling an earlier event
+                if (((events[i].events & EPOLLOUT) && relay_flush_upstream(epoll_fd) < 0) ||
+                    ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && relay_receive_upstream(epoll_fd) < 0))
+                    relay_upstream_lost(epoll_fd, "connection to the server lost");
+            } else {
+                if (upstream.fd < 0)
+                    continue; // closed with the upstream connection
+                if (events[i].events & EPOLLOUT)
+                    relay_acknowledge_coins(c); // an ack may be waiting for room
+                if (((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && relay_receive_local(c) < 0) ||
+                    relay_flush_local(epoll_fd, c) < 0)
+                    relay_close_local(epoll_fd, c);
+            }
+        }
+        if (upstream.fd < 0)
+            continue;
+
+        // One upstream batch per tick: the coins, a lease request and, when due, the heartbeat
+        u32_t n_queued = upstream.n_output;
+        if (relay_send_batches() < 0) {
+            relay_upstream_lost(epoll_fd, "the server does not keep up");
+            continue;
+        }
+        relay_request_lease();
+        if (upstream.n_output != n_queued || time(NULL) - upstream.last_heartbeat >= PROTOCOL_HEARTBEAT_PERIOD)
+            relay_queue_progress(MSG_PROGRESS);
+        if (relay_flush_upstream(epoll_fd) < 0) {
+            relay_upstream_lost(epoll_fd, "connection to the server lost");
+            continue;
+        }
+        if (time(NULL) != last_expiry) {
+            relay_expire_pieces(epoll_fd);
+            last_expiry = time(NULL);
+        }
+    }
+    printf("Relay is shutting down.\n");
+
+    // Last words to the upstream server (the local clients keep the coins not acknowledged)
+    if (upstream.fd >= 0 && relay_send_batches() == 0) {
+        relay_queue_progress(MSG_RESULT);
+        (void)fcntl(upstream.fd, F_SETFL, fcntl(upstream.fd, F_GETFL, 0) & ~O_NONBLOCK);
+        if (send_all(upstream.fd, upstream.output, upstream.n_output) < 0)
+            perror("Failed to send result");
+    }
+    printf("Relay: %u local connections, %lu coins forwarded, %lu duplicates dropped, %lu coins of an unknown template rejected, "
+           "%lu attempts\n", relay_n_connections, upstream.n_forwarded, upstream.n_duplicates, upstream.n_rejected, upstream.n_attempts);
+    while (relay_connections != NULL)
+        relay_close_local(epoll_fd, relay_connections);
+    if (upstream.fd >= 0)
+        close(upstream.fd);
+    close(epoll_fd);
+    close(listen_fd);
+    return 0;
+}
+
+#endif
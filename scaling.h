@@ -0,0 +1,198 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// thread-scaling study of the multithreaded search engines
+//
+// for each placement policy (os, core, smt) and each number of threads from 1 to the number of usable cpus, the engine
+// searches for a fixed number of seconds; the attempts of each thread are read from the telemetry counters, and one
+// CSV line per point is appended to the CSV file (and echoed to stdout) with the throughput, the speedup and the
+// efficiency relative to one thread of the same policy, and the slowest and fastest thread
+//
+// engines:
+//   avx_openmp, avx2_openmp ---------- deti_coins_cpu_avx_openmp_search(), deti_coins_cpu_avx2_openmp_search()
+//   pool_avx, pool_avx2, pool_avx512 - the worker pool of the client and shared-memory modes (threads take
+//                                      KEYSPACE_CHUNK_SIZE chunks of a template and search them CLIENT_SLICE_SIZE
+//                                      candidates at a time with client_search_slice()) with that MD5 engine
+// coins found along the way are saved in the vault, as in the search modes
+//
+// scaling_study() --- run the sweep
+//
+
+#ifndef SCALING
+#define SCALING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <omp.h>
+
+#define SCALING_CSV_FILE "deti_coins_scaling.csv"
+
+//
+// the worker pool engine
+//
+
+// Save the coins that client_search_slice() left in the hit ring of a thread (the thread is the only one using it)
+static void scaling_save_hits(u32_t thread, const u32_t template[13]) {
+    client_hit_ring_t *ring = &client_hit_rings[thread];
+    u32_t coin[13];
+
+    for (; ring->tail != ring->head; ring->tail++) {
+        keyspace_make_coin(template, ring->hits[ring->tail % CLIENT_HIT_RING_SIZE].index, coin);
+        #pragma omp critical
+        save_deti_coin(coin);
+    }
+    for (; ring->n_overflow > 0u; ring->n_overflow--) {
+        keyspace_make_coin(template, ring->overflow[ring->n_overflow - 1u].index, coin);
+        #pragma omp critical
+        save_deti_coin(coin);
+    }
+}
+
+static void scaling_pool_search(const client_engine_t *engine, u32_t n_threads) {
+    static const char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    u64_t next_chunk = 0u;
+    client_chunk_t chunk;
+    coin_t template;
+
+    initialize_deti_coin(&template);
+    for (u32_t i = 0u; i < KEYSPACE_TAG_LENGTH; i++)
+        template.coin_as_chars[10u + i] = charset[random() % (sizeof(charset) - 1)];
+    memset(&chunk, 0, sizeof(chunk));
+    memcpy(chunk.template, template.coin_as_ints, sizeof(chunk.template));
+    client.engine = engine; // the engine of client_search_slice()
+    #pragma omp parallel num_threads(n_threads)
+    {
+        u32_t thread = (u32_t)omp_get_thread_num();
+        u64_t n_attempts = 0u, n_coins = 0u;
+
+        pin_worker_thread(thread);
+        while (stop_request == 0) {
+            u64_t first = __atomic_fetch_add(&next_chunk, 1u, __ATOMIC_RELAXED) * KEYSPACE_CHUNK_SIZE;
+            if (first >= KEYSPACE_SIZE)
+                break;
+            for (u64_t slice = first; slice < first + KEYSPACE_CHUNK_SIZE && stop_request == 0; slice += CLIENT_SLICE_SIZE) {
+                n_coins += client_search_slice(thread, &chunk, slice, CLIENT_SLICE_SIZE);
+                n_attempts += CLIENT_SLICE_SIZE;
+                telemetry_count(thread, n_attempts, n_coins);
+                scaling_save_hits(thread, chunk.template);
+            }
+        }
+        telemetry_count(thread, n_attempts, n_coins);
+    }
+    client.engine = NULL;
+}
+
+//
+// one point of the sweep (returns the attempts per second; rates[] gets those of each thread)
+//
+
+static double scaling_point(const char *engine, u32_t n_threads, u32_t seconds, double *rates) {
+    struct timespec start, end;
+    double elapsed;
+    u64_t n_attempts = 0u;
+
+    memset(telemetry_counters, 0, sizeof(telemetry_counters));
+    stop_request = 0;
+    (void)signal(SIGALRM, alarm_signal_handler);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    (void)alarm(seconds);
+    if (0)
+        ;
+#ifdef DETI_COINS_CPU_AVX_OPENMP_SEARCH
+    else if (strcmp(engine, "avx_openmp") == 0)
+        deti_coins_cpu_avx_openmp_search(1u, n_threads);
+#endif
+#ifdef DETI_COINS_CPU_AVX2_OPENMP_SEARCH
+    else if (strcmp(engine, "avx2_openmp") == 0)
+        deti_coins_cpu_avx2_openmp_search(1u, n_threads);
+#endif
+    else
+        for (u32_t i = 0u; i < sizeof(client_engines) / sizeof(client_engines[0]); i++)
+            if (strcmp(engine + 5, client_engines[i].name) == 0)
+                scaling_pool_search(&client_engines[i], n_threads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    (void)alarm(0u);
+    elapsed = (double)(end.tv_sec - start.tv_sec) + 1.0e-9 * (double)(end.tv_nsec - start.tv_nsec);
+    for (u32_t thread = 0u; thread < n_threads; thread++) {
+        rates[thread] = (double)telemetry_counters[thread].n_attempts / elapsed;
+        n_attempts += telemetry_counters[thread].n_attempts;
+    }
+    return (double)n_attempts / elapsed;
+}
+
+static int scaling_engine_is_known(const char *engine) {
+#ifdef DETI_COINS_CPU_AVX_OPENMP_SEARCH
+    if (strcmp(engine, "avx_openmp") == 0)
+        return 1;
+#endif
+#ifdef DETI_COINS_CPU_AVX2_OPENMP_SEARCH
+    if (strcmp(engine, "avx2_openmp") == 0)
+        return 1;
+#endif
+    if (strncmp(engine, "pool_", 5) == 0)
+        for (u32_t i = 0u; i < sizeof(client_engines) / sizeof(client_engines[0]); i++)
+            if (strcmp(engine + 5, client_engines[i].name) == 0)
+                return client_engines[i].supported();
+    return 0;
+}
+
+void scaling_study(const char *engine, u32_t seconds, const char *policies, const char *csv_file_name) {
+    static double rates[TELEMETRY_MAX_THREADS];
+    static const char *policy_names[3] = { "os", "core", "smt" };
+    u32_t max_threads = usable_cpu_count(), n_threads, n, thread;
+    double rate, rate_1, min_rate, max_rate;
+    FILE *fp;
+
+    if (!scaling_engine_is_known(engine)) {
+        fprintf(stderr, "scaling_study: unknown or unsupported engine \"%s\" (avx_openmp, avx2_openmp, pool_avx, pool_avx2 or pool_avx512)\n", engine);
+        exit(1);
+    }
+    if (max_threads > TELEMETRY_MAX_THREADS)
+        max_threads = TELEMETRY_MAX_THREADS;
+    if (strncmp(engine, "pool_", 5) == 0 && max_threads > MAX_CLIENT_THREADS)
+        max_threads = MAX_CLIENT_THREADS;
+    if ((fp = fopen(csv_file_name, "a")) == NULL) {
+        perror("scaling_study: CSV file");
+        exit(1);
+    }
+    printf("scaling study of %s: 1 to %u threads, %u seconds per point, policies %s, CSV in %s\n", engine, max_threads, seconds, policies,
+           csv_file_name);
+    fseek(fp, 0l, SEEK_END);
+    if (ftell(fp) == 0l)
+        fprintf(fp, "engine,policy,threads,seconds,attempts_per_second,per_thread,speedup,efficiency,slowest_thread,fastest_thread\n");
+    for (int policy = PLACEMENT_OS; policy <= PLACEMENT_SMT; policy++) {
+        const char *p = strstr(policies, policy_names[policy]);
+        if (p == NULL || (p != policies && p[-1] != ',') || (p[strlen(policy_names[policy])] != ',' && p[strlen(policy_names[policy])] != '\0'))
+            continue; // not in the list
+        rate_1 = 0.0;
+        for (n = 1u; n <= max_threads; n++) {
+            n_threads = setup_worker_placement(policy, n);
+            if (n_threads < n)
+                break; // no more cpus for this policy
+            rate = scaling_point(engine, n_threads, seconds, rates);
+            if (n_threads == 1u)
+                rate_1 = rate;
+            min_rate = max_rate = rates[0];
+            for (thread = 1u; thread < n_threads; thread++) {
+                if (rates[thread] < min_rate)
+                    min_rate = rates[thread];
+                if (rates[thread] > max_rate)
+                    max_rate = rates[thread];
+            }
+            fprintf(fp, "%s,%s,%u,%u,%.0f,%.0f,%.3f,%.3f,%.0f,%.0f\n", engine, policy_names[policy], n_threads, seconds, rate, rate / (double)n_threads,
+                    (rate_1 > 0.0) ? rate / rate_1 : 0.0, (rate_1 > 0.0) ? rate / rate_1 / (double)n_threads : 0.0, min_rate, max_rate);
+            fflush(fp);
+            printf("scaling: %s,%s,%u threads: %.2f million attempts per second, speedup %.2f, efficiency %.2f\n", engine, policy_names[policy],
+                   n_threads, rate * 1.0e-6, (rate_1 > 0.0) ? rate / rate_1 : 0.0, (rate_1 > 0.0) ? rate / rate_1 / (double)n_threads : 0.0);
+            fflush(stdout);
+        }
+    }
+    STORE_DETI_COINS();
+    fclose(fp);
+}
+
+#endif
@@ -1,243 +1,984 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// server() --- coordinator of the client_search() miners
+//
+// a single-threaded epoll event loop holds all the client connections (thousands of mostly idle ones are fine);
+// the verification of the received DETI coins and the vault writes are done by a pool of threads (deti_coins_verify.h),
+// so the event loop never hashes or touches the disk, and a client that sends bad coins only gets them rejected;
+// the accepted coins go through a write-ahead journal (deti_coins_journal.h) and are acknowledged to their client
+// with MSG_COINS_ACK only once they are durable; the server runs until SIGINT or SIGTERM (a long-lived service)
+//
+// the server owns the keyspace (deti_coins_keyspace.h): each client holds up to MAX_CLIENT_LEASES numbered leases
+// (a relay, see relay.h, up to MAX_RELAY_LEASES);
+// the client acknowledges completed candidates in its heartbeats, and the undone part of a lease whose client
+// disconnects or stops acknowledging is reissued to another client, so no work overlaps and none is lost
+//
+// the event loop has two backends: epoll, and (SERVER_IO_URING) io_uring with a multishot accept and one multishot
+// receive per connection into a ring of provided buffers, so an idle client costs no system call and a busy one
+// no readiness round trip; io_uring is used when the kernel supports it, epoll otherwise (or when asked for)
+//
+// a server started with scratch (for load tests that replay real coins, see load_generator.h) uses
+// SERVER_SCRATCH_VAULT_FILE and SERVER_SCRATCH_JOURNAL_FILE, emptied when it starts, instead of the vault and journal
+//
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <time.h>
+#include "search_utilities.h"
+#include "deti_coins_protocol.h"
+#include "deti_coins_verify.h"
+#include "io_uring_utilities.h"
+#include "probes.h"
 
 #ifndef SERVER_AVX
 #define SERVER_AVX
 
-#define MAX_CLIENTS 5 // Max number of simultaneously clients
-#define MAX_PENDING_CONNECTIONS 5 // Max number of client connection requests that can be queued
-#define MAX_TOTAL_CONNECTIONS 10 // Max number of connections the server will accept during its lifetime
-#define PREFIX_LENGTH 5 // Do not change this value
-
+#define MAX_PENDING_CONNECTIONS SOMAXCONN // Max number of client connection requests that can be queued
+#define MAX_EPOLL_EVENTS 256 // Max number of events handled per epoll_wait() call
+#define CONNECTION_BUFFER_SIZE 64 // Inline receive buffer of each connection (larger frames use a heap buffer)
+#define CONNECTION_OUTPUT_SIZE 224 // Send buffer of each connection (room for a few MSG_LEASE, MSG_REVOKE and MSG_COINS_ACK frames)
+#define MAX_CLIENT_LEASES 2 // Max number of leases held by a client (the one being searched and the next one)
+#define MAX_RELAY_LEASES 64 // Max number of leases held by a relay (it asks for them in its hello)
+#define RECENT_LEASES 4 // Completed leases of a connection whose hits are still accepted (they may trail the last ack)
+#define SERVER_STATS_PERIOD 60 // Seconds between two server statistics reports
+#define SERVER_SHUTDOWN_TIMEOUT 2 // Seconds the server spends at most sending the last acks when it shuts down
+#define SERVER_SCRATCH_VAULT_FILE "deti_coins_scratch_vault.txt" // Vault of a server started with scratch
+#define SERVER_SCRATCH_JOURNAL_FILE "deti_coins_scratch_journal.txt" // and its journal
+#define SERVER_URING_ENTRIES 1024 // Submission queue size of the io_uring backend
+#define SERVER_URING_BUFFERS 512 // Provided receive buffers of the io_uring backend (a power of two)
+#define SERVER_URING_BUFFER_SIZE 4096 // Size of each of them
+
+#ifndef SERVER_IO_URING
+# ifdef IO_URING_AVAILABLE
+#  define SERVER_IO_URING 1
+# else
+#  define SERVER_IO_URING 0
+# endif
+#endif
+
+// A range of candidates
 typedef struct {
-    u32_t total_n_coins;
-    u64_t total_n_attempts;
-} search_results_t;
+    u64_t first, count;
+} keyspace_range_t;
 
-// Struct for handling client threads
+// A lease handed to a client
 typedef struct {
+    u32_t lease_id;  // 0 means that the slot is free
+    u64_t first;     // first candidate index
+    u64_t count;     // number of candidates
+    u64_t done;      // candidates acknowledged by the client (counted from first)
+    time_t deadline; // the lease is reissued if it is not acknowledged before this time
+} server_lease_t;
+
+// State of one client connection (kept small: it is all the server stores for an idle client)
+typedef struct connection_s {
+    struct connection_s *prev, *next; // list of all connections (used to expire leases)
     int client_fd;
-    struct sockaddr_in client_addr;
-    search_results_t client_result;
-} client_data_t;
-
-typedef struct {
-    pthread_mutex_t mutex;
-    int active_clients;
-    int total_connections;
-} server_state_t;
-
-server_state_t server_state = {
-    .mutex = PTHREAD_MUTEX_INITIALIZER,
-    .active_clients = 0,
-    .total_connections = 0,
-};
-
-// Global variables to store aggregated results and DETI coins
+    int want_output;   // EPOLLOUT is enabled
+    u32_t n_sending;   // io_uring: bytes of output[] being sent
+    u32_t n_pending_ops; // io_uring: submitted operations not yet completed (it is freed only when zero)
+    u32_t client_id;
+    u32_t coins_received;
+    u32_t coins_accepted;  // verified coins
+    u32_t coins_rejected;  // coins that failed the verification
+    u32_t coins_acked; // coins covered by the last MSG_COINS_ACK
+    u32_t n_verifying; // coins of this connection still in the verification pool (it is freed only when zero)
+    u32_t n_coins;     // coins reported by the last MSG_PROGRESS or MSG_RESULT
+    u64_t n_attempts;  // attempts reported by the last MSG_PROGRESS or MSG_RESULT
+    u64_t connect_ns;  // time of the accept (for the disconnect probe)
+    u08_t *input;      // small_input[] or, while a large frame is being received, a heap buffer
+    u32_t input_size;  // size of input[]
+    u32_t n_input;     // bytes waiting in input[]
+    u32_t n_output;    // bytes waiting in output[]
+    u32_t max_leases;  // size of leases[]
+    server_lease_t *leases; // small_leases[] or, for a relay, a heap buffer
+    server_lease_t small_leases[MAX_CLIENT_LEASES];
+    keyspace_range_t recent_leases[RECENT_LEASES]; // the last completed leases (round robin)
+    u32_t n_recent_leases;
+    u08_t output[CONNECTION_OUTPUT_SIZE];
+    u08_t small_input[CONNECTION_BUFFER_SIZE];
+} connection_t;
+
+// Aggregated results (only touched by the event loop)
 static u32_t total_coins = 0;
+static u32_t total_accepted_coins = 0;
+static u32_t total_rejected_coins = 0;
 static u64_t total_attempts = 0;
-static pthread_mutex_t results_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-// Function to print the server state
-void print_server_state() {
-    pthread_mutex_lock(&server_state.mutex);
-    printf("Server State: Active Clients = %d, Total Connections = %d\n",
-           server_state.active_clients, server_state.total_connections);
-    pthread_mutex_unlock(&server_state.mutex);
+static u32_t active_clients = 0;
+static u32_t total_connections = 0;
+static connection_t *connections = NULL;
+
+// Keyspace (only touched by the event loop): the template of this session, the first never issued candidate
+// and the ranges of expired leases waiting to be reissued
+static u32_t server_template[13];
+static u32_t server_template_id;
+static u64_t next_index = 0;
+static u32_t next_lease_id = 1;
+static keyspace_range_t *free_ranges = NULL;
+static u32_t n_free_ranges = 0, free_ranges_capacity = 0;
+static u64_t n_reissued_leases = 0;
+
+// io_uring backend (server_ring.fd is -1 when epoll is used); the operation is kept in the low bits of the user_data
+// of each request, the rest is the connection
+#if SERVER_IO_URING
+enum { URING_RECV = 0, URING_SEND, URING_ACCEPT, URING_VERIFY, URING_TIMEOUT, URING_CANCEL };
+#define URING_OP_MASK 7ul
+
+static io_ring_t server_ring = { .fd = -1 };
+static io_buffers_t server_buffers;
+#endif
+
+// Make the template of this session (the random tag keeps sessions from searching the same candidates)
+static void server_init_keyspace(void) {
+    const char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    coin_t coin;
+
+    initialize_deti_coin(&coin);
+    for (u32_t i = 0; i < KEYSPACE_TAG_LENGTH; i++)
+        coin.coin_as_chars[10u + i] = charset[random() % (sizeof(charset) - 1)];
+    memcpy(server_template, coin.coin_as_ints, sizeof(server_template));
+    server_template_id = (u32_t)random();
+    printf("Keyspace template %08x: %.52s", server_template_id, coin.coin_as_chars);
 }
 
-// Function to generate a random prefix of a given length
-void generate_random_prefix(char *prefix, size_t length) {
-    const char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
-    for (size_t i = 0; i < length; i++) {
-        prefix[i] = charset[rand() % (sizeof(charset) - 1)];
+//
+// event loop helpers
+//
+
+// Try to send the pending output (returns -1 if the connection must be closed)
+static int flush_connection(int epoll_fd, connection_t *connection) {
+    struct epoll_event event;
+
+#if SERVER_IO_URING
+    if (server_ring.fd >= 0) {
+        // one send in flight per connection; its completion sends what was queued meanwhile
+        if (connection->n_sending == 0 && connection->n_output > 0) {
+            struct io_uring_sqe *sqe = io_ring_get_sqe(&server_ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = connection->client_fd;
+            sqe->addr = (u64_t)(uintptr_t)connection->output;
+            sqe->len = connection->n_output;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = (u64_t)(uintptr_t)connection | URING_SEND;
+            connection->n_sending = connection->n_output;
+            connection->n_pending_ops++;
+        }
+        return 0;
+    }
+#endif
+    while (connection->n_output > 0) {
+        ssize_t n = send(connection->client_fd, connection->output, connection->n_output, MSG_NOSIGNAL);
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0)
+            return -1;
+        memmove(connection->output, &connection->output[n], connection->n_output - (u32_t)n);
+        connection->n_output -= (u32_t)n;
     }
-    prefix[length] = '\0'; // Null-terminate the string
+    if ((connection->n_output > 0) == connection->want_output)
+        return 0;
+    connection->want_output = (connection->n_output > 0);
+    event.events = connection->want_output ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = connection;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->client_fd, &event);
 }
 
-// Function to handle communication with a single client
-void *handle_client(void *arg) {
-    client_data_t *client_data = (client_data_t *)arg;
-    int client_fd = client_data->client_fd;
-    char prefix[PREFIX_LENGTH + 1] = {0};
+// Append a frame to the pending output (returns -1 if there is no room for it)
+static int queue_output(connection_t *connection, u32_t type, const u08_t *payload, u32_t length) {
+    if (connection->n_output + PROTOCOL_HEADER_SIZE + length > CONNECTION_OUTPUT_SIZE)
+        return -1;
+    protocol_put_header(&connection->output[connection->n_output], type, length);
+    memcpy(&connection->output[connection->n_output + PROTOCOL_HEADER_SIZE], payload, length);
+    connection->n_output += PROTOCOL_HEADER_SIZE + length;
+    return 0;
+}
 
-    // Generate and send a random prefix
-    generate_random_prefix(prefix, PREFIX_LENGTH);
-    if (send(client_fd, prefix, PREFIX_LENGTH, 0) < 0) {
-        perror("Failed to send prefix");
-        close(client_fd);
-        free(client_data);
-        pthread_exit(NULL);
+//
+// leases
+//
+
+// Give a free slot of the connection a new lease: reissue an expired range first, otherwise a fresh one
+static int issue_lease(connection_t *connection) {
+    u08_t payload[PROTOCOL_LEASE_SIZE];
+    keyspace_lease_t lease;
+    server_lease_t *slot = NULL;
+
+    for (u32_t i = 0; i < connection->max_leases && slot == NULL; i++)
+        if (connection->leases[i].lease_id == 0)
+            slot = &connection->leases[i];
+    if (slot == NULL || connection->n_output + PROTOCOL_HEADER_SIZE + PROTOCOL_LEASE_SIZE > CONNECTION_OUTPUT_SIZE)
+        return -1;
+    if (n_free_ranges > 0) {
+        keyspace_range_t *range = &free_ranges[n_free_ranges - 1];
+        lease.first = range->first;
+        lease.count = (range->count > KEYSPACE_LEASE_SIZE) ? KEYSPACE_LEASE_SIZE : range->count;
+        range->first += lease.count;
+        range->count -= lease.count;
+        if (range->count == 0)
+            n_free_ranges--;
+        n_reissued_leases++;
+    } else {
+        if (next_index >= KEYSPACE_SIZE)
+            return -1; // the keyspace of this template is exhausted
+        lease.first = next_index;
+        lease.count = (KEYSPACE_SIZE - next_index > KEYSPACE_LEASE_SIZE) ? KEYSPACE_LEASE_SIZE : KEYSPACE_SIZE - next_index;
+        next_index += lease.count;
     }
-    printf("Sent prefix '%s' to client\n", prefix);
+    lease.lease_id = next_lease_id++;
+    if (next_lease_id == 0)
+        next_lease_id = 1;
+    lease.template_id = server_template_id;
+    memcpy(lease.template, server_template, sizeof(lease.template));
+    slot->lease_id = lease.lease_id;
+    slot->first = lease.first;
+    slot->count = lease.count;
+    slot->done = 0;
+    slot->deadline = time(NULL) + PROTOCOL_LEASE_TIMEOUT;
+    protocol_put_lease(payload, &lease);
+    return queue_output(connection, MSG_LEASE, payload, PROTOCOL_LEASE_SIZE);
+}
 
-    char buffer[1024] = {0};
-    int coins_received = 0;
-    while (1) {
-        ssize_t bytes_received = recv(client_fd, buffer, sizeof(buffer), 0);
-        if (bytes_received <= 0) {
-            break; // Client disconnected
+// Forget a lease, keeping its undone candidates for another client
+static void release_lease(server_lease_t *slot) {
+    if (slot->lease_id == 0)
+        return;
+    if (slot->done < slot->count) {
+        if (n_free_ranges == free_ranges_capacity) {
+            free_ranges_capacity = (free_ranges_capacity == 0) ? 64 : 2 * free_ranges_capacity;
+            free_ranges = realloc(free_ranges, free_ranges_capacity * sizeof(*free_ranges));
+            if (free_ranges == NULL) {
+                fprintf(stderr, "release_lease: out of memory\n");
+                exit(1);
+            }
         }
+        free_ranges[n_free_ranges].first = slot->first + slot->done;
+        free_ranges[n_free_ranges].count = slot->count - slot->done;
+        n_free_ranges++;
+    }
+    slot->lease_id = 0;
+}
 
-        // Process client messages
-        if (bytes_received == 1 && buffer[0] == 0) { 
-            // End signal
-            printf("End Signal\n");
-            break;
-        } else if (bytes_received == sizeof(search_results_t) + 1) { 
-            // Result signal + end signal
-            printf("Saved the results\n");
-            search_results_t *result = (search_results_t *)buffer;
-            pthread_mutex_lock(&results_mutex);
-            total_coins += result->total_n_coins;
-            total_attempts += result->total_n_attempts;
-            pthread_mutex_unlock(&results_mutex);
-        } else if (bytes_received == 52) { 
-            // DETI coin received
-            save_deti_coin((u32_t *)buffer);
-            coins_received++;
-            printf("Saved Deti coin\n");
-        }
-        else {
-            fprintf(stderr, "Received unexpected message of size %zd bytes.\n", bytes_received);
+// Record the candidates done in a lease; an ack for a lease the client no longer holds is answered with MSG_REVOKE
+static void acknowledge_lease(connection_t *connection, u32_t lease_id, u64_t done) {
+    u08_t payload[4];
+
+    for (u32_t i = 0; i < connection->max_leases; i++) {
+        server_lease_t *slot = &connection->leases[i];
+        if (slot->lease_id != lease_id || lease_id == 0)
+            continue;
+        if (done > slot->done)
+            slot->done = (done < slot->count) ? done : slot->count;
+        slot->deadline = time(NULL) + PROTOCOL_LEASE_TIMEOUT;
+        if (slot->done == slot->count) {
+            keyspace_range_t *recent = &connection->recent_leases[connection->n_recent_leases++ % RECENT_LEASES];
+            recent->first = slot->first;
+            recent->count = slot->count;
+            slot->lease_id = 0; // completed
         }
+        return;
     }
+    put_u32(payload, lease_id);
+    (void)queue_output(connection, MSG_REVOKE, payload, 4);
+}
 
-    printf("Client disconnected. Received %d coins.\n", coins_received);
-    close(client_fd);
-    free(client_data);
+// Is a candidate in one of the leases of a connection? (the hits of a lease may arrive just after its last ack)
+static int connection_holds_candidate(const connection_t *connection, u64_t index) {
+    for (u32_t i = 0; i < connection->max_leases; i++)
+        if (connection->leases[i].lease_id != 0 && index - connection->leases[i].first < connection->leases[i].count)
+            return 1;
+    for (u32_t i = 0; i < RECENT_LEASES && i < connection->n_recent_leases; i++)
+        if (index - connection->recent_leases[i].first < connection->recent_leases[i].count)
+            return 1;
+    return 0;
+}
 
-    pthread_mutex_lock(&server_state.mutex);
-    server_state.active_clients--;
-    pthread_mutex_unlock(&server_state.mutex);
+// Reissue the leases that were not acknowledged in time
+static void expire_leases(void) {
+    time_t now = time(NULL);
 
-    pthread_exit(NULL);
+    for (connection_t *connection = connections; connection != NULL; connection = connection->next)
+        for (u32_t i = 0; i < connection->max_leases; i++)
+            if (connection->leases[i].lease_id != 0 && connection->leases[i].deadline < now) {
+                printf("Client %u: lease %u expired after %lu of %lu candidates\n", connection->client_id,
+                       connection->leases[i].lease_id, connection->leases[i].done, connection->leases[i].count);
+                release_lease(&connection->leases[i]);
+            }
 }
 
+// Tell the client how many of its coins are durable or rejected, once none of them is still being verified (the
+// pool does not finish them in order); it is retried later when the output buffer is full
+static void acknowledge_coins(connection_t *connection) {
+    u08_t payload[4];
 
-int server(u32_t server_port) {
-    int server_fd;
-    struct sockaddr_in server_addr, client_addr;
+    if (connection->n_verifying > 0 || connection->coins_acked == connection->coins_received)
+        return;
+    put_u32(payload, connection->coins_received);
+    if (queue_output(connection, MSG_COINS_ACK, payload, 4) == 0)
+        connection->coins_acked = connection->coins_received;
+}
 
-    // Create and set up the server socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+// Free a closed connection once nothing refers to it any more
+static void release_connection(connection_t *connection) {
+    if (connection->client_fd < 0 && connection->n_verifying == 0 && connection->n_pending_ops == 0)
+        free(connection);
+}
+
+static void close_connection(int epoll_fd, connection_t *connection) {
+    printf("Client %u disconnected. Received %u coins.\n", connection->client_id, connection->coins_received);
+    DETI_PROBE5(server_disconnect, connection->client_id, connection->client_fd, connection->coins_received, connection->coins_accepted,
+                probe_time_ns() - connection->connect_ns);
+    for (u32_t i = 0; i < connection->max_leases; i++)
+        release_lease(&connection->leases[i]);
+    if (connection->leases != connection->small_leases)
+        free(connection->leases);
+    if (connection->prev != NULL)
+        connection->prev->next = connection->next;
+    else
+        connections = connection->next;
+    if (connection->next != NULL)
+        connection->next->prev = connection->prev;
+#if SERVER_IO_URING
+    if (server_ring.fd >= 0) {
+        // the canceled receive and send complete later (with -ECANCELED), so the connection outlives them
+        struct io_uring_sqe *sqe = io_ring_get_sqe(&server_ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = connection->client_fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = URING_CANCEL;
+        (void)io_ring_submit(&server_ring, 0);
+    } else
+#endif
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->client_fd, NULL);
+    close(connection->client_fd);
+    connection->client_fd = -1;
+    if (connection->input != connection->small_input)
+        free(connection->input);
+    connection->input = NULL;
+    active_clients--;
+    release_connection(connection);
+}
+
+// Account for the coins verified by the pool, acknowledge them (frees the closed connections that have no coins left in it)
+static void collect_verification_results(int epoll_fd) {
+    verify_result_t *results;
+    size_t n_results = verify_pool_take_results(&results);
+
+    for (size_t i = 0; i < n_results; i++) {
+        connection_t *connection = results[i].owner;
+        connection->coins_accepted += results[i].n_accepted;
+        connection->coins_rejected += results[i].n_rejected;
+        connection->n_verifying -= results[i].n_accepted + results[i].n_rejected;
+        total_accepted_coins += results[i].n_accepted;
+        total_rejected_coins += results[i].n_rejected;
+        if (results[i].n_rejected > 0)
+            fprintf(stderr, "Client %u: %u invalid coin%s rejected (%u so far)\n", connection->client_id, results[i].n_rejected,
+                    (results[i].n_rejected == 1) ? "" : "s", connection->coins_rejected);
+        if (connection->client_fd < 0)
+            release_connection(connection);
+        else if (connection->n_verifying == 0) {
+            acknowledge_coins(connection);
+            (void)flush_connection(epoll_fd, connection); // a send error shows up as EPOLLERR of the connection
+        }
     }
+    free(results);
+}
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(server_port);
+// Send the last acks before the server exits (epoll backend; the sockets are nonblocking, so wait for room with poll())
+static void flush_connections_on_exit(int epoll_fd) {
+    time_t deadline = time(NULL) + SERVER_SHUTDOWN_TIMEOUT;
+
+    for (connection_t *connection = connections; connection != NULL; connection = connection->next) {
+        acknowledge_coins(connection);
+        while (connection->n_output > 0 && time(NULL) < deadline) {
+            struct pollfd pfd = { .fd = connection->client_fd, .events = POLLOUT };
+            if (poll(&pfd, 1, 1000 * (int)(deadline - time(NULL))) <= 0 || flush_connection(epoll_fd, connection) < 0)
+                break; // the client keeps the coins not acknowledged
+            acknowledge_coins(connection); // an ack may be waiting for room
+        }
+    }
+}
 
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Socket binding failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+// Update the totals with the counters of a MSG_PROGRESS or MSG_RESULT message (they are cumulative)
+static void update_client_progress(connection_t *connection, u64_t n_attempts, u32_t n_coins) {
+    if (n_attempts >= connection->n_attempts) {
+        total_attempts += n_attempts - connection->n_attempts;
+        connection->n_attempts = n_attempts;
     }
+    if (n_coins >= connection->n_coins) {
+        total_coins += n_coins - connection->n_coins;
+        connection->n_coins = n_coins;
+    }
+}
 
-    if (listen(server_fd, MAX_PENDING_CONNECTIONS) < 0) {
-        perror("Listening failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+// Handle one complete frame (returns -1 if the connection must be closed)
+static int process_client_message(connection_t *connection, u32_t type, const u08_t *payload, u32_t length) {
+    switch (type) {
+        case MSG_HELLO:
+            if (length != 8 && length != 12)
+                return -1;
+            if (length == 12 && get_u32(&payload[8]) > MAX_CLIENT_LEASES && connection->leases == connection->small_leases) {
+                // a relay: more leases, to be divided among its own clients
+                u32_t max_leases = (get_u32(&payload[8]) < MAX_RELAY_LEASES) ? get_u32(&payload[8]) : MAX_RELAY_LEASES;
+                server_lease_t *leases = calloc(max_leases, sizeof(server_lease_t));
+                if (leases == NULL)
+                    return -1;
+                memcpy(leases, connection->small_leases, sizeof(connection->small_leases));
+                connection->leases = leases;
+                connection->max_leases = max_leases;
+            }
+            printf("Client %u: %u threads with %u lanes each%s\n", connection->client_id, get_u32(&payload[0]), get_u32(&payload[4]),
+                   (connection->max_leases > MAX_CLIENT_LEASES) ? " (relay)" : "");
+            if (issue_lease(connection) < 0)
+                fprintf(stderr, "Client %u: no lease available\n", connection->client_id);
+            return 0;
+        case MSG_LEASE_REQUEST:
+            if (length != 0)
+                return -1;
+            (void)issue_lease(connection); // ignored when the client already holds all the leases it may hold
+            return 0;
+        case MSG_COINS: {
+            u32_t n_coins = (length >= 4) ? get_u32(&payload[0]) : 0;
+            if (length < 4 || n_coins > PROTOCOL_MAX_COINS || length != 4 + n_coins * PROTOCOL_COIN_SIZE)
+                return -1;
+            for (u32_t i = 0; i < n_coins; i++) {
+                u32_t coin[13];
+                memcpy(coin, &payload[4 + i * PROTOCOL_COIN_SIZE], sizeof(coin));
+                verify_pool_push(connection, coin);
+            }
+            connection->coins_received += n_coins;
+            connection->n_verifying += n_coins;
+            return 0;
+        }
+        case MSG_HITS: {
+            u32_t n_hits = (length >= 4) ? get_u32(&payload[0]) : 0, n_unknown = 0, n_foreign = 0;
+            if (length < 4 || n_hits > PROTOCOL_MAX_HITS || length != 4 + n_hits * PROTOCOL_HIT_SIZE)
+                return -1;
+            for (u32_t i = 0; i < n_hits; i++) {
+                const u08_t *hit = &payload[4 + i * PROTOCOL_HIT_SIZE];
+                u64_t index = get_u64(&hit[4]);
+                u32_t coin[13];
+                if (get_u32(&hit[0]) != server_template_id || index >= KEYSPACE_SIZE) {
+                    n_unknown++; // not a candidate of this session
+                    continue;
+                }
+                if (!connection_holds_candidate(connection, index)) {
+                    n_foreign++; // not a candidate this client was asked to search
+                    continue;
+                }
+                keyspace_make_coin(server_template, index, coin);
+                verify_pool_push(connection, coin);
+            }
+            connection->coins_received += n_hits;
+            connection->n_verifying += n_hits - n_unknown - n_foreign;
+            connection->coins_rejected += n_unknown + n_foreign;
+            total_rejected_coins += n_unknown + n_foreign;
+            if (n_unknown > 0)
+                fprintf(stderr, "Client %u: %u coin%s of an unknown template rejected\n", connection->client_id, n_unknown,
+                        (n_unknown == 1) ? "" : "s");
+            if (n_foreign > 0)
+                fprintf(stderr, "Client %u: %u coin%s outside its leases rejected\n", connection->client_id, n_foreign,
+                        (n_foreign == 1) ? "" : "s");
+            return 0;
+        }
+        case MSG_PROGRESS:
+        case MSG_RESULT: {
+            u32_t n_acks = (length >= 16) ? get_u32(&payload[12]) : 0;
+            if (length < 16 || n_acks > PROTOCOL_MAX_ACKS || length != PROTOCOL_PROGRESS_SIZE(n_acks))
+                return -1;
+            update_client_progress(connection, get_u64(&payload[0]), get_u32(&payload[8]));
+            for (u32_t i = 0; i < n_acks; i++)
+                acknowledge_lease(connection, get_u32(&payload[16 + 12 * i]), get_u64(&payload[20 + 12 * i]));
+            return 0;
+        }
+        default:
+            return -1;
     }
+}
 
-    printf("Server is listening on port %d...\n", server_port);
+// Consume the complete frames of the input buffer (returns -1 if the connection must be closed)
+static int process_client_messages(connection_t *connection) {
+    u32_t used = 0, type, length;
 
-    pthread_t threads[MAX_TOTAL_CONNECTIONS];
-    int thread_count = 0;
+    while (connection->n_input - used >= PROTOCOL_HEADER_SIZE) {
+        if (protocol_get_header(&connection->input[used], &type, &length) < 0) {
+            fprintf(stderr, "Client %u: bad frame header\n", connection->client_id);
+            return -1;
+        }
+        if (connection->n_input - used < PROTOCOL_HEADER_SIZE + length)
+            break;
+        if (process_client_message(connection, type, &connection->input[used + PROTOCOL_HEADER_SIZE], length) < 0) {
+            fprintf(stderr, "Client %u: bad message of type %u and length %u\n", connection->client_id, type, length);
+            return -1;
+        }
+        used += PROTOCOL_HEADER_SIZE + length;
+    }
+    memmove(connection->input, &connection->input[used], connection->n_input - used);
+    connection->n_input -= used;
+
+    // Make sure the frame being received fits in the input buffer; go back to the inline buffer when possible
+    if (connection->n_input >= PROTOCOL_HEADER_SIZE) {
+        protocol_get_header(connection->input, &type, &length);
+        if (PROTOCOL_HEADER_SIZE + length > connection->input_size) {
+            u08_t *input = malloc(PROTOCOL_HEADER_SIZE + PROTOCOL_MAX_PAYLOAD);
+            if (input == NULL)
+                return -1;
+            memcpy(input, connection->input, connection->n_input);
+            if (connection->input != connection->small_input)
+                free(connection->input);
+            connection->input = input;
+            connection->input_size = PROTOCOL_HEADER_SIZE + PROTOCOL_MAX_PAYLOAD;
+        }
+    } else if (connection->input != connection->small_input) {
+        memcpy(connection->small_input, connection->input, connection->n_input);
+        free(connection->input);
+        connection->input = connection->small_input;
+        connection->input_size = CONNECTION_BUFFER_SIZE;
+    }
+    return 0;
+}
 
-    // Server loop with select() to handle non-blocking accept
-    while (1) {
-        pthread_mutex_lock(&server_state.mutex);
+#if SERVER_IO_URING
+// Ask for the data of a connection: a multishot receive completes once per arriving segment, with one of the provided buffers
+static void uring_receive(connection_t *connection) {
+    struct io_uring_sqe *sqe = io_ring_get_sqe(&server_ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->fd = connection->client_fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = server_buffers.group;
+    sqe->user_data = (u64_t)(uintptr_t)connection | URING_RECV;
+    connection->n_pending_ops++;
+}
+#endif
 
-        //Server state
-        //printf("Server State: Active Clients = %d, Total Connections = %d\n", 
-        //    server_state.active_clients, server_state.total_connections);
+// Set up the state of a new connection and start receiving its data
+static int add_connection(int epoll_fd, int client_fd) {
+    struct epoll_event event;
+    connection_t *connection = calloc(1, sizeof(connection_t));
 
-        // Exit condition: No active clients and either connections occurred or limit reached
-        if ((server_state.active_clients == 0 && server_state.total_connections > 0) ||
-            server_state.total_connections >= MAX_TOTAL_CONNECTIONS) {
-            pthread_mutex_unlock(&server_state.mutex);
-            printf("All clients disconnected. Server is shutting down.\n");
-            break;
+    if (connection == NULL) {
+        fprintf(stderr, "add_connection: out of memory\n");
+        close(client_fd);
+        return -1;
+    }
+    connection->client_fd = client_fd;
+    connection->client_id = ++total_connections;
+    connection->input = connection->small_input;
+    connection->input_size = CONNECTION_BUFFER_SIZE;
+    connection->leases = connection->small_leases;
+    connection->max_leases = MAX_CLIENT_LEASES;
+#if SERVER_IO_URING
+    if (server_ring.fd >= 0)
+        uring_receive(connection);
+    else
+#endif
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = connection;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+            perror("Failed to register connection");
+            close(client_fd);
+            free(connection);
+            return -1;
         }
+    }
+    active_clients++;
+    connection->connect_ns = probe_time_ns();
+    DETI_PROBE3(server_accept, connection->client_id, client_fd, active_clients);
+    connection->next = connections;
+    if (connections != NULL)
+        connections->prev = connection;
+    connections = connection;
+    return 0;
+}
 
-        // Accept a maximum of simultaneously clients
-        if (server_state.active_clients >= MAX_CLIENTS) {
-            pthread_mutex_unlock(&server_state.mutex);
-            //printf("Maximum number of active clients reached.\n");
+static void accept_clients(int epoll_fd, int server_fd) {
+    struct sockaddr_in client_addr;
 
-            // Sleep or use a select timeout to avoid busy waiting
-            struct timeval timeout = {5, 0}; // 5 seconds
-            select(0, NULL, NULL, NULL, &timeout);
-            
-            // Continue to the next iteration to recheck server state
-            continue;
+    for (;;) {
+        socklen_t addr_len = sizeof(client_addr);
+        int client_fd = accept4(server_fd, (struct sockaddr *)&client_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                perror("Failed to accept connection");
+            return;
         }
+        (void)add_connection(epoll_fd, client_fd);
+    }
+}
 
-        pthread_mutex_unlock(&server_state.mutex);
+//
+// statistics: per-connection memory, resident memory and the cpu time of the event loop
+//
 
-        // Use select to avoid blocking the server
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(server_fd, &read_fds);
+static void print_server_state(void) {
+    struct rusage usage;
+    long pages = 0, resident = 0;
+    FILE *fp;
 
-        struct timeval timeout = {5, 0}; // Timeout of 1 second
-        int activity = select(server_fd + 1, &read_fds, NULL, NULL, &timeout);
+    if ((fp = fopen("/proc/self/statm", "r")) != NULL) {
+        if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(fp);
+    }
+    getrusage(RUSAGE_THREAD, &usage);
+    printf("Server State: Active Clients = %u, Total Connections = %u, Coins = %u (%u accepted, %u rejected, %lu duplicates), Next Index = %lu, "
+           "Reissued Leases = %lu, Connection Size = %zu bytes, Resident Memory = %ld KiB, Event Loop CPU = %.3fs user + %.3fs system\n",
+           active_clients, total_connections, total_coins, total_accepted_coins, total_rejected_coins,
+           __atomic_load_n(&verify_pool.n_duplicates, __ATOMIC_RELAXED), next_index, n_reissued_leases,
+           sizeof(connection_t),
+           resident * (sysconf(_SC_PAGESIZE) / 1024),
+           (double)usage.ru_utime.tv_sec + 1.0e-6 * (double)usage.ru_utime.tv_usec,
+           (double)usage.ru_stime.tv_sec + 1.0e-6 * (double)usage.ru_stime.tv_usec);
+    fflush(stdout);
+}
 
-        if (activity < 0) {
-            perror("Select error");
+static void raise_open_files_limit(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Periodic work of the event loop (once per second or so)
+static void server_housekeeping(time_t *last_expiry, time_t *last_stats) {
+    if (time(NULL) != *last_expiry) {
+        expire_leases();
+        *last_expiry = time(NULL);
+    }
+    if (time(NULL) - *last_stats >= SERVER_STATS_PERIOD) {
+        print_server_state();
+        *last_stats = time(NULL);
+    }
+}
+
+static int server_epoll_start(int server_fd, int verify_fd) {
+    struct epoll_event event;
+    int epoll_fd;
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // NULL marks the listening socket
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event) < 0) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = &verify_pool; // marks the eventfd of the verification pool
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, verify_fd, &event) < 0) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+    return epoll_fd;
+}
+
+static void server_epoll_loop(int epoll_fd, int server_fd) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    time_t last_stats, last_expiry;
+
+    last_expiry = last_stats = time(NULL);
+    while (stop_request == 0) {
+        int n_events = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, 1000);
+        if (n_events < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait error");
             break;
         }
+        for (int i = 0; i < n_events; i++) {
+            connection_t *connection = events[i].data.ptr;
 
-        // If there's an incoming connection, accept it
-        if (FD_ISSET(server_fd, &read_fds)) {
-            socklen_t addr_len = sizeof(client_addr);
-            int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &addr_len);
-            if (client_fd < 0) {
-                perror("Failed to accept connection");
+            if (connection == NULL) {
+                accept_clients(epoll_fd, server_fd);
                 continue;
             }
-
-            pthread_mutex_lock(&server_state.mutex);
-
-            if (server_state.total_connections >= MAX_TOTAL_CONNECTIONS) {
-                printf("Server has reached its maximum connection limit.\n");
-                close(client_fd);
-                pthread_mutex_unlock(&server_state.mutex);
+            if (events[i].data.ptr == (void *)&verify_pool) {
+                collect_verification_results(epoll_fd);
                 continue;
             }
+            if (events[i].events & EPOLLOUT) {
+                acknowledge_coins(connection); // an ack may be waiting for room
+                if (flush_connection(epoll_fd, connection) < 0) {
+                    close_connection(epoll_fd, connection);
+                    continue;
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ssize_t bytes_received = recv(connection->client_fd, &connection->input[connection->n_input],
+                                              connection->input_size - connection->n_input, 0);
+                if (bytes_received < 0 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                if (bytes_received <= 0) {
+                    close_connection(epoll_fd, connection); // Client disconnected
+                    continue;
+                }
+                connection->n_input += (u32_t)bytes_received;
+                if (process_client_messages(connection) < 0) {
+                    close_connection(epoll_fd, connection);
+                    continue;
+                }
+                acknowledge_coins(connection); // coins of an unknown template, or outside the leases, are rejected right away
+                if (flush_connection(epoll_fd, connection) < 0)
+                    close_connection(epoll_fd, connection);
+            }
+        }
+        server_housekeeping(&last_expiry, &last_stats);
+    }
+}
+
+#if SERVER_IO_URING
+// Copy received data into the input buffer of a connection, consuming the complete frames as it fills up (returns -1
+// if the connection must be closed)
+static int receive_client_data(connection_t *connection, const u08_t *data, u32_t n) {
+    while (n > 0) {
+        u32_t room = connection->input_size - connection->n_input;
+        u32_t chunk = (n < room) ? n : room;
+        memcpy(&connection->input[connection->n_input], data, chunk);
+        connection->n_input += chunk;
+        data += chunk;
+        n -= chunk;
+        if (process_client_messages(connection) < 0)
+            return -1;
+    }
+    return 0;
+}
 
-            // Create a new thread to handle the client
-            client_data_t *client_data = malloc(sizeof(client_data_t));
-            client_data->client_fd = client_fd;
-            client_data->client_addr = client_addr;
-
-            if (pthread_create(&threads[thread_count], NULL, handle_client, client_data) != 0) {
-                perror("Failed to create thread");
-                close(client_fd);
-                free(client_data);
-            } else {
-                server_state.active_clients++;
-                server_state.total_connections++;
-                thread_count++;
+static void uring_accept(int server_fd) {
+    struct io_uring_sqe *sqe = io_ring_get_sqe(&server_ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->fd = server_fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT;
+}
+
+static void uring_poll_verify_pool(int verify_fd) {
+    struct io_uring_sqe *sqe = io_ring_get_sqe(&server_ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = verify_fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_VERIFY;
+}
+
+// Wake up the event loop after a while, even when nothing happens
+static void uring_timeout(struct __kernel_timespec *period) {
+    struct io_uring_sqe *sqe = io_ring_get_sqe(&server_ring);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (u64_t)(uintptr_t)period;
+    sqe->len = 1;
+    sqe->user_data = URING_TIMEOUT;
+}
+
+// Create the ring and its provided buffers (returns -1, with the ring destroyed, if io_uring cannot be used)
+static int server_uring_start(void) {
+    if (io_ring_setup(&server_ring, SERVER_URING_ENTRIES, 16u * SERVER_URING_ENTRIES) < 0)
+        return -1;
+    if (io_buffers_setup(&server_ring, &server_buffers, 0, SERVER_URING_BUFFERS, SERVER_URING_BUFFER_SIZE) < 0) {
+        io_ring_exit(&server_ring);
+        return -1;
+    }
+    return 0;
+}
+
+static void uring_receive_completed(connection_t *connection, int res, u32_t flags) {
+    if (flags & IORING_CQE_F_BUFFER) {
+        u32_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && connection->client_fd >= 0) {
+            if (receive_client_data(connection, &server_buffers.buffers[(size_t)bid * SERVER_URING_BUFFER_SIZE], (u32_t)res) < 0)
+                close_connection(-1, connection);
+            else {
+                acknowledge_coins(connection); // coins of an unknown template, or outside the leases, are rejected right away
+                (void)flush_connection(-1, connection);
             }
+        }
+        io_buffers_recycle(&server_buffers, bid);
+    }
+    if (flags & IORING_CQE_F_MORE)
+        return;
+    // the multishot receive has ended: restart it, unless the client is gone (the ended one is counted until the
+    // end, so that close_connection() does not free the connection)
+    if (connection->client_fd >= 0) {
+        if (res > 0 || res == -ENOBUFS)
+            uring_receive(connection);
+        else
+            close_connection(-1, connection); // Client disconnected
+    }
+    connection->n_pending_ops--;
+    release_connection(connection);
+}
+
+static void uring_send_completed(connection_t *connection, int res) {
+    connection->n_sending = 0;
+    if (connection->client_fd >= 0) {
+        if (res <= 0)
+            close_connection(-1, connection);
+        else {
+            memmove(connection->output, &connection->output[res], connection->n_output - (u32_t)res);
+            connection->n_output -= (u32_t)res;
+            acknowledge_coins(connection); // an ack may be waiting for room
+            (void)flush_connection(-1, connection);
+        }
+    }
+    connection->n_pending_ops--;
+    release_connection(connection);
+}
 
-            pthread_mutex_unlock(&server_state.mutex);
+static void server_uring_loop(int server_fd, int verify_fd) {
+    struct __kernel_timespec period = { .tv_sec = 1, .tv_nsec = 0 };
+    struct io_uring_cqe *cqe;
+    time_t last_stats, last_expiry;
+
+    uring_accept(server_fd);
+    uring_poll_verify_pool(verify_fd);
+    uring_timeout(&period);
+    last_expiry = last_stats = time(NULL);
+    while (stop_request == 0) {
+        if (io_ring_submit(&server_ring, 1) < 0 && errno != EINTR) {
+            perror("io_uring_enter error");
+            break;
+        }
+        while ((cqe = io_ring_peek_cqe(&server_ring)) != NULL) {
+            u64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            u32_t flags = cqe->flags;
+            connection_t *connection = (connection_t *)(uintptr_t)(user_data & ~URING_OP_MASK);
+
+            io_ring_cqe_seen(&server_ring);
+            switch (user_data & URING_OP_MASK) {
+                case URING_RECV:
+                    uring_receive_completed(connection, res, flags);
+                    break;
+                case URING_SEND:
+                    uring_send_completed(connection, res);
+                    break;
+                case URING_ACCEPT:
+                    if (res >= 0)
+                        (void)add_connection(-1, res);
+                    else if (res != -EAGAIN && res != -EINTR)
+                        fprintf(stderr, "Failed to accept connection: %s\n", strerror(-res));
+                    if (!(flags & IORING_CQE_F_MORE))
+                        uring_accept(server_fd);
+                    break;
+                case URING_VERIFY:
+                    collect_verification_results(-1);
+                    if (!(flags & IORING_CQE_F_MORE))
+                        uring_poll_verify_pool(verify_fd);
+                    break;
+                case URING_TIMEOUT:
+                    uring_timeout(&period);
+                    break;
+                default: // URING_CANCEL
+                    break;
+            }
         }
+        server_housekeeping(&last_expiry, &last_stats);
+    }
+}
+#endif
+
+// backend is "epoll" or "io_uring" (NULL: io_uring if the kernel supports it); with scratch the accepted coins go to
+// a scratch vault and journal, never to DETI_COINS_VAULT_FILE
+int server(u32_t server_port, const char *backend, int scratch) {
+    int server_fd, epoll_fd = -1, one = 1;
+    struct sockaddr_in server_addr;
+    int verify_fd;
+
+    // The server is a long-lived service: ignore the search time, stop on SIGINT or SIGTERM
+    (void)alarm(0u);
+    (void)signal(SIGINT, alarm_signal_handler);
+    (void)signal(SIGTERM, alarm_signal_handler);
+    (void)signal(SIGPIPE, SIG_IGN);
+    raise_open_files_limit();
+
+    // Create and set up the server socket
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    (void)setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(server_port);
+
+    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Socket binding failed");
+        close(server_fd);
+        exit(EXIT_FAILURE);
     }
 
-    // Wait for all threads to finish
-    for (int i = 0; i < thread_count; i++) {
-        pthread_join(threads[i], NULL);
+    if (listen(server_fd, MAX_PENDING_CONNECTIONS) < 0) {
+        perror("Listening failed");
+        close(server_fd);
+        exit(EXIT_FAILURE);
     }
 
-    STORE_DETI_COINS();
+    // Pick the event loop backend
+    if (backend != NULL && strcmp(backend, "epoll") != 0 && strcmp(backend, "io_uring") != 0) {
+        fprintf(stderr, "server: unknown backend \"%s\" (epoll or io_uring)\n", backend);
+        exit(EXIT_FAILURE);
+    }
+#if SERVER_IO_URING
+    if ((backend == NULL || strcmp(backend, "io_uring") == 0) && server_uring_start() < 0)
+        fprintf(stderr, "server: io_uring is not available (%s), using epoll\n", strerror(errno));
+#else
+    if (backend != NULL && strcmp(backend, "io_uring") == 0)
+        fprintf(stderr, "server: compiled without io_uring support, using epoll\n");
+#endif
+
+    if (scratch) {
+        deti_coins_vault_file = SERVER_SCRATCH_VAULT_FILE;
+        journal_file = SERVER_SCRATCH_JOURNAL_FILE;
+        (void)unlink(SERVER_SCRATCH_VAULT_FILE);
+        (void)unlink(SERVER_SCRATCH_JOURNAL_FILE);
+        printf("Server: accepted coins go to \"" SERVER_SCRATCH_VAULT_FILE "\" (scratch), not to \"" DETI_COINS_VAULT_FILE "\"\n");
+    }
+    verify_fd = verify_pool_start();
+#if SERVER_IO_URING
+    if (server_ring.fd < 0)
+#endif
+        epoll_fd = server_epoll_start(server_fd, verify_fd);
+
+    printf("Server is listening on port %d (%s)...\n", server_port, (epoll_fd < 0) ? "io_uring" : "epoll");
+    fflush(stdout);
+
+    server_init_keyspace();
+
+    // Event loop
+#if SERVER_IO_URING
+    if (server_ring.fd >= 0)
+        server_uring_loop(server_fd, verify_fd);
+    else
+#endif
+        server_epoll_loop(epoll_fd, server_fd);
+    printf("Server is shutting down.\n");
+
+    // Verify and store the queued DETI coins
+    verify_pool_stop();
+    collect_verification_results(epoll_fd);
+    print_server_state();
 
     // Print final aggregated results
     printf("Server - deti_coins_cpu_avx_search: Found %u DETI coin%s in %lu attempt%s (expected %.2f coins)\n",
@@ -245,8 +986,18 @@ int server(u32_t server_port) {
            total_attempts, (total_attempts == 1) ? "" : "s",
            (double)total_attempts / (double)(1ul << 32));
 
+#if SERVER_IO_URING
+    if (server_ring.fd >= 0) {
+        (void)io_ring_submit(&server_ring, 0); // the last acks
+        io_ring_exit(&server_ring);
+    }
+#endif
+    if (epoll_fd >= 0) {
+        flush_connections_on_exit(epoll_fd); // the last acks
+        close(epoll_fd);
+    }
     close(server_fd);
     return 0;
 }
 
-#endif
\ No newline at end of file
+#endif
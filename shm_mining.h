@@ -0,0 +1,439 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// shm_coordinator() --- owner of a shared-memory search (one template, the vault)
+// shm_worker() -------- miner process attached to the segment of a shm_coordinator()
+//
+// for several miner processes on one host (for example one per NUMA node) the client/server pair is pointless
+// overhead; instead, the coordinator creates a POSIX shared-memory segment (SHM_DEFAULT_NAME, see shm_open(3)) with
+//   the template of the session and a keyspace cursor (the next chunk of KEYSPACE_CHUNK_SIZE candidates), which
+//     the worker threads advance with an atomic fetch-and-add, so chunks are handed out without any lock,
+//   one slot of counters per worker process, each one on its own cache line,
+//   a lock-free multi-producer single-consumer ring of hits (candidate indices), written by the worker threads and
+//     drained by the coordinator, which rebuilds, verifies and saves the coins (it is the only writer of the vault)
+// there are no sockets and no serialization on the hit path; a worker that dies loses only the chunks it was searching
+// (the keyspace of a template is far larger than what can be searched) and, should it die between claiming a slot of
+// the ring and filling it, the hits after that slot; when the coordinator stops it tells the workers to stop and
+// removes the segment (a new coordinator starts a new template)
+//
+// the worker uses the MD5 engine and the number of threads of client_search() (see client_avx.h); run it with taskset or
+// numactl to confine it to a NUMA node
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <omp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "search_utilities.h"
+#include "deti_coins_keyspace.h"
+#include "client_avx.h"
+#include "telemetry.h"
+
+#ifndef SHM_MINING
+#define SHM_MINING
+
+#define SHM_DEFAULT_NAME "/deti_coins" // Name of the segment (in /dev/shm)
+#define SHM_MAGIC 0x4d485344u // "DSHM", stored last by the coordinator
+#define SHM_VERSION 1u
+#define SHM_MAX_WORKERS 64 // Worker processes attached at the same time
+#define SHM_HIT_RING_SIZE 1024u // Hits waiting for the coordinator (a power of two)
+#define SHM_WORKER_OVERFLOW 64u // Hits a worker thread keeps while the ring is full
+#define SHM_POLL_PERIOD 10 // Milliseconds between two passes of the coordinator over the ring
+#define SHM_STATS_PERIOD 60 // Seconds between two coordinator statistics reports
+#define SHM_STOP_TIMEOUT 5 // Seconds the coordinator waits for the workers to stop
+
+// Counters of one worker process (each one on its own cache line)
+typedef struct {
+    u32_t pid; // 0 means that the slot is free
+    u32_t n_threads;
+    u64_t n_attempts;
+    u64_t n_coins;
+} __attribute__((aligned(64))) shm_worker_t;
+
+// A slot of the hit ring: sequence says whether it holds a hit (sequence == position + 1) or is free for the producer
+// of that position (sequence == position)
+typedef struct {
+    u64_t sequence;
+    u64_t index;
+    u32_t worker;
+} shm_hit_t;
+
+typedef struct {
+    u32_t magic;
+    u32_t version;
+    u32_t stop; // set by the coordinator when the search ends
+    u32_t template_id;
+    u32_t template[13];
+    u64_t next_chunk __attribute__((aligned(64))); // keyspace cursor, in chunks
+    u64_t hit_head __attribute__((aligned(64)));   // positions claimed by the producers
+    u64_t hit_tail __attribute__((aligned(64)));   // positions consumed (written only by the coordinator)
+    shm_worker_t workers[SHM_MAX_WORKERS];
+    shm_hit_t hits[SHM_HIT_RING_SIZE] __attribute__((aligned(64)));
+} shm_segment_t;
+
+//
+// hit ring
+//
+
+// Producer side (any worker thread): returns -1 if the ring is full
+static int shm_push_hit(shm_segment_t *segment, u32_t worker, u64_t index) {
+    u64_t position = __atomic_load_n(&segment->hit_head, __ATOMIC_RELAXED);
+    shm_hit_t *slot;
+
+    for (;;) {
+        slot = &segment->hits[position % SHM_HIT_RING_SIZE];
+        u64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence == position) {
+            if (__atomic_compare_exchange_n(&segment->hit_head, &position, position + 1u, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (sequence < position)
+            return -1; // not yet consumed
+        else
+            position = __atomic_load_n(&segment->hit_head, __ATOMIC_RELAXED);
+    }
+    slot->index = index;
+    slot->worker = worker;
+    __atomic_store_n(&slot->sequence, position + 1u, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Consumer side (the coordinator): returns -1 if there is no hit
+static int shm_pop_hit(shm_segment_t *segment, u32_t *worker, u64_t *index) {
+    u64_t position = segment->hit_tail;
+    shm_hit_t *slot = &segment->hits[position % SHM_HIT_RING_SIZE];
+
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1u)
+        return -1;
+    *index = slot->index;
+    *worker = slot->worker;
+    __atomic_store_n(&slot->sequence, position + SHM_HIT_RING_SIZE, __ATOMIC_RELEASE);
+    segment->hit_tail = position + 1u;
+    return 0;
+}
+
+//
+// coordinator
+//
+
+// Rebuild, verify and save the coins of the ring (returns the number of hits taken)
+static u32_t shm_collect_hits(shm_segment_t *segment, u32_t *n_accepted, u32_t *n_rejected) {
+    u32_t coin[13], hash[4], power, worker, n_hits = 0u;
+    u64_t index;
+
+    while (shm_pop_hit(segment, &worker, &index) == 0) {
+        n_hits++;
+        power = 0u;
+        if (index < KEYSPACE_SIZE) {
+            keyspace_make_coin(segment->template, index, coin);
+            md5_cpu(coin, hash);
+            hash_byte_reverse(hash);
+            power = deti_coin_power(hash);
+        }
+        if (power >= 32u && deti_coin_format_is_good(coin)) {
+            save_checked_deti_coin(coin, power);
+            (*n_accepted)++;
+        } else {
+            fprintf(stderr, "shm_coordinator: worker %u reported a bad coin (candidate %lu)\n", worker, index);
+            (*n_rejected)++;
+        }
+    }
+    return n_hits;
+}
+
+// Report the workers and free the slots of those that died
+static void shm_print_state(shm_segment_t *segment, u32_t n_accepted, u32_t n_rejected) {
+    u64_t n_attempts = 0u;
+    u32_t n_workers = 0u;
+
+    for (u32_t i = 0u; i < SHM_MAX_WORKERS; i++) {
+        shm_worker_t *w = &segment->workers[i];
+        u32_t pid = __atomic_load_n(&w->pid, __ATOMIC_ACQUIRE);
+        n_attempts += __atomic_load_n(&w->n_attempts, __ATOMIC_RELAXED);
+        if (pid == 0u)
+            continue;
+        if (kill((pid_t)pid, 0) < 0 && errno == ESRCH) {
+            printf("Worker %u (pid %u) died after %lu attempts\n", i, pid, w->n_attempts);
+            __atomic_store_n(&w->pid, 0u, __ATOMIC_RELEASE);
+            continue;
+        }
+        n_workers++;
+        printf("Worker %u (pid %u): %u threads, %lu attempts, %lu coins\n", i, pid, w->n_threads, w->n_attempts, w->n_coins);
+    }
+    printf("Coordinator State: Workers = %u, Attempts = %lu, Coins = %u (%u rejected), Next Chunk = %lu\n", n_workers, n_attempts,
+           n_accepted, n_rejected, __atomic_load_n(&segment->next_chunk, __ATOMIC_RELAXED));
+    fflush(stdout);
+}
+
+// Number of live workers attached to an existing segment that a coordinator has set up (0 if there is none)
+static u32_t shm_live_workers(const char *name) {
+    shm_segment_t *segment;
+    struct stat st;
+    u32_t n_alive = 0u;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+        return 0u;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(shm_segment_t)) {
+        close(fd);
+        return 0u; // another version, or a coordinator that did not get to ftruncate()
+    }
+    segment = mmap(NULL, sizeof(shm_segment_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED)
+        return 0u;
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC)
+        for (u32_t i = 0u; i < SHM_MAX_WORKERS; i++) {
+            u32_t pid = __atomic_load_n(&segment->workers[i].pid, __ATOMIC_ACQUIRE);
+            if (pid != 0u && !(kill((pid_t)pid, 0) < 0 && errno == ESRCH))
+                n_alive++;
+        }
+    munmap(segment, sizeof(shm_segment_t));
+    return n_alive;
+}
+
+void shm_coordinator(const char *name, int force) {
+    const char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    shm_segment_t *segment;
+    coin_t coin;
+    u32_t n_accepted = 0u, n_rejected = 0u, n_live;
+    u64_t n_attempts = 0u;
+    time_t last_stats, deadline;
+    int fd;
+
+    // Stop on SIGINT or SIGTERM (as well as at the end of the search time)
+    (void)signal(SIGINT, alarm_signal_handler);
+    (void)signal(SIGTERM, alarm_signal_handler);
+
+    // A segment left behind by a crashed coordinator is replaced (its workers keep the old one and find it stopped), but
+    // one with live workers may belong to a running coordinator, so it is only replaced when forced
+    if ((n_live = shm_live_workers(name)) > 0u && !force) {
+        fprintf(stderr, "shm_coordinator: segment \"%s\" is in use by %u live worker%s; stop them (or use another segment), or force its replacement\n",
+                name, n_live, (n_live == 1u) ? "" : "s");
+        exit(1);
+    }
+    (void)shm_unlink(name);
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        perror("shm_coordinator: shm_open");
+        exit(1);
+    }
+    if (ftruncate(fd, sizeof(shm_segment_t)) != 0) {
+        perror("shm_coordinator: ftruncate");
+        exit(1);
+    }
+    segment = mmap(NULL, sizeof(shm_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        perror("shm_coordinator: mmap");
+        exit(1);
+    }
+
+    // The template of this session (the random tag keeps sessions from searching the same candidates)
+    initialize_deti_coin(&coin);
+    for (u32_t i = 0; i < KEYSPACE_TAG_LENGTH; i++)
+        coin.coin_as_chars[10u + i] = charset[random() % (sizeof(charset) - 1)];
+    memcpy(segment->template, coin.coin_as_ints, sizeof(segment->template));
+    segment->template_id = (u32_t)random();
+    segment->version = SHM_VERSION;
+    for (u32_t i = 0u; i < SHM_HIT_RING_SIZE; i++)
+        segment->hits[i].sequence = i;
+    __atomic_store_n(&segment->magic, SHM_MAGIC, __ATOMIC_RELEASE); // the workers may attach from now on
+    printf("Coordinator: segment \"%s\" (%zu bytes), template %08x: %.52s", name, sizeof(shm_segment_t), segment->template_id,
+           coin.coin_as_chars);
+    fflush(stdout);
+
+    last_stats = time(NULL);
+    while (stop_request == 0) {
+        if (shm_collect_hits(segment, &n_accepted, &n_rejected) == 0u)
+            usleep(1000 * SHM_POLL_PERIOD);
+        if (time(NULL) - last_stats >= SHM_STATS_PERIOD) {
+            shm_print_state(segment, n_accepted, n_rejected);
+            save_checked_deti_coin(NULL, 0u); // update the vault from time to time
+            last_stats = time(NULL);
+        }
+    }
+
+    // Tell the workers to stop and wait for them to detach, then take their last hits
+    __atomic_store_n(&segment->stop, 1u, __ATOMIC_RELEASE);
+    deadline = time(NULL) + SHM_STOP_TIMEOUT;
+    for (;;) {
+        u32_t n_attached = 0u;
+        for (u32_t i = 0u; i < SHM_MAX_WORKERS; i++) {
+            u32_t pid = __atomic_load_n(&segment->workers[i].pid, __ATOMIC_ACQUIRE);
+            if (pid != 0u && !(kill((pid_t)pid, 0) < 0 && errno == ESRCH))
+                n_attached++;
+        }
+        (void)shm_collect_hits(segment, &n_accepted, &n_rejected);
+        if (n_attached == 0u || time(NULL) >= deadline)
+            break;
+        usleep(1000 * SHM_POLL_PERIOD);
+    }
+    (void)shm_collect_hits(segment, &n_accepted, &n_rejected);
+    STORE_DETI_COINS();
+    shm_print_state(segment, n_accepted, n_rejected);
+    for (u32_t i = 0u; i < SHM_MAX_WORKERS; i++)
+        n_attempts += segment->workers[i].n_attempts;
+
+    printf("Coordinator: Found %u DETI coin%s in %lu attempt%s (expected %.2f coins)\n",
+           n_accepted, (n_accepted == 1) ? "" : "s",
+           n_attempts, (n_attempts == 1) ? "" : "s",
+           (double)n_attempts / (double)(1ul << 32));
+    munmap(segment, sizeof(shm_segment_t));
+    (void)shm_unlink(name);
+}
+
+//
+// worker
+//
+
+// Search count candidates of the template starting at candidate first (count is a multiple of the number of lanes);
+// the hits that do not fit in the ring are kept in overflow[]
+static u32_t shm_search_slice(shm_segment_t *segment, const client_engine_t *engine, u32_t worker, u64_t first, u64_t count,
+                              u64_t *overflow, u32_t *n_overflow) {
+    u32_t interleaved_data[13u * MAX_CLIENT_LANES] __attribute__((aligned(64)));
+    u32_t interleaved_hash[ 4u * MAX_CLIENT_LANES] __attribute__((aligned(64)));
+    u32_t n_lanes = engine->n_lanes, lane, idx, n_coins = 0u;
+    u32_t var1 = keyspace_word(first % KEYSPACE_WORD_SIZE);
+    u32_t var2 = keyspace_word(first / KEYSPACE_WORD_SIZE);
+
+    for (lane = 0u; lane < n_lanes; lane++)
+        for (idx = 0u; idx < 13u; idx++)
+            interleaved_data[n_lanes * idx + lane] = segment->template[idx];
+    for (u64_t batch = 0u; batch < count / n_lanes; batch++) {
+        // lane k of a batch gets the k-th next candidate
+        for (lane = 0u; lane < n_lanes; lane++) {
+            interleaved_data[n_lanes * KEYSPACE_VAR1_WORD + lane] = var1;
+            interleaved_data[n_lanes * KEYSPACE_VAR2_WORD + lane] = var2;
+            var1 = next_ascii_code(var1);
+            if (var1 == 0x20202020) {
+                var2 = next_ascii_code(var2);
+            }
+        }
+
+        engine->md5(interleaved_data, interleaved_hash);
+        cross_check_batch((u32_t)omp_get_thread_num(), n_lanes, interleaved_data, interleaved_hash); // sampled check against md5_cpu()
+
+        // Check hashes for trailing zeros
+        for (lane = 0u; lane < n_lanes; lane++) {
+            if ((interleaved_hash[n_lanes * 3u + lane] & telemetry_near_miss_mask) == 0u) { // a near miss (all hits are near misses)
+                telemetry_near_miss((u32_t)omp_get_thread_num());
+                if ((interleaved_hash[n_lanes * 3u + lane] & deti_coin_hit_mask) == 0u) {
+                    u64_t index = first + batch * n_lanes + lane;
+                    DETI_PROBE4(hit, (u32_t)omp_get_thread_num(), lane, telemetry.mode, index);
+                    n_coins++;
+                    if (*n_overflow == 0u && shm_push_hit(segment, worker, index) == 0)
+                        continue;
+                    if (*n_overflow < SHM_WORKER_OVERFLOW)
+                        overflow[(*n_overflow)++] = index;
+                    else
+                        fprintf(stderr, "shm_worker: the coordinator cannot keep up, candidate %lu dropped\n", index);
+                }
+            }
+        }
+    }
+    return n_coins;
+}
+
+void shm_worker(const char *name, u32_t search_time) {
+    const client_engine_t *engine = client_select_engine();
+    shm_segment_t *segment;
+    shm_worker_t *slot = NULL;
+    struct stat st;
+    u32_t worker = 0u, n_threads, total_n_coins = 0u;
+    u64_t total_n_attempts = 0u;
+    time_t start_time = time(NULL);
+    int fd;
+
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+        fprintf(stderr, "shm_worker: no segment \"%s\" (%s); start the coordinator first\n", name, strerror(errno));
+        exit(1);
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(shm_segment_t)) {
+        fprintf(stderr, "shm_worker: segment \"%s\" has the wrong size (another version?)\n", name);
+        exit(1);
+    }
+    segment = mmap(NULL, sizeof(shm_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        perror("shm_worker: mmap");
+        exit(1);
+    }
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || segment->version != SHM_VERSION) {
+        fprintf(stderr, "shm_worker: segment \"%s\" is not ready or has another version\n", name);
+        exit(1);
+    }
+
+    // Take a free slot of counters
+    for (; worker < SHM_MAX_WORKERS && slot == NULL; worker++) {
+        u32_t expected = 0u;
+        if (__atomic_compare_exchange_n(&segment->workers[worker].pid, &expected, (u32_t)getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            slot = &segment->workers[worker];
+    }
+    if (slot == NULL) {
+        fprintf(stderr, "shm_worker: segment \"%s\" already has %d workers\n", name, SHM_MAX_WORKERS);
+        exit(1);
+    }
+    worker--;
+    n_threads = usable_cpu_count();
+    if (n_threads > MAX_CLIENT_THREADS)
+        n_threads = MAX_CLIENT_THREADS;
+    slot->n_threads = n_threads; // the counters of a slot add up all the workers that have used it
+    printf("Worker %u of \"%s\": %u threads using md5_cpu_%s() (%u lanes), template %08x\n", worker, name, n_threads, engine->name,
+           engine->n_lanes, segment->template_id);
+    fflush(stdout);
+
+    telemetry_start("shm_worker", n_threads);
+    #pragma omp parallel reduction(+:total_n_coins, total_n_attempts) num_threads(n_threads)
+    {
+        u64_t overflow[SHM_WORKER_OVERFLOW];
+        u32_t n_overflow = 0u, thread = (u32_t)omp_get_thread_num();
+
+        while (stop_request == 0 && !__atomic_load_n(&segment->stop, __ATOMIC_ACQUIRE) && time(NULL) - start_time < search_time) {
+            u64_t first = __atomic_fetch_add(&segment->next_chunk, 1u, __ATOMIC_RELAXED) * KEYSPACE_CHUNK_SIZE;
+            if (first >= KEYSPACE_SIZE)
+                break; // the keyspace of the template is exhausted
+
+            // Search the chunk one slice at a time; now and then check the time and the stop flag
+            for (u64_t done = 0u; done < KEYSPACE_CHUNK_SIZE; done += CLIENT_SLICE_SIZE) {
+                u32_t n_coins = shm_search_slice(segment, engine, worker, first + done, CLIENT_SLICE_SIZE, overflow, &n_overflow);
+                while (n_overflow > 0u && shm_push_hit(segment, worker, overflow[0]) == 0)
+                    memmove(overflow, &overflow[1], --n_overflow * sizeof(overflow[0]));
+                total_n_coins += n_coins;
+                total_n_attempts += CLIENT_SLICE_SIZE;
+                telemetry_count(thread, total_n_attempts, total_n_coins);
+                __atomic_fetch_add(&slot->n_attempts, CLIENT_SLICE_SIZE, __ATOMIC_RELAXED);
+                if (n_coins > 0u)
+                    __atomic_fetch_add(&slot->n_coins, n_coins, __ATOMIC_RELAXED);
+                if (stop_request != 0 || __atomic_load_n(&segment->stop, __ATOMIC_ACQUIRE) || time(NULL) - start_time >= search_time)
+                    break;
+            }
+        }
+
+        // The coordinator drains the ring until all workers have detached
+        for (int tries = 0; n_overflow > 0u && tries < 1000; tries++) {
+            if (shm_push_hit(segment, worker, overflow[0]) == 0)
+                memmove(overflow, &overflow[1], --n_overflow * sizeof(overflow[0]));
+            else
+                usleep(1000);
+        }
+        if (n_overflow > 0u)
+            fprintf(stderr, "shm_worker: %u coins could not be handed to the coordinator\n", n_overflow);
+    }
+
+    telemetry_stop();
+    __atomic_store_n(&slot->pid, 0u, __ATOMIC_RELEASE); // detach
+    printf("Worker %u - md5_cpu_%s: Found %u DETI coin%s in %lu attempt%s (expected %.2f coins)\n",
+           worker, engine->name,
+           total_n_coins, (total_n_coins == 1) ? "" : "s",
+           total_n_attempts, (total_n_attempts == 1) ? "" : "s",
+           (double)total_n_attempts / (double)(1ul << 32));
+    munmap(segment, sizeof(shm_segment_t));
+}
+
+#endif
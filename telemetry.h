@@ -0,0 +1,248 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// live telemetry of the search modes
+//
+// each search thread publishes its attempt and coin counters with telemetry_count(), two plain (relaxed) stores to a
+// cache line of its own, so the hash loop never synchronizes with anything; when DETI_TELEMETRY_PERIOD is set in the
+// environment, a monitor thread samples the counters every DETI_TELEMETRY_PERIOD seconds and appends one JSON object
+// per line to DETI_TELEMETRY_FILE (stderr when it is not set), with
+//   "t": seconds since the start, "mode": the search function, "threads": number of threads,
+//   "rates": attempts per second of each thread, "rate": their sum, "stalled": threads that did no attempt,
+//   "attempts" and "coins": totals, "expected": coins expected for the attempts made (attempts / 2^32),
+//   "vault": flushes of the vault, coins written by them and coins waiting in the buffer,
+//   "remaining": seconds left in the search, "eta": seconds to the next expected coin at the current rate,
+//   "cross_check": sampled hashes checked against md5_cpu() and mismatches (cross_check.h),
+//   "near_misses": hashes with at least "bits" trailing zero bits (DETI_NEAR_MISS_BITS, default TELEMETRY_NEAR_MISS_BITS)
+//     "observed" and "expected" for the attempts made (attempts / 2^bits), and "z", the number of standard deviations
+//     between them; coins are far too rare to tell whether the attempts reported are real, but near misses are not:
+//     with 16 bits a thread doing 10^7 attempts per second finds about 150 of them per second, so a z far from 0 (say
+//     beyond +-5) means that the attempts are not what they claim to be, or that the hit check is broken
+// the last line, written by telemetry_stop(), also has "final": true
+//
+// the monitor thread also runs the throughput watchdog (watchdog.h), which may be enabled without the telemetry lines;
+// the alarms of the cross-check of the SIMD engines (cross_check.h) also go to the telemetry stream
+//
+// telemetry_count() is also where the batch probe of probes.h fires (every DETI_PROBE_BATCH_PERIOD calls)
+//
+// telemetry_start() -------- start the monitor (does nothing when neither the telemetry nor the watchdog is enabled)
+// telemetry_count() -------- publish the counters of a thread
+// telemetry_near_miss() ---- count a near miss of a thread (called by the search loops when the hash passes the
+//                            telemetry_near_miss_mask test, which comes before, and is a superset of, the hit check)
+// telemetry_near_miss_configure() -- set telemetry_near_miss_mask (by telemetry_start() and when deti_coin_hit_mask changes)
+// telemetry_stop() --------- write the last line and stop the monitor
+//
+
+#ifndef TELEMETRY
+#define TELEMETRY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "watchdog.h"
+#include "cross_check.h"
+#include "probes.h"
+
+#define TELEMETRY_MAX_THREADS 256
+#define TELEMETRY_NEAR_MISS_BITS 16u // Default of DETI_NEAR_MISS_BITS
+
+// Counters of one search thread, each one on its own cache line
+typedef struct {
+    u64_t n_attempts;
+    u64_t n_coins;
+    u32_t tid; // thread id, for the watchdog
+    u64_t n_calls;  // calls of telemetry_count() (for the batch probe)
+    u64_t probe_ns; // time of the last batch probe
+    u64_t n_near_misses;
+} __attribute__((aligned(64))) telemetry_counter_t;
+
+static telemetry_counter_t telemetry_counters[TELEMETRY_MAX_THREADS];
+static time_t telemetry_end_time; // end of the search (set by main())
+
+// bits of the last word of the MD5 hash (as computed) that must be zero for a near miss; it never has more bits than
+// deti_coin_hit_mask, so all hits are near misses
+static u32_t telemetry_near_miss_mask = 0xFFFF0000u;
+static u32_t telemetry_near_miss_bits = TELEMETRY_NEAR_MISS_BITS;
+
+static struct {
+    int running;
+    int stop;
+    int report; // write the telemetry lines (otherwise only the watchdog runs)
+    const char *mode;
+    u32_t n_threads;
+    u32_t period;
+    FILE *fp;
+    struct timespec start;
+    double last_time;
+    u64_t last_attempts[TELEMETRY_MAX_THREADS];
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake_up;
+} telemetry = { .mutex = PTHREAD_MUTEX_INITIALIZER, .wake_up = PTHREAD_COND_INITIALIZER };
+
+#if DETI_PROBES
+static void __attribute__((noinline, cold)) telemetry_probe_batch(u32_t thread, u64_t n_attempts, u64_t n_coins) {
+    u64_t now_ns = probe_time_ns(), last_ns = telemetry_counters[thread].probe_ns;
+
+    telemetry_counters[thread].probe_ns = now_ns;
+    DETI_PROBE6(batch, thread, telemetry_counters[thread].tid, telemetry.mode, n_attempts, n_coins, (last_ns == 0u) ? 0u : now_ns - last_ns);
+}
+#endif
+
+static inline void telemetry_count(u32_t thread, u64_t n_attempts, u64_t n_coins) {
+    if (thread < TELEMETRY_MAX_THREADS) {
+        if (__builtin_expect(telemetry_counters[thread].tid == 0u, 0))
+            telemetry_counters[thread].tid = (u32_t)syscall(SYS_gettid);
+        __atomic_store_n(&telemetry_counters[thread].n_attempts, n_attempts, __ATOMIC_RELAXED);
+        __atomic_store_n(&telemetry_counters[thread].n_coins, n_coins, __ATOMIC_RELAXED);
+#if DETI_PROBES
+        if ((++telemetry_counters[thread].n_calls & (DETI_PROBE_BATCH_PERIOD - 1u)) == 0u)
+            telemetry_probe_batch(thread, n_attempts, n_coins);
+#endif
+    }
+}
+
+static inline void telemetry_near_miss(u32_t thread) {
+    if (thread < TELEMETRY_MAX_THREADS)
+        __atomic_store_n(&telemetry_counters[thread].n_near_misses, telemetry_counters[thread].n_near_misses + 1u, __ATOMIC_RELAXED);
+}
+
+static void telemetry_near_miss_configure(void) {
+    const char *bits = getenv("DETI_NEAR_MISS_BITS");
+    u32_t n = (bits != NULL && atoi(bits) >= 1 && atoi(bits) <= 32) ? (u32_t)atoi(bits) : TELEMETRY_NEAR_MISS_BITS;
+
+    // the trailing zero bits of the printed digest are the high bits of the bytes of the last word (see hash_byte_reverse())
+    telemetry_near_miss_mask = ((n >= 32u) ? 0xFFFFFFFFu : __builtin_bswap32((1u << n) - 1u)) & deti_coin_hit_mask;
+    telemetry_near_miss_bits = (u32_t)__builtin_popcount(telemetry_near_miss_mask);
+}
+
+static double telemetry_sqrt(double x) { // without libm
+    double y = (x > 1.0) ? x : 1.0;
+
+    if (x <= 0.0)
+        return 0.0;
+    for (int i = 0; i < 64; i++)
+        y = 0.5 * (y + x / y);
+    return y;
+}
+
+static void telemetry_sample(int final) {
+    struct timespec now;
+    double t, dt, rate = 0.0, rates[TELEMETRY_MAX_THREADS];
+    u64_t n_attempts = 0u, n_coins = 0u, attempts[TELEMETRY_MAX_THREADS], n_checks, n_mismatches, n_near_misses = 0u;
+    double expected_near_misses;
+    u32_t tids[TELEMETRY_MAX_THREADS];
+    const char *separator = "";
+    time_t remaining;
+    u32_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    t = (double)(now.tv_sec - telemetry.start.tv_sec) + 1.0e-9 * (double)(now.tv_nsec - telemetry.start.tv_nsec);
+    dt = (t > telemetry.last_time) ? t - telemetry.last_time : 1.0e-9;
+    for (i = 0u; i < telemetry.n_threads; i++) {
+        u64_t a = attempts[i] = __atomic_load_n(&telemetry_counters[i].n_attempts, __ATOMIC_RELAXED);
+        tids[i] = __atomic_load_n(&telemetry_counters[i].tid, __ATOMIC_RELAXED);
+        rates[i] = (double)(a - telemetry.last_attempts[i]) / dt;
+        rate += rates[i];
+        n_attempts += a;
+        n_coins += __atomic_load_n(&telemetry_counters[i].n_coins, __ATOMIC_RELAXED);
+        n_near_misses += __atomic_load_n(&telemetry_counters[i].n_near_misses, __ATOMIC_RELAXED);
+        telemetry.last_attempts[i] = a;
+    }
+    telemetry.last_time = t;
+    cross_check_totals(&n_checks, &n_mismatches);
+    expected_near_misses = (double)n_attempts / (double)(1ul << telemetry_near_miss_bits);
+    remaining = telemetry_end_time - time(NULL);
+    if (!final)
+        watchdog_check(telemetry.fp, t, rates, attempts, tids, telemetry.n_threads);
+    if (!telemetry.report)
+        return;
+
+    fprintf(telemetry.fp, "{\"t\":%.3f,\"mode\":\"%s\",\"threads\":%u,\"rates\":[", t, telemetry.mode, telemetry.n_threads);
+    for (i = 0u; i < telemetry.n_threads; i++)
+        fprintf(telemetry.fp, "%s%.0f", (i == 0u) ? "" : ",", rates[i]);
+    fprintf(telemetry.fp, "],\"rate\":%.0f,\"stalled\":[", rate);
+    for (i = 0u; i < telemetry.n_threads; i++)
+        if (rates[i] == 0.0 && !final) { // all of them at the end
+            fprintf(telemetry.fp, "%s%u", separator, i);
+            separator = ",";
+        }
+    fprintf(telemetry.fp, "],\"attempts\":%lu,\"coins\":%lu,\"expected\":%.4f,\"vault\":{\"flushes\":%lu,\"written\":%lu,\"buffered\":%u},"
+            "\"remaining\":%ld,\"eta\":%.0f,\"cross_check\":{\"checks\":%lu,\"mismatches\":%lu},"
+            "\"near_misses\":{\"bits\":%u,\"observed\":%lu,\"expected\":%.1f,\"z\":%.2f}%s}\n",
+            n_attempts, n_coins, (double)n_attempts / (double)(1ul << 32),
+            deti_coins_vault_stats.n_flushes, deti_coins_vault_stats.n_written, deti_coins_vault_stats.n_buffered,
+            (remaining > 0) ? (long)remaining : 0l, (rate > 0.0) ? (double)(1ul << 32) / rate : -1.0, n_checks, n_mismatches,
+            telemetry_near_miss_bits, n_near_misses, expected_near_misses,
+            (expected_near_misses > 0.0) ? ((double)n_near_misses - expected_near_misses) / telemetry_sqrt(expected_near_misses) : 0.0, final ? ",\"final\":true" : "");
+    fflush(telemetry.fp);
+}
+
+static void *telemetry_thread(void *arg) {
+    struct timespec deadline;
+
+    (void)arg;
+    pthread_mutex_lock(&telemetry.mutex);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    while (!telemetry.stop) {
+        deadline.tv_sec += telemetry.period;
+        while (!telemetry.stop && pthread_cond_timedwait(&telemetry.wake_up, &telemetry.mutex, &deadline) != ETIMEDOUT)
+            ;
+        if (!telemetry.stop)
+            telemetry_sample(0);
+    }
+    pthread_mutex_unlock(&telemetry.mutex);
+    return NULL;
+}
+
+static void telemetry_start(const char *mode, u32_t n_threads) {
+    const char *period = getenv("DETI_TELEMETRY_PERIOD"), *file_name = getenv("DETI_TELEMETRY_FILE");
+
+    telemetry.mode = mode; // also an argument of the probes
+    telemetry.report = (period != NULL && atoi(period) > 0);
+    cross_check_configure(mode);
+    telemetry_near_miss_configure();
+    if (!watchdog_configure() && !telemetry.report)
+        return;
+    telemetry.period = telemetry.report ? (u32_t)atoi(period) : WATCHDOG_DEFAULT_PERIOD;
+    telemetry.n_threads = (n_threads < TELEMETRY_MAX_THREADS) ? n_threads : TELEMETRY_MAX_THREADS;
+    telemetry.fp = stderr;
+    if (file_name != NULL && file_name[0] != '\0' && (telemetry.fp = fopen(file_name, "a")) == NULL) {
+        perror("telemetry_start: DETI_TELEMETRY_FILE");
+        telemetry.fp = stderr;
+    }
+    cross_check.fp = telemetry.fp;
+    memset(telemetry_counters, 0, sizeof(telemetry_counters));
+    memset(telemetry.last_attempts, 0, sizeof(telemetry.last_attempts));
+    clock_gettime(CLOCK_MONOTONIC, &telemetry.start);
+    telemetry.last_time = 0.0;
+    telemetry.stop = 0;
+    if (pthread_create(&telemetry.thread, NULL, telemetry_thread, NULL) != 0) {
+        perror("telemetry_start: pthread_create");
+        return;
+    }
+    telemetry.running = 1;
+}
+
+static void telemetry_stop(void) {
+    cross_check_report();
+    if (!telemetry.running)
+        return;
+    pthread_mutex_lock(&telemetry.mutex);
+    telemetry.stop = 1;
+    pthread_cond_signal(&telemetry.wake_up);
+    pthread_mutex_unlock(&telemetry.mutex);
+    pthread_join(telemetry.thread, NULL);
+    telemetry_sample(1);
+    cross_check.fp = stderr;
+    if (telemetry.fp != stderr)
+        fclose(telemetry.fp);
+    telemetry.running = 0;
+}
+
+#endif
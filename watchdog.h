@@ -0,0 +1,216 @@
+//
+// Arquiteturas de Alto Desempenho 2024/2025
+//
+// throughput watchdog of the search modes (run by the telemetry monitor thread, see telemetry.h)
+//
+// enabled by DETI_WATCHDOG=fraction (for example 0.7); after DETI_WATCHDOG_WARMUP seconds (default 30) the rate of each
+// thread since the start becomes its baseline, and from then on, at every sample, a thread is flagged when its rate
+// drops below fraction times its baseline or times the median rate of all the threads (its peers), and the whole
+// host when the total rate drops below fraction times the total baseline; each transition (slow, stalled, recovered)
+// is logged once, as a JSON line in the telemetry stream, with the cpu the thread last ran on and what sysfs or /proc
+// says about it: current frequency, thermal throttle count, hottest thermal zone
+//
+// with DETI_WATCHDOG_ACTION=stop a flagged thread or host also ends the search (as the end of the search time does, so
+// the coins found are saved) and lets a supervisor (a shell loop, systemd) restart it; the default action only logs
+// (the client and shared-memory workers pull work chunk by chunk, so a slow thread there already takes less of it)
+//
+// watchdog_configure() ---- read the configuration from the environment (returns 1 when the watchdog is enabled)
+// watchdog_check() -------- look at one sample of the per-thread counters
+//
+
+#ifndef WATCHDOG
+#define WATCHDOG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WATCHDOG_MAX_THREADS 256
+#define WATCHDOG_DEFAULT_PERIOD 10 // Seconds between two samples when only the watchdog is enabled
+#define WATCHDOG_DEFAULT_WARMUP 30 // Seconds before the baseline is taken
+
+static struct {
+    int enabled;
+    int stop_on_event;
+    double fraction;
+    double warmup;
+    int have_baseline;
+    double total_baseline;
+    int host_slow;
+    double baseline[WATCHDOG_MAX_THREADS];
+    int state[WATCHDOG_MAX_THREADS]; // 0: fine, 1: slow, 2: stalled
+} watchdog;
+
+static int watchdog_configure(void) {
+    const char *fraction = getenv("DETI_WATCHDOG"), *warmup = getenv("DETI_WATCHDOG_WARMUP"), *action = getenv("DETI_WATCHDOG_ACTION");
+
+    memset(&watchdog, 0, sizeof(watchdog));
+    if (fraction == NULL || atof(fraction) <= 0.0 || atof(fraction) >= 1.0)
+        return 0;
+    watchdog.enabled = 1;
+    watchdog.fraction = atof(fraction);
+    watchdog.warmup = (warmup != NULL && atof(warmup) > 0.0) ? atof(warmup) : (double)WATCHDOG_DEFAULT_WARMUP;
+    if (action != NULL && strcmp(action, "stop") == 0)
+        watchdog.stop_on_event = 1;
+    else if (action != NULL && strcmp(action, "log") != 0)
+        fprintf(stderr, "watchdog: unknown DETI_WATCHDOG_ACTION \"%s\" (log or stop), only logging\n", action);
+    return 1;
+}
+
+//
+// what the system says about a cpu (-1 when it does not say)
+//
+
+static long watchdog_read_number(const char *file_name) {
+    FILE *fp = fopen(file_name, "r");
+    long value = -1;
+
+    if (fp != NULL) {
+        if (fscanf(fp, "%ld", &value) != 1)
+            value = -1;
+        fclose(fp);
+    }
+    return value;
+}
+
+// The cpu a thread last ran on (field 39 of /proc/self/task/<tid>/stat)
+static int watchdog_thread_cpu(u32_t tid) {
+    char file_name[64], line[1024], *p, *save;
+    int field, cpu = -1;
+    FILE *fp;
+
+    snprintf(file_name, sizeof(file_name), "/proc/self/task/%u/stat", tid);
+    if (tid == 0u || (fp = fopen(file_name, "r")) == NULL)
+        return -1;
+    if (fgets(line, sizeof(line), fp) != NULL && (p = strrchr(line, ')')) != NULL) {
+        for (field = 3, p = strtok_r(p + 1, " ", &save); p != NULL && field < 39; field++) // the first field after the name is 3
+            p = strtok_r(NULL, " ", &save);
+        if (p != NULL)
+            cpu = atoi(p);
+    }
+    fclose(fp);
+    return cpu;
+}
+
+// Current frequency of a cpu in MHz (cpufreq, or the "cpu MHz" line of /proc/cpuinfo)
+static long watchdog_cpu_mhz(int cpu) {
+    char file_name[96], line[256];
+    long khz;
+    int current = -1;
+    double mhz;
+    FILE *fp;
+
+    if (cpu < 0)
+        return -1;
+    snprintf(file_name, sizeof(file_name), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpu);
+    if ((khz = watchdog_read_number(file_name)) > 0)
+        return khz / 1000;
+    if ((fp = fopen("/proc/cpuinfo", "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "processor : %d", &current) == 1)
+            continue;
+        if (current == cpu && sscanf(line, "cpu MHz : %lf", &mhz) == 1) {
+            fclose(fp);
+            return (long)mhz;
+        }
+    }
+    fclose(fp);
+    return -1;
+}
+
+static long watchdog_throttle_count(int cpu) {
+    char file_name[96];
+
+    if (cpu < 0)
+        return -1;
+    snprintf(file_name, sizeof(file_name), "/sys/devices/system/cpu/cpu%d/thermal_throttle/core_throttle_count", cpu);
+    return watchdog_read_number(file_name);
+}
+
+// Hottest thermal zone, in degrees Celsius
+static long watchdog_max_temperature(void) {
+    char file_name[64];
+    long t, max_t = -1;
+
+    for (int zone = 0; zone < 64; zone++) {
+        snprintf(file_name, sizeof(file_name), "/sys/class/thermal/thermal_zone%d/temp", zone);
+        if ((t = watchdog_read_number(file_name)) < 0) {
+            if (zone > 0)
+                break;
+            continue;
+        }
+        if (t / 1000 > max_t)
+            max_t = t / 1000;
+    }
+    return max_t;
+}
+
+static int watchdog_compare_rates(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void watchdog_event(FILE *fp, double t, const char *event, int thread, double rate, double baseline, double peers, u32_t tid) {
+    int cpu = (thread >= 0) ? watchdog_thread_cpu(tid) : -1;
+
+    fprintf(fp, "{\"t\":%.3f,\"watchdog\":\"%s\"", t, event);
+    if (thread >= 0)
+        fprintf(fp, ",\"thread\":%d", thread);
+    fprintf(fp, ",\"rate\":%.0f,\"baseline\":%.0f", rate, baseline);
+    if (thread >= 0)
+        fprintf(fp, ",\"peers\":%.0f,\"cpu\":%d,\"mhz\":%ld,\"throttle_count\":%ld", peers, cpu, watchdog_cpu_mhz(cpu),
+                watchdog_throttle_count(cpu));
+    else
+        fprintf(fp, ",\"mhz\":%ld", watchdog_cpu_mhz(0));
+    fprintf(fp, ",\"temperature\":%ld%s}\n", watchdog_max_temperature(), watchdog.stop_on_event ? ",\"action\":\"stop\"" : "");
+    fflush(fp);
+    if (watchdog.stop_on_event && strcmp(event, "recovered") != 0 && strcmp(event, "host_recovered") != 0)
+        stop_request = 1;
+}
+
+// rates: attempts per second of each thread in the last interval; attempts: since the start; tids: thread ids
+static void watchdog_check(FILE *fp, double t, const double *rates, const u64_t *attempts, const u32_t *tids, u32_t n_threads) {
+    double sorted[WATCHDOG_MAX_THREADS], peers, total = 0.0;
+    u32_t i;
+
+    if (!watchdog.enabled || n_threads == 0u || t <= 0.0)
+        return;
+    if (n_threads > WATCHDOG_MAX_THREADS)
+        n_threads = WATCHDOG_MAX_THREADS;
+    for (i = 0u; i < n_threads; i++)
+        total += rates[i];
+    if (!watchdog.have_baseline) {
+        if (t < watchdog.warmup)
+            return;
+        watchdog.total_baseline = 0.0;
+        for (i = 0u; i < n_threads; i++) {
+            watchdog.baseline[i] = (double)attempts[i] / t;
+            watchdog.total_baseline += watchdog.baseline[i];
+        }
+        watchdog.have_baseline = 1;
+        fprintf(fp, "{\"t\":%.3f,\"watchdog\":\"baseline\",\"rate\":%.0f,\"fraction\":%.2f,\"mhz\":%ld,\"temperature\":%ld}\n", t,
+                watchdog.total_baseline, watchdog.fraction, watchdog_cpu_mhz(0), watchdog_max_temperature());
+        fflush(fp);
+        return;
+    }
+    memcpy(sorted, rates, n_threads * sizeof(double));
+    qsort(sorted, n_threads, sizeof(double), watchdog_compare_rates);
+    peers = (n_threads % 2u) ? sorted[n_threads / 2u] : 0.5 * (sorted[n_threads / 2u - 1u] + sorted[n_threads / 2u]);
+    for (i = 0u; i < n_threads; i++) {
+        int state = (rates[i] == 0.0) ? 2 :
+                    (rates[i] < watchdog.fraction * watchdog.baseline[i] || rates[i] < watchdog.fraction * peers) ? 1 : 0;
+        if (state == watchdog.state[i])
+            continue;
+        watchdog_event(fp, t, (state == 2) ? "stalled" : (state == 1) ? "slow" : "recovered", (int)i, rates[i], watchdog.baseline[i],
+                       peers, tids[i]);
+        watchdog.state[i] = state;
+    }
+    if ((total < watchdog.fraction * watchdog.total_baseline) != watchdog.host_slow) {
+        watchdog.host_slow = !watchdog.host_slow;
+        watchdog_event(fp, t, watchdog.host_slow ? "host_slow" : "host_recovered", -1, total, watchdog.total_baseline, 0.0, 0u);
+    }
+}
+
+#endif